@@ -13,9 +13,10 @@ from gi.repository import Gtk
 
 VID = 0xCAFE
 PID = 0xBADA
-CONFIG_SIZE = 26
+CONFIG_SIZE = 60
 REPORT_ID = 3
-CONFIG_VERSION = 1
+CONFIG_VERSION = 6
+MAX_CPI = 12000
 PICTURE_FILENAME = os.path.join(os.path.dirname(__file__), "trackball.png")
 
 SENSOR_FUNCTIONS = (
@@ -62,12 +63,68 @@ def make_dropdown(model):
     return dropdown
 
 
-def make_scale():
-    scale = Gtk.Scale.new_with_range(Gtk.Orientation.HORIZONTAL, 1, 120, 1)
+def make_scale(max_value=120):
+    scale = Gtk.Scale.new_with_range(Gtk.Orientation.HORIZONTAL, 1, max_value, 1)
     scale.connect("format-value", lambda _, value: str(int(value) * 100))
     return scale
 
 
+# the sensors can only do multiples of 100, finer steps only work with a native CPI
+def make_cpi_scale():
+    scale = Gtk.Scale.new_with_range(Gtk.Orientation.HORIZONTAL, 50, MAX_CPI, 50)
+    scale.connect("format-value", lambda _, value: str(int(value)))
+    return scale
+
+
+def make_native_cpi_scale():
+    scale = Gtk.Scale.new_with_range(Gtk.Orientation.HORIZONTAL, 0, MAX_CPI // 100, 1)
+    scale.connect(
+        "format-value", lambda _, value: str(int(value) * 100) if value else "Off"
+    )
+    return scale
+
+
+# off by default, the firmware's default without the MOTION pins
+def make_idle_after_scale():
+    scale = Gtk.Scale.new_with_range(Gtk.Orientation.HORIZONTAL, 0, 5000, 50)
+    scale.connect(
+        "format-value", lambda _, value: f"{int(value)} ms" if value else "Off"
+    )
+    scale.set_value(0)
+    return scale
+
+
+def make_idle_interval_scale():
+    scale = Gtk.Scale.new_with_range(Gtk.Orientation.HORIZONTAL, 1, 100, 1)
+    scale.connect("format-value", lambda _, value: f"every {int(value)} ms")
+    scale.set_value(8)
+    return scale
+
+
+# how long the ball has to be still, in tenths of a second in the config
+def make_rest_after_scale(min_seconds, max_seconds, step):
+    scale = Gtk.Scale.new_with_range(
+        Gtk.Orientation.HORIZONTAL, min_seconds, max_seconds, step
+    )
+    scale.connect(
+        "format-value", lambda _, value: f"{value:g} s" if value else "Off"
+    )
+    return scale
+
+
+def make_rest_period_scale(max_ms):
+    scale = Gtk.Scale.new_with_range(Gtk.Orientation.HORIZONTAL, 1, max_ms, 1)
+    scale.connect("format-value", lambda _, value: f"{int(value)} ms")
+    return scale
+
+
+# where a sensor is on the ball
+def make_angle_spin_button(min_degrees, max_degrees, tooltip):
+    spin_button = Gtk.SpinButton.new_with_range(min_degrees, max_degrees, 1)
+    spin_button.set_tooltip_text(tooltip)
+    return spin_button
+
+
 class TrackballConfigWindow(Gtk.Window):
     def __init__(self):
         sensor_function_model = make_model(SENSOR_FUNCTIONS)
@@ -121,9 +178,9 @@ class TrackballConfigWindow(Gtk.Window):
         grid.attach(self.sensor1_y_shifted_dropdown, 2, row, 1, 1)
         row += 1
         grid.attach(Gtk.Label("Sensor 1 CPI", halign=Gtk.Align.END), 0, row, 1, 1)
-        self.sensor1_cpi = make_scale()
+        self.sensor1_cpi = make_cpi_scale()
         grid.attach(self.sensor1_cpi, 1, row, 1, 1)
-        self.sensor1_cpi_shifted = make_scale()
+        self.sensor1_cpi_shifted = make_cpi_scale()
         grid.attach(self.sensor1_cpi_shifted, 2, row, 1, 1)
         row += 1
         grid.attach(Gtk.Label("Sensor 2 X axis", halign=Gtk.Align.END), 0, row, 1, 1)
@@ -139,9 +196,9 @@ class TrackballConfigWindow(Gtk.Window):
         grid.attach(self.sensor2_y_shifted_dropdown, 2, row, 1, 1)
         row += 1
         grid.attach(Gtk.Label("Sensor 2 CPI", halign=Gtk.Align.END), 0, row, 1, 1)
-        self.sensor2_cpi = make_scale()
+        self.sensor2_cpi = make_cpi_scale()
         grid.attach(self.sensor2_cpi, 1, row, 1, 1)
-        self.sensor2_cpi_shifted = make_scale()
+        self.sensor2_cpi_shifted = make_cpi_scale()
         grid.attach(self.sensor2_cpi_shifted, 2, row, 1, 1)
         row += 1
         grid.attach(Gtk.Label("Button 1", halign=Gtk.Align.END), 0, row, 1, 1)
@@ -167,6 +224,83 @@ class TrackballConfigWindow(Gtk.Window):
         grid.attach(self.button4_dropdown, 1, row, 1, 1)
         self.button4_shifted_dropdown = make_dropdown(button_function_model)
         grid.attach(self.button4_shifted_dropdown, 2, row, 1, 1)
+        row += 1
+        grid.attach(Gtk.Label("Samples per second", halign=Gtk.Align.END), 0, row, 1, 1)
+        self.sample_rate = make_scale(80)
+        grid.attach(self.sample_rate, 1, row, 2, 1)
+        row += 1
+        grid.attach(
+            Gtk.Label("Sample less when still", halign=Gtk.Align.END), 0, row, 1, 1
+        )
+        self.idle_after = make_idle_after_scale()
+        self.idle_after.set_tooltip_text(
+            "Read the sensors less and less often once the ball has been still "
+            "for this long, down to the rate on the right. Without the sensors' "
+            "MOTION pins connected, motion can be picked up that much later"
+        )
+        grid.attach(self.idle_after, 1, row, 1, 1)
+        self.idle_interval = make_idle_interval_scale()
+        grid.attach(self.idle_interval, 2, row, 1, 1)
+        row += 1
+        grid.attach(Gtk.Label("Native CPI", halign=Gtk.Align.END), 0, row, 1, 1)
+        self.native_cpi = make_native_cpi_scale()
+        self.native_cpi.set_tooltip_text(
+            "Keep the sensors at this CPI and scale to the CPIs above in software, "
+            "so that shift switches them instantly"
+        )
+        grid.attach(self.native_cpi, 1, row, 2, 1)
+        row += 1
+        grid.attach(Gtk.Label("Still for", halign=Gtk.Align.CENTER), 1, row, 1, 1)
+        grid.attach(Gtk.Label("Frame every", halign=Gtk.Align.CENTER), 2, row, 1, 1)
+        self.rest_after = [
+            make_rest_after_scale(0, 2.5, 0.1),
+            make_rest_after_scale(1, 300, 1),
+            make_rest_after_scale(10, 6500, 10),
+        ]
+        self.rest_period = [
+            make_rest_period_scale(20),
+            make_rest_period_scale(500),
+            make_rest_period_scale(1000),
+        ]
+        self.rest_after[0].set_tooltip_text(
+            "Let the sensors save power when the ball has been still for a while, "
+            "at the cost of noticing it move again a little later"
+        )
+        for i in range(3):
+            row += 1
+            grid.attach(
+                Gtk.Label(f"Sensor rest {i + 1}", halign=Gtk.Align.END), 0, row, 1, 1
+            )
+            grid.attach(self.rest_after[i], 1, row, 1, 1)
+            grid.attach(self.rest_period[i], 2, row, 1, 1)
+        self.sensor_mount = []
+        for i in range(2):
+            row += 1
+            grid.attach(
+                Gtk.Label(f"Sensor {i + 1} position", halign=Gtk.Align.END),
+                0,
+                row,
+                1,
+                1,
+            )
+            spin_buttons = [
+                make_angle_spin_button(
+                    0, 180, "Degrees up from right under the ball, 90 is on its side"
+                ),
+                make_angle_spin_button(
+                    -180,
+                    180,
+                    "Degrees around from the right, counterclockwise seen from above",
+                ),
+                make_angle_spin_button(
+                    -180, 180, "Degrees the sensor is turned about its own axis"
+                ),
+            ]
+            mount_hbox = Gtk.Box(spacing=6)
+            for spin_button in spin_buttons:
+                mount_hbox.pack_start(spin_button, True, True, 0)
+            grid.attach(mount_hbox, 1, row, 2, 1)
+            self.sensor_mount.append(spin_buttons)
 
         vbox.pack_start(grid, True, True, 0)
 
@@ -250,8 +384,24 @@ class TrackballConfigWindow(Gtk.Window):
             button2_shifted,
             button3_shifted,
             button4_shifted,
+            sample_rate,
+            native_cpi,
+            rest1_after,
+            rest2_after,
+            rest3_after,
+            rest1_period,
+            rest2_period,
+            rest3_period,
+            idle_after,
+            idle_interval,
+            sensor1_elevation,
+            sensor2_elevation,
+            sensor1_azimuth,
+            sensor2_azimuth,
+            sensor1_rotation,
+            sensor2_rotation,
             crc32,
-        ) = struct.unpack("<BBb4b4b2B2B4b4bL", data)
+        ) = struct.unpack("<BBb4b4b2H2H4b4bBH3H3HHB6hL", data)
         self.sensor1_x_dropdown.set_active_id(str(sensor1_x))
         self.sensor1_x_shifted_dropdown.set_active_id(str(sensor1_x_shifted))
         self.sensor1_y_dropdown.set_active_id(str(sensor1_y))
@@ -272,6 +422,27 @@ class TrackballConfigWindow(Gtk.Window):
         self.sensor1_cpi_shifted.set_value(sensor1_cpi_shifted)
         self.sensor2_cpi.set_value(sensor2_cpi)
         self.sensor2_cpi_shifted.set_value(sensor2_cpi_shifted)
+        self.sample_rate.set_value(sample_rate)
+        self.native_cpi.set_value(native_cpi // 100)
+        self.idle_after.set_value(idle_after)
+        self.idle_interval.set_value(idle_interval)
+        for i, (after, period) in enumerate(
+            zip(
+                (rest1_after, rest2_after, rest3_after),
+                (rest1_period, rest2_period, rest3_period),
+            )
+        ):
+            self.rest_after[i].set_value(after / 10)
+            self.rest_period[i].set_value(period)
+        for spin_buttons, angles in zip(
+            self.sensor_mount,
+            (
+                (sensor1_elevation, sensor1_azimuth, sensor1_rotation),
+                (sensor2_elevation, sensor2_azimuth, sensor2_rotation),
+            ),
+        ):
+            for spin_button, angle in zip(spin_buttons, angles):
+                spin_button.set_value(angle)
 
     def save_button_clicked(self, button):
         self.wrap_exception_in_dialog(self.save_config_to_device)
@@ -298,9 +469,21 @@ class TrackballConfigWindow(Gtk.Window):
         sensor1_cpi_shifted = int(self.sensor1_cpi_shifted.get_value())
         sensor2_cpi = int(self.sensor2_cpi.get_value())
         sensor2_cpi_shifted = int(self.sensor2_cpi_shifted.get_value())
+        sample_rate = int(self.sample_rate.get_value())
+        native_cpi = int(self.native_cpi.get_value()) * 100
+        rest_after = [round(scale.get_value() * 10) for scale in self.rest_after]
+        rest_period = [int(scale.get_value()) for scale in self.rest_period]
+        idle_after = int(self.idle_after.get_value())
+        idle_interval = int(self.idle_interval.get_value())
+        # elevations, then azimuths, then rotations
+        mount = [
+            int(spin_buttons[i].get_value())
+            for i in range(3)
+            for spin_buttons in self.sensor_mount
+        ]
 
         data = struct.pack(
-            "<BBb4b4b2B2B4b4b",
+            "<BBb4b4b2H2H4b4bBH3H3HHB6h",
             REPORT_ID,
             CONFIG_VERSION,
             command,
@@ -324,6 +507,13 @@ class TrackballConfigWindow(Gtk.Window):
             button2_shifted,
             button3_shifted,
             button4_shifted,
+            sample_rate,
+            native_cpi,
+            *rest_after,
+            *rest_period,
+            idle_after,
+            idle_interval,
+            *mount,
         )
         crc32 = binascii.crc32(data[1:])
         crc_bytes = struct.pack("<L", crc32)
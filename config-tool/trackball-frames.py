@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+
+# Captures raw images from one of the trackball's sensors and saves them as
+# PGM files, for checking the lens and the ball surface. See
+# firmware/src/frame.h for the format.
+#
+# usage: trackball-frames.py sensor output-prefix [frames]
+#
+# Captures as fast as the sensor allows until interrupted with Ctrl-C or until
+# the given number of frames has been saved, to output-prefix-0000.pgm and
+# so on. The trackball doesn't track while it's capturing. Frames come over
+# the bulk stream if the firmware has one (see trackball-stream.py, this
+# needs PyUSB), otherwise over feature reports, which is a lot slower.
+
+import sys
+import struct
+import time
+import hid
+
+try:
+    import usb.core
+    import usb.util
+except ImportError:
+    usb = None
+
+VID = 0xCAFE
+PID = 0xBADA
+NSENSORS = 2
+FRAME_WIDTH = 36
+FRAME_SIZE = FRAME_WIDTH * FRAME_WIDTH
+FRAME_REPORT_ID = 6
+FRAME_REPORT_SIZE = 62
+FRAME_CHUNK_SIZE = FRAME_REPORT_SIZE - 4
+FRAME_NO_CHUNK = 0xFF
+FRAME_STOP = 0
+FRAME_START = 1
+STREAM_SYNC = 0xA5
+STREAM_COMMAND_START = 1
+STREAM_COMMAND_STOP = 2
+HEADER_SIZE = 4
+READ_SIZE = 4096
+READ_TIMEOUT_MS = 100
+
+
+def stream_frames(sensor):
+    return 1 << (2 + sensor)
+
+
+class HidFrames:
+    def __init__(self, sensor):
+        devices = [
+            d
+            for d in hid.enumerate()
+            if d["vendor_id"] == VID and d["product_id"] == PID
+        ]
+        if not devices:
+            sys.exit("No devices found")
+        self.device = hid.Device(path=devices[0]["path"])
+        self.sensor = sensor
+        self.frame = bytearray(FRAME_SIZE)
+        self.number = None
+
+    def send(self, command, sensor=0):
+        self.device.send_feature_report(
+            struct.pack("<BBB", FRAME_REPORT_ID, command, sensor)
+            + bytes(FRAME_REPORT_SIZE - 2)
+        )
+
+    def start(self):
+        self.send(FRAME_START, self.sensor)
+
+    def stop(self):
+        self.send(FRAME_STOP)
+
+    # returns a complete frame or None
+    def read(self):
+        data = self.device.get_feature_report(FRAME_REPORT_ID, FRAME_REPORT_SIZE + 1)
+        number, chunk = data[1], data[2]
+        if chunk == FRAME_NO_CHUNK:
+            time.sleep(0.001)
+            return None
+        offset = chunk * FRAME_CHUNK_SIZE
+        length = min(FRAME_CHUNK_SIZE, FRAME_SIZE - offset)
+        self.frame[offset : offset + length] = data[5 : 5 + length]
+        if offset + length == FRAME_SIZE:
+            return bytes(self.frame)
+        return None
+
+
+class StreamFrames:
+    def __init__(self, device, interface, sensor):
+        self.device = device
+        usb.util.claim_interface(device, interface)
+        self.ep_out = usb.util.find_descriptor(
+            interface,
+            custom_match=lambda e: usb.util.endpoint_direction(e.bEndpointAddress)
+            == usb.util.ENDPOINT_OUT,
+        )
+        self.ep_in = usb.util.find_descriptor(
+            interface,
+            custom_match=lambda e: usb.util.endpoint_direction(e.bEndpointAddress)
+            == usb.util.ENDPOINT_IN,
+        )
+        self.sensor = sensor
+        self.buffer = bytearray()
+        self.frame = bytearray(FRAME_SIZE)
+
+    def start(self):
+        self.ep_out.write(bytes([STREAM_COMMAND_START, stream_frames(self.sensor)]))
+
+    def stop(self):
+        self.ep_out.write(bytes([STREAM_COMMAND_STOP, stream_frames(self.sensor)]))
+
+    # returns a complete frame or None
+    def read(self):
+        try:
+            self.buffer += self.ep_in.read(READ_SIZE, READ_TIMEOUT_MS)
+        except usb.core.USBTimeoutError:
+            pass
+        frame = None
+        while len(self.buffer) >= HEADER_SIZE:
+            if self.buffer[0] != STREAM_SYNC:
+                del self.buffer[0]
+                continue
+            _, packet_type, length = struct.unpack("<BBH", self.buffer[:HEADER_SIZE])
+            if len(self.buffer) < HEADER_SIZE + length:
+                break
+            payload = self.buffer[HEADER_SIZE : HEADER_SIZE + length]
+            del self.buffer[: HEADER_SIZE + length]
+            if packet_type != stream_frames(self.sensor):
+                continue
+            (offset,) = struct.unpack("<H", payload[2:4])
+            data = payload[4:]
+            self.frame[offset : offset + len(data)] = data
+            if offset + len(data) == FRAME_SIZE:
+                frame = bytes(self.frame)
+        return frame
+
+
+def open_frames(sensor):
+    if usb is not None:
+        device = usb.core.find(idVendor=VID, idProduct=PID)
+        if device is not None:
+            interface = usb.util.find_descriptor(
+                device.get_active_configuration(),
+                bInterfaceClass=usb.CLASS_VENDOR_SPEC,
+            )
+            if interface is not None:
+                print("Reading frames over the bulk stream")
+                return StreamFrames(device, interface, sensor)
+    print("Reading frames over feature reports")
+    return HidFrames(sensor)
+
+
+def main():
+    if len(sys.argv) not in (3, 4) or sys.argv[1] not in ("0", "1"):
+        sys.exit(f"usage: {sys.argv[0]} sensor output-prefix [frames]")
+    sensor = int(sys.argv[1])
+    prefix = sys.argv[2]
+    count = int(sys.argv[3]) if len(sys.argv) == 4 else None
+
+    frames = open_frames(sensor)
+    frames.start()
+    start = time.monotonic()
+    saved = 0
+    print("Capturing, press Ctrl-C to stop")
+    try:
+        while count is None or saved < count:
+            frame = frames.read()
+            if frame is None:
+                continue
+            filename = f"{prefix}-{saved:04d}.pgm"
+            with open(filename, "wb") as f:
+                f.write(f"P5\n{FRAME_WIDTH} {FRAME_WIDTH}\n255\n".encode())
+                f.write(frame)
+            print(
+                f"{filename}: min {min(frame)} max {max(frame)} "
+                f"average {sum(frame) / FRAME_SIZE:.1f}"
+            )
+            saved += 1
+    except KeyboardInterrupt:
+        pass
+    frames.stop()
+
+    seconds = time.monotonic() - start
+    print(f"{saved} frames in {seconds:.1f} seconds ({saved / seconds:.1f} per second)")
+
+
+if __name__ == "__main__":
+    main()
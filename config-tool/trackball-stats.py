@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+
+# Prints the runtime statistics the trackball collects: how long each stage
+# of a sample takes, how many samples and reports go out per second, how
+# old the data in the reports is, whether any motion didn't fit and how
+# quickly button presses get to the host. See
+# firmware/src/stats.h for the format.
+#
+# usage: trackball-stats.py [--reset]
+#
+# --reset starts the statistics over (after printing them).
+
+import sys
+import struct
+import binascii
+import hid
+
+VID = 0xCAFE
+PID = 0xBADA
+CONFIG_SIZE = 60
+CONFIG_REPORT_ID = 3
+CONFIG_VERSION = 6
+RESET_STATS = 2
+STATS_REPORT_ID = 5
+STATS_VERSION = 5
+STATS_REPORT_SIZE = 62
+STATS_HISTOGRAM_BUCKETS = 12
+NSTAGES = 4
+
+STAGES = ("sensor read", "mapping", "twist", "report")
+HISTOGRAMS = (
+    [f"{stage} (cycles)" for stage in STAGES]
+    + [
+        "samples per second",
+        "reports per second",
+        "endpoint busy per second",
+        "CPI changes per second",
+        "data age (us)",
+    ]
+)
+
+POWER_STATES = ("run", "rest 1", "rest 2", "rest 3", "suspended")
+
+
+def open_device():
+    devices = [
+        d
+        for d in hid.enumerate()
+        if d["vendor_id"] == VID and d["product_id"] == PID
+    ]
+    if not devices:
+        sys.exit("No devices found")
+    return hid.Device(path=devices[0]["path"])
+
+
+def read_page(device, page):
+    device.send_feature_report(
+        struct.pack("<BB", STATS_REPORT_ID, page) + bytes(STATS_REPORT_SIZE - 1)
+    )
+    data = device.get_feature_report(STATS_REPORT_ID, STATS_REPORT_SIZE + 1)
+    if data[1] != page or data[2] != STATS_VERSION:
+        sys.exit("Unsupported stats version")
+    return data[3], data[4:]
+
+
+def print_summary(data):
+    (
+        time_ms,
+        samples,
+        reports,
+        hid_busy,
+        cpi_changes,
+        *stage_cycles,
+        data_age_average,
+        data_age_min,
+        data_age_max,
+    ) = struct.unpack("<5L4L4L3H", data[:58])
+    seconds = max(time_ms / 1000, 0.001)
+    print(f"{time_ms / 1000:.1f} seconds since reset")
+    print(f"samples: {samples} ({samples / seconds:.0f} per second)")
+    print(f"reports: {reports} ({reports / seconds:.0f} per second)")
+    print(f"endpoint still busy a frame after a report: {hid_busy}")
+    print(f"CPI changes: {cpi_changes}")
+    for i, stage in enumerate(STAGES):
+        print(
+            f"{stage}: {stage_cycles[i]} cycles average, "
+            f"{stage_cycles[NSTAGES + i]} max"
+        )
+    print(
+        f"data age: {data_age_average} us average, "
+        f"{data_age_min} us min, {data_age_max} us max"
+    )
+
+
+def print_motion(data):
+    (
+        sensor_overflows,
+        saturated_samples,
+        carried_reports,
+        carried_max,
+        suppressed_reports,
+    ) = struct.unpack("<5L", data[:20])
+    print(f"sensor readings at the limit: {sensor_overflows}")
+    print(f"samples with motion lost to saturation: {saturated_samples}")
+    print(
+        f"reports with motion carried over: {carried_reports} "
+        f"(at most {carried_max} counts)"
+    )
+    print(f"reports not sent, nothing had changed: {suppressed_reports}")
+
+
+def print_buttons(data):
+    presses, bounces, latency_average, latency_min, latency_max = struct.unpack(
+        "<5L", data[:20]
+    )
+    print(f"button presses: {presses} ({bounces} bounces ignored)")
+    print(
+        f"press latency: {latency_average} us average, "
+        f"{latency_min} us min, {latency_max} us max"
+    )
+
+
+def print_power(data):
+    values = struct.unpack("<5L5L4L", data[:56])
+    state_ms, wakeups = values[:5], values[5:10]
+    remote_wakeups, latency_average, latency_min, latency_max = values[10:]
+    for name, ms, count in zip(POWER_STATES, state_ms, wakeups):
+        print(f"{name}: {ms / 1000:.1f} s ({count} wakeups)")
+    print(f"remote wakeups: {remote_wakeups}")
+    print(
+        f"wake latency: {latency_average} us average, "
+        f"{latency_min} us min, {latency_max} us max"
+    )
+
+
+def print_histogram(name, shift, data):
+    counts = struct.unpack(
+        f"<{STATS_HISTOGRAM_BUCKETS}L", data[: 4 * STATS_HISTOGRAM_BUCKETS]
+    )
+    print(f"{name}:")
+    for i, count in enumerate(counts):
+        if count == 0:
+            continue
+        low = 0 if i == 0 else 1 << (shift + i - 1)
+        if i == STATS_HISTOGRAM_BUCKETS - 1:
+            print(f"  {low:>8} and up: {count}")
+        else:
+            print(f"  {low:>8} - {(1 << (shift + i)) - 1:<8} {count}")
+
+
+def reset_stats(device):
+    config = bytearray(
+        device.get_feature_report(CONFIG_REPORT_ID, CONFIG_SIZE + 1)[1:]
+    )
+    if config[0] != CONFIG_VERSION:
+        sys.exit("Unsupported config version")
+    config[1] = RESET_STATS
+    config[-4:] = struct.pack("<L", binascii.crc32(config[:-4]))
+    device.send_feature_report(bytes([CONFIG_REPORT_ID]) + config)
+
+
+def main():
+    if len(sys.argv) > 2 or (len(sys.argv) == 2 and sys.argv[1] != "--reset"):
+        sys.exit(f"usage: {sys.argv[0]} [--reset]")
+
+    device = open_device()
+
+    _, summary = read_page(device, 0)
+    print_summary(summary)
+    for i, name in enumerate(HISTOGRAMS):
+        shift, data = read_page(device, i + 1)
+        print_histogram(name, shift, data)
+    _, motion = read_page(device, len(HISTOGRAMS) + 1)
+    print_motion(motion)
+    _, buttons = read_page(device, len(HISTOGRAMS) + 2)
+    print_buttons(buttons)
+    shift, data = read_page(device, len(HISTOGRAMS) + 3)
+    print_histogram("press latency (us)", shift, data)
+    _, power = read_page(device, len(HISTOGRAMS) + 4)
+    print_power(power)
+    shift, data = read_page(device, len(HISTOGRAMS) + 5)
+    print_histogram("wake latency (us)", shift, data)
+
+    if len(sys.argv) == 2:
+        reset_stats(device)
+        print("Statistics reset")
+
+
+if __name__ == "__main__":
+    main()
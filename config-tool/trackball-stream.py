@@ -0,0 +1,196 @@
+#!/usr/bin/env python3
+
+# Reads the bulk stream from a trackball built with -DVENDOR_INTERFACE=ON.
+# See firmware/src/stream.h for the format.
+#
+# usage: trackball-stream.py trace output.bin [seconds]
+#        trackball-stream.py stats [seconds]
+#
+# "trace" records a motion trace like trackball-trace.py does, but without
+# polling feature reports, so it keeps up with high sample rates. "stats"
+# prints the stats summary ten times per second. Both run until interrupted
+# with Ctrl-C (or until the given number of seconds has passed).
+#
+# On Linux the user needs access to the USB device, for example with a udev
+# rule like this one in /etc/udev/rules.d/50-trackball.rules:
+#   SUBSYSTEM=="usb", ATTRS{idVendor}=="cafe", ATTRS{idProduct}=="bada", MODE="0660", TAG+="uaccess"
+
+import sys
+import struct
+import time
+import hid
+import usb.core
+import usb.util
+
+VID = 0xCAFE
+PID = 0xBADA
+CONFIG_SIZE = 60
+CONFIG_REPORT_ID = 3
+CONFIG_VERSION = 6
+RESOLUTION_MULTIPLIER_REPORT_ID = 2
+TRACE_MAGIC = 0x52544254
+TRACE_VERSION = 6
+NSENSORS = 2
+RECORD_SIZE = 4 + 1 + NSENSORS * 2 * 2
+STREAM_SYNC = 0xA5
+STREAM_COMMAND_START = 1
+STREAM_COMMAND_STOP = 2
+STREAM_TRACE = 1 << 0
+STREAM_STATS = 1 << 1
+HEADER_SIZE = 4
+READ_SIZE = 4096
+READ_TIMEOUT_MS = 100
+
+
+class Stream:
+    def __init__(self):
+        self.device = usb.core.find(idVendor=VID, idProduct=PID)
+        if self.device is None:
+            sys.exit("No devices found")
+        interface = usb.util.find_descriptor(
+            self.device.get_active_configuration(),
+            bInterfaceClass=usb.CLASS_VENDOR_SPEC,
+        )
+        if interface is None:
+            sys.exit(
+                "No vendor interface, build the firmware with -DVENDOR_INTERFACE=ON"
+            )
+        usb.util.claim_interface(self.device, interface)
+        self.ep_out = usb.util.find_descriptor(
+            interface,
+            custom_match=lambda e: usb.util.endpoint_direction(e.bEndpointAddress)
+            == usb.util.ENDPOINT_OUT,
+        )
+        self.ep_in = usb.util.find_descriptor(
+            interface,
+            custom_match=lambda e: usb.util.endpoint_direction(e.bEndpointAddress)
+            == usb.util.ENDPOINT_IN,
+        )
+        self.buffer = bytearray()
+
+    def command(self, command, mask):
+        self.ep_out.write(bytes([command, mask]))
+
+    # returns a list of (type, payload), possibly empty
+    def read_packets(self):
+        try:
+            self.buffer += self.ep_in.read(READ_SIZE, READ_TIMEOUT_MS)
+        except usb.core.USBTimeoutError:
+            pass
+        packets = []
+        while len(self.buffer) >= HEADER_SIZE:
+            if self.buffer[0] != STREAM_SYNC:
+                # shouldn't happen, resynchronize
+                del self.buffer[0]
+                continue
+            _, packet_type, length = struct.unpack("<BBH", self.buffer[:HEADER_SIZE])
+            if len(self.buffer) < HEADER_SIZE + length:
+                break
+            packets.append(
+                (packet_type, bytes(self.buffer[HEADER_SIZE : HEADER_SIZE + length]))
+            )
+            del self.buffer[: HEADER_SIZE + length]
+        return packets
+
+
+def read_trace_header():
+    devices = [
+        d
+        for d in hid.enumerate()
+        if d["vendor_id"] == VID and d["product_id"] == PID
+    ]
+    if not devices:
+        sys.exit("No devices found")
+    device = hid.Device(path=devices[0]["path"])
+    config = device.get_feature_report(CONFIG_REPORT_ID, CONFIG_SIZE + 1)[1:]
+    if config[0] != CONFIG_VERSION:
+        sys.exit("Unsupported config version")
+    resolution_multiplier = device.get_feature_report(
+        RESOLUTION_MULTIPLIER_REPORT_ID, 2
+    )[1]
+    device.close()
+    return (
+        struct.pack(
+            "<LBBBB", TRACE_MAGIC, TRACE_VERSION, NSENSORS, resolution_multiplier, 0
+        )
+        + config
+    )
+
+
+def record_trace(filename, duration):
+    header = read_trace_header()
+    stream = Stream()
+    records = 0
+    dropped = 0
+    with open(filename, "wb") as f:
+        f.write(header)
+        stream.command(STREAM_COMMAND_START, STREAM_TRACE)
+        start = time.monotonic()
+        print("Recording, press Ctrl-C to stop")
+        try:
+            while duration is None or time.monotonic() - start < duration:
+                for packet_type, payload in stream.read_packets():
+                    if packet_type != STREAM_TRACE:
+                        continue
+                    (dropped,) = struct.unpack("<L", payload[:4])
+                    f.write(payload[4:])
+                    records += (len(payload) - 4) // RECORD_SIZE
+        except KeyboardInterrupt:
+            pass
+        stream.command(STREAM_COMMAND_STOP, STREAM_TRACE)
+
+    print(f"{records} records written to {filename}")
+    if dropped:
+        print(
+            f"{dropped} records were dropped because they weren't read fast "
+            "enough, the trace has gaps"
+        )
+
+
+def print_stats(duration):
+    stream = Stream()
+    stream.command(STREAM_COMMAND_START, STREAM_STATS)
+    start = time.monotonic()
+    try:
+        while duration is None or time.monotonic() - start < duration:
+            for packet_type, payload in stream.read_packets():
+                if packet_type != STREAM_STATS:
+                    continue
+                (
+                    time_ms,
+                    samples,
+                    reports,
+                    hid_busy,
+                    cpi_changes,
+                    *stage_cycles,
+                    data_age_average,
+                    data_age_min,
+                    data_age_max,
+                ) = struct.unpack("<5L4L4L3H", payload[:58])
+                print(
+                    f"{time_ms / 1000:8.1f}s samples {samples} reports {reports} "
+                    f"busy {hid_busy} cpi changes {cpi_changes} "
+                    f"cycles {'/'.join(str(c) for c in stage_cycles[:4])} "
+                    f"data age {data_age_average}/{data_age_min}/{data_age_max} us"
+                )
+    except KeyboardInterrupt:
+        pass
+    stream.command(STREAM_COMMAND_STOP, STREAM_STATS)
+
+
+def main():
+    if len(sys.argv) in (3, 4) and sys.argv[1] == "trace":
+        duration = float(sys.argv[3]) if len(sys.argv) == 4 else None
+        record_trace(sys.argv[2], duration)
+    elif len(sys.argv) in (2, 3) and sys.argv[1] == "stats":
+        duration = float(sys.argv[2]) if len(sys.argv) == 3 else None
+        print_stats(duration)
+    else:
+        sys.exit(
+            f"usage: {sys.argv[0]} trace output.bin [seconds]\n"
+            f"       {sys.argv[0]} stats [seconds]"
+        )
+
+
+if __name__ == "__main__":
+    main()
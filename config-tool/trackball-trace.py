@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+
+# Records a motion trace from the trackball into a file that can be replayed
+# with firmware/host/trace_replay. See firmware/src/trace.h for the format.
+#
+# usage: trackball-trace.py output.bin [seconds]
+#
+# Records until interrupted with Ctrl-C or until the given number of seconds
+# has passed.
+
+import sys
+import struct
+import time
+import hid
+
+VID = 0xCAFE
+PID = 0xBADA
+CONFIG_SIZE = 60
+CONFIG_REPORT_ID = 3
+CONFIG_VERSION = 6
+RESOLUTION_MULTIPLIER_REPORT_ID = 2
+TRACE_REPORT_ID = 4
+TRACE_MAGIC = 0x52544254
+TRACE_VERSION = 6
+NSENSORS = 2
+RECORD_SIZE = 4 + 1 + NSENSORS * 2 * 2
+TRACE_RECORDS_PER_REPORT = 4
+TRACE_REPORT_SIZE = 2 + TRACE_RECORDS_PER_REPORT * RECORD_SIZE
+TRACE_STOP = 0
+TRACE_START = 1
+TRACE_FLAG_DROPPED = 1 << 1
+
+
+def open_device():
+    devices = [
+        d
+        for d in hid.enumerate()
+        if d["vendor_id"] == VID and d["product_id"] == PID
+    ]
+    if not devices:
+        sys.exit("No devices found")
+    return hid.Device(path=devices[0]["path"])
+
+
+def send_trace_command(device, command):
+    data = struct.pack("<BB", TRACE_REPORT_ID, command)
+    data += bytes(TRACE_REPORT_SIZE - 1)
+    device.send_feature_report(data)
+
+
+# returns the records in the report and whether any were dropped before them
+def read_trace_report(device):
+    data = device.get_feature_report(TRACE_REPORT_ID, TRACE_REPORT_SIZE + 1)
+    count = data[1]
+    flags = data[2]
+    return data[3 : 3 + count * RECORD_SIZE], bool(flags & TRACE_FLAG_DROPPED)
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        sys.exit(f"usage: {sys.argv[0]} output.bin [seconds]")
+    duration = float(sys.argv[2]) if len(sys.argv) == 3 else None
+
+    device = open_device()
+
+    config = device.get_feature_report(CONFIG_REPORT_ID, CONFIG_SIZE + 1)[1:]
+    if config[0] != CONFIG_VERSION:
+        sys.exit("Unsupported config version")
+    resolution_multiplier = device.get_feature_report(
+        RESOLUTION_MULTIPLIER_REPORT_ID, 2
+    )[1]
+
+    records = 0
+    dropped = False
+    with open(sys.argv[1], "wb") as f:
+        f.write(
+            struct.pack(
+                "<LBBBB",
+                TRACE_MAGIC,
+                TRACE_VERSION,
+                NSENSORS,
+                resolution_multiplier,
+                0,
+            )
+        )
+        f.write(config)
+
+        send_trace_command(device, TRACE_START)
+        start = time.monotonic()
+        print("Recording, press Ctrl-C to stop")
+        try:
+            while duration is None or time.monotonic() - start < duration:
+                data, d = read_trace_report(device)
+                f.write(data)
+                records += len(data) // RECORD_SIZE
+                dropped |= d
+        except KeyboardInterrupt:
+            pass
+        send_trace_command(device, TRACE_STOP)
+
+        # whatever was recorded before the stop command
+        while True:
+            data, d = read_trace_report(device)
+            dropped |= d
+            if not data:
+                break
+            f.write(data)
+            records += len(data) // RECORD_SIZE
+
+    print(f"{records} records written to {sys.argv[1]}")
+    if dropped:
+        print(
+            "Some records were dropped because they weren't read fast enough, "
+            "the trace has gaps"
+        )
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,254 @@
+// Runs the sample schedule the way core1_main() does over a few minutes of
+// the ball being moved now and then, with adaptive sampling off, on, and on
+// with the sensors' MOTION pins starting a sample (MOTION_INTERRUPT). Prints
+// how often the sensors were read while the ball was still and how long
+// motion took to be picked up.
+//
+// usage: adaptive_sampling [moves]
+//
+// Checks that sampling backs off to the idle interval, that motion brings
+// it straight back to the configured rate, that a held button keeps it
+// there, that no counts went missing, and that with the MOTION pins motion
+// isn't picked up any later than with adaptive sampling off. Exits with
+// status 1 if not.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "crc.h"
+#include "hal_host.h"
+
+// the ball moves a count every this many us while it's moving, and that's
+// when a sensor notices and pulls its MOTION pin low
+#define COUNT_US 200
+
+#define IDLE_AFTER_MS 500
+#define IDLE_INTERVAL_MS 8
+// long enough after IDLE_AFTER_MS for sampling to have backed off all the way
+#define IDLE_US 600000
+
+struct move_t {
+    uint64_t start_us;
+    uint64_t end_us;
+    uint64_t first_count_us;
+    uint64_t moved_before_us;  // in the moves before this one
+};
+
+struct result_t {
+    uint32_t samples;
+    uint32_t still_samples;
+    uint64_t still_us;
+    // once the ball has been still for IDLE_US
+    uint32_t idle_samples;
+    uint64_t idle_us;
+    uint64_t total_latency_us;
+    uint64_t worst_latency_us;
+    uint32_t slow_after_motion;  // picking up motion didn't bring back the configured rate
+    uint32_t slow_while_held;
+    int64_t reported;
+};
+
+static std::vector<move_t> moves;
+static int64_t reported_dx = 0;
+static int failures = 0;
+
+static void add_report(uint8_t report_id, const void* data, uint16_t len) {
+    if (report_id == 1) {
+        reported_dx += ((const hid_report_t*) data)->dx;
+    }
+}
+
+// the last move that started by t, nullptr if none did
+static const move_t* last_move(uint64_t t) {
+    auto next = std::upper_bound(
+        moves.begin(), moves.end(), t, [](uint64_t t, const move_t& move) { return t < move.start_us; });
+    return next == moves.begin() ? nullptr : &*(next - 1);
+}
+
+// how long the ball has been moving by t
+static uint64_t moving_us(uint64_t t) {
+    const move_t* move = last_move(t);
+    if (move == nullptr) {
+        return 0;
+    }
+    return move->moved_before_us + (t < move->end_us ? t : move->end_us) - move->start_us;
+}
+
+static bool moving_at(uint64_t t) {
+    const move_t* move = last_move(t);
+    return move != nullptr && t < move->end_us;
+}
+
+// how long the ball has been still at t, 0 if it's moving
+static uint64_t still_for_us(uint64_t t) {
+    const move_t* move = last_move(t);
+    if (move == nullptr) {
+        return t;
+    }
+    return t < move->end_us ? 0 : t - move->end_us;
+}
+
+// when a MOTION pin goes low after a read at t, UINT64_MAX if never
+static uint64_t motion_pin_low(uint64_t t) {
+    uint64_t counted = moving_us(t) / COUNT_US;
+    const move_t* move = last_move(t);
+    for (size_t i = move == nullptr ? 0 : move - moves.data(); i < moves.size(); i++) {
+        if (moves[i].end_us <= t) {
+            continue;
+        }
+        // the first count after t
+        uint64_t start = moves[i].start_us > t ? moves[i].start_us : t;
+        uint64_t first = start + (counted + 1) * COUNT_US - moving_us(start);
+        if (first < moves[i].end_us) {
+            return first;
+        }
+    }
+    return UINT64_MAX;
+}
+
+static void send_config() {
+    config.crc32 = crc32((const uint8_t*) &config, CONFIG_SIZE - 4);
+    config_t c = config;
+    handle_set_report(3, (const uint8_t*) &c, CONFIG_SIZE);
+}
+
+static result_t run(uint16_t idle_after_ms, bool motion_interrupt, uint64_t end_us, uint64_t hold_us) {
+    reset_state();
+    reported_dx = 0;
+    config.idle_after_ms = idle_after_ms;
+    send_config();
+
+    result_t result = {};
+    uint64_t next_sample_us = 0;
+    uint64_t last_read_us = 0;
+    size_t next_move = 0;
+    uint32_t configured_us = 0;
+    while (next_sample_us < end_us + hold_us) {
+        uint64_t now = next_sample_us;
+        bool by_motion = false;
+        if (motion_interrupt && sample_on_motion()) {
+            uint64_t low = motion_pin_low(last_read_us);
+            if (low < now) {
+                now = low;
+                by_motion = true;
+            }
+        }
+        bool held = now >= end_us;
+        host_set_buttons(held ? 1 : 0);
+        host_set_time_us(now);
+        host_add_motion(0, moving_us(now) / COUNT_US - moving_us(last_read_us) / COUNT_US, 0);
+        sensor_task();
+        hid_task();
+        result.samples++;
+        if (!moving_at(now) && !held) {
+            result.still_samples++;
+            if (still_for_us(now) >= IDLE_US) {
+                result.idle_samples++;
+            }
+        }
+
+        // the first sample with a count of each move
+        bool picked_up = false;
+        while (next_move < moves.size() && now >= moves[next_move].first_count_us) {
+            uint64_t latency = now - moves[next_move].first_count_us;
+            result.total_latency_us += latency;
+            if (latency > result.worst_latency_us) {
+                result.worst_latency_us = latency;
+            }
+            next_move++;
+            picked_up = true;
+        }
+
+        uint32_t interval = sample_interval_us();
+        if (configured_us == 0) {
+            configured_us = interval;
+        }
+        if (picked_up && interval != configured_us) {
+            result.slow_after_motion++;
+        }
+        if (held && interval != configured_us) {
+            result.slow_while_held++;
+        }
+        last_read_us = now;
+        next_sample_us = (by_motion ? now : next_sample_us) + interval;
+    }
+
+    result.still_us = end_us - moving_us(end_us);
+    uint64_t since = 0;
+    for (const move_t& move : moves) {
+        if (move.start_us - since > IDLE_US) {
+            result.idle_us += move.start_us - since - IDLE_US;
+        }
+        since = move.end_us;
+    }
+    result.idle_us += end_us - since - IDLE_US;
+    host_set_buttons(0);
+    result.reported = reported_dx;
+    return result;
+}
+
+static void print(const char* name, const result_t& r, int nmoves) {
+    printf("%s: %u samples\n", name, r.samples);
+    printf("  per second while still: %.1f, after %d ms still: %.1f\n", r.still_samples * 1e6 / r.still_us,
+        IDLE_US / 1000, r.idle_samples * 1e6 / r.idle_us);
+    printf("  motion picked up after %.0f us average, %u us worst\n", (double) r.total_latency_us / nmoves,
+        (unsigned int) r.worst_latency_us);
+}
+
+static void check(bool ok, const char* what) {
+    if (!ok) {
+        printf("%s\n", what);
+        failures++;
+    }
+}
+
+int main(int argc, char** argv) {
+    int nmoves = argc > 1 ? atoi(argv[1]) : 200;
+    srand(1);
+    host_set_report_callback(add_report);
+    config.sensor_function[0][0] = SensorFunction::CURSOR_X;
+    config.idle_interval_ms = IDLE_INTERVAL_MS;
+
+    // still for anything from a moment to a few seconds, then moving for a while
+    uint64_t t = 0;
+    uint64_t moved_us = 0;
+    for (int i = 0; i < nmoves; i++) {
+        t += 10000 + rand() % 3000000 + rand() % 1000;
+        uint64_t duration = COUNT_US + rand() % 500000;
+        moves.push_back({ t, t + duration, 0, moved_us });
+        t += duration;
+        moved_us += duration;
+    }
+    for (move_t& move : moves) {
+        move.first_count_us = motion_pin_low(move.start_us);
+    }
+    uint64_t end_us = t + 1000000;
+    uint64_t hold_us = 1000000;
+    int64_t counts = moving_us(end_us) / COUNT_US;
+
+    result_t off = run(0, false, end_us, hold_us);
+    result_t adaptive = run(IDLE_AFTER_MS, false, end_us, hold_us);
+    result_t pin = run(IDLE_AFTER_MS, true, end_us, hold_us);
+    print("adaptive sampling off", off, nmoves);
+    print("adaptive sampling", adaptive, nmoves);
+    print("adaptive sampling, MOTION pin", pin, nmoves);
+
+    for (const result_t* r : { &off, &adaptive, &pin }) {
+        check(r->reported == counts, "counts went missing");
+        check(r->slow_after_motion == 0, "not back to the configured rate after motion");
+        check(r->slow_while_held == 0, "backed off with a button held");
+    }
+    check(off.idle_samples * 1e6 / off.idle_us > 990, "backed off with adaptive sampling off");
+    for (const result_t* r : { &adaptive, &pin }) {
+        check(r->idle_samples * 1e3 / r->idle_us < 1.01 / IDLE_INTERVAL_MS, "didn't back off to the idle interval");
+    }
+    check(adaptive.worst_latency_us <= IDLE_INTERVAL_MS * 1000, "motion picked up later than the idle interval");
+    // no later than at the configured rate
+    check(pin.worst_latency_us < 1000, "motion picked up late with the MOTION pin");
+
+    printf("%s\n", failures == 0 ? "OK" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,170 @@
+// Runs the button debouncing over simulated clicks with switch bounce: a
+// burst of edges at the start of every press and release, short taps and
+// long holds, and now and then an edge that never makes it to the queue.
+// The state is sampled the way core 1 does, once per sample interval and
+// right away when a press comes in.
+//
+// usage: button_bounce [clicks]
+//
+// Checks that every click comes out as exactly one press, timestamped with
+// its first edge, and one release DEBOUNCE_RELEASE_US after the last edge
+// (give or take a sample interval). Exits with status 1 if not.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "debounce.h"
+
+#define SAMPLE_INTERVAL_US 1000
+#define MAX_BOUNCE_US 3000
+
+struct click_t {
+    uint8_t button;
+    uint32_t press_us;  // first edge
+    uint32_t release_us;  // last edge
+};
+
+static uint32_t random_between(uint32_t min, uint32_t max) {
+    return min + rand() % (max - min + 1);
+}
+
+// a burst of edges ending at the given level
+static void add_bounces(std::vector<button_event_t>& events, uint8_t button, uint32_t start, bool pressed) {
+    int edges = rand() % 3 == 0 ? 0 : 2 * random_between(1, 6);
+    uint32_t t = start;
+    events.push_back({ t, button, pressed });
+    for (int i = 0; i < edges; i++) {
+        t += random_between(20, MAX_BOUNCE_US / 12);
+        events.push_back({ t, button, (i % 2 == 0) ? !pressed : pressed });
+    }
+}
+
+int main(int argc, char** argv) {
+    int nclicks = argc > 1 ? atoi(argv[1]) : 20000;
+    srand(1);
+
+    // each button clicks on its own schedule, all of them mixed together
+    std::vector<click_t> clicks;
+    std::vector<button_event_t> events;
+    uint32_t button_free_us[NBUTTONS] = { 0 };
+    for (int n = 0; n < nclicks; n++) {
+        uint8_t button = rand() % NBUTTONS;
+        click_t click;
+        click.button = button;
+        click.press_us = button_free_us[button] + random_between(20000, 300000);
+        size_t first = events.size();
+        add_bounces(events, button, click.press_us, true);
+        uint32_t hold = rand() % 4 == 0 ? random_between(MAX_BOUNCE_US, 10000) : random_between(30000, 500000);
+        add_bounces(events, button, click.press_us + hold, false);
+        click.release_us = events.back().time_us;
+        for (size_t i = first + 1; i < events.size(); i++) {
+            if (events[i].time_us > click.release_us) {
+                click.release_us = events[i].time_us;
+            }
+        }
+        clicks.push_back(click);
+        button_free_us[button] = click.release_us;
+    }
+    std::stable_sort(events.begin(), events.end(),
+        [](const button_event_t& a, const button_event_t& b) { return a.time_us < b.time_us; });
+
+    debouncer_t d;
+    debounce_init(&d, 0);
+    uint32_t raw = 0;
+    uint32_t state = 0;
+    uint32_t press_count[NBUTTONS] = { 0 };
+    std::vector<uint32_t> press_times[NBUTTONS];
+    std::vector<uint32_t> release_times[NBUTTONS];
+    int lost = 0;
+    uint32_t next_sample = 0;
+    size_t e = 0;
+    uint32_t end = 0;
+    for (const click_t& click : clicks) {
+        if (click.release_us > end) {
+            end = click.release_us;
+        }
+    }
+    end += DEBOUNCE_RELEASE_US + 2 * SAMPLE_INTERVAL_US;
+
+    uint32_t now = 0;
+    while (now < end) {
+        // the next thing to happen: an edge or a regular sample
+        if (e < events.size() && events[e].time_us < next_sample) {
+            now = events[e].time_us;
+            const button_event_t& event = events[e++];
+            raw = event.pressed ? raw | (1 << event.button) : raw & ~(1 << event.button);
+            if (rand() % 200 == 0) {
+                lost++;  // only the pin level knows
+            } else {
+                debounce_event(&d, &event);
+            }
+            // only a press wakes core 1 up
+            if (!d.new_press) {
+                continue;
+            }
+        } else {
+            now = next_sample;
+            next_sample += SAMPLE_INTERVAL_US;
+        }
+
+        uint32_t new_state = debounce_update(&d, now, raw);
+        uint32_t press_us;
+        bool took = debounce_take_press(&d, &press_us);
+        for (int i = 0; i < NBUTTONS; i++) {
+            if ((new_state & ~state) & (1 << i)) {
+                press_count[i]++;
+                press_times[i].push_back(took ? press_us : now);
+            }
+            if ((state & ~new_state) & (1 << i)) {
+                release_times[i].push_back(now);
+            }
+        }
+        state = new_state;
+    }
+
+    int failures = 0;
+    size_t index[NBUTTONS] = { 0 };
+    uint32_t worst_release_error = 0;
+    for (const click_t& click : clicks) {
+        uint8_t b = click.button;
+        size_t i = index[b]++;
+        if (i >= press_times[b].size() || i >= release_times[b].size()) {
+            failures++;
+            continue;
+        }
+        // a lost first edge is picked up by the next sample
+        if (press_times[b][i] != click.press_us &&
+            press_times[b][i] - click.press_us > SAMPLE_INTERVAL_US) {
+            if (failures++ < 10) {
+                printf("button %d pressed at %u, seen at %u\n", b, click.press_us, press_times[b][i]);
+            }
+        }
+        uint32_t expected = click.release_us + DEBOUNCE_RELEASE_US;
+        uint32_t error = release_times[b][i] > expected ? release_times[b][i] - expected : expected - release_times[b][i];
+        if (error > worst_release_error) {
+            worst_release_error = error;
+        }
+        if (release_times[b][i] < expected || error > SAMPLE_INTERVAL_US) {
+            if (failures++ < 10) {
+                printf("button %d released at %u, seen at %u\n", b, click.release_us, release_times[b][i]);
+            }
+        }
+    }
+    uint32_t presses = 0;
+    for (int b = 0; b < NBUTTONS; b++) {
+        presses += press_count[b];
+    }
+    if (presses != clicks.size()) {
+        printf("%u presses for %zu clicks\n", presses, clicks.size());
+        failures++;
+    }
+
+    printf("%zu clicks, %zu edges (%d lost), %u presses, %u bounces ignored\n", clicks.size(), events.size(), lost,
+        presses, d.bounces);
+    printf("releases at most %u us off from %u us after the last edge\n", worst_release_error, DEBOUNCE_RELEASE_US);
+    printf("%s\n", failures == 0 ? "OK" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,120 @@
+// Saves configs through the feature report over and over, the way the config
+// tool does, sometimes several in a row and sometimes cutting the power in
+// the middle of writing one. After each "reboot" the config that comes back
+// has to be the last one that was written completely. Also shows how the
+// erases are spread over the sectors.
+//
+// usage: config_store_stress [saves]
+//
+// Exits with status 1 if a config came back wrong or saves weren't coalesced.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config_store.h"
+#include "crc.h"
+#include "hal_host.h"
+
+static uint64_t time_us = 1000000;
+static config_t defaults;
+
+static void advance(uint64_t us) {
+    time_us += us;
+    host_set_time_us(time_us);
+    config_task();
+}
+
+static config_t make_config(int n) {
+    config_t c = defaults;
+    c.sensor_cpi[0] = 100 + (n % 239) * 50;
+    c.sensor_shifted_cpi[1] = 100 + (n % 113) * 100;
+    c.sample_rate = 1 + n % 80;
+    c.crc32 = crc32((const uint8_t*) &c, CONFIG_SIZE - 4);
+    return c;
+}
+
+static void send(const config_t* c) {
+    handle_set_report(3, (const uint8_t*) c, CONFIG_SIZE);
+}
+
+static uint32_t newest_sequence() {
+    uint32_t newest = 0;
+    for (int offset = 0; offset < CONFIG_STORE_SIZE; offset += CONFIG_STORE_SLOT_SIZE) {
+        const config_record_t* record = (const config_record_t*) (host_flash_store() + offset);
+        if (record->magic == CONFIG_STORE_MAGIC &&
+            crc32((const uint8_t*) record, offsetof(config_record_t, crc32)) == record->crc32 &&
+            record->sequence > newest) {
+            newest = record->sequence;
+        }
+    }
+    return newest;
+}
+
+// what load_config() finds after a restart
+static bool reboot_and_check(const config_t* expected) {
+    config = defaults;
+    load_config();
+    return !memcmp(&config, expected, CONFIG_SIZE);
+}
+
+int main(int argc, char** argv) {
+    int nsaves = argc > 1 ? atoi(argv[1]) : 5000;
+
+    defaults = config;
+    host_set_time_us(time_us);
+    srand(1);
+
+    config_t saved = defaults;  // last one written completely
+    int power_cuts = 0;
+    int failures = 0;
+    for (int n = 0; n < nsaves; n++) {
+        // a few in a row before the delay is up only get written once
+        int burst = (rand() % 10 == 0) ? 2 + rand() % 3 : 1;
+        config_t c;
+        for (int i = 0; i < burst; i++) {
+            c = make_config(n * 7 + i);
+            send(&c);
+            advance(rand() % 100000);
+        }
+
+        bool cut = rand() % 25 == 0;
+        if (cut) {
+            host_flash_cut_power_after(rand() % sizeof(config_record_t));
+        }
+        advance(1000000);
+        if (!cut && newest_sequence() != (uint32_t) (n + 1 - power_cuts)) {
+            printf("save %d: %u complete records, expected %d\n", n, newest_sequence(), n + 1 - power_cuts);
+            failures++;
+        }
+
+        if (cut) {
+            power_cuts++;
+            if (!reboot_and_check(&saved)) {
+                printf("save %d: wrong config after a power cut\n", n);
+                failures++;
+            }
+            continue;
+        }
+        saved = c;
+        if (rand() % 10 == 0 && !reboot_and_check(&saved)) {
+            printf("save %d: wrong config after a restart\n", n);
+            failures++;
+        }
+    }
+
+    if (!reboot_and_check(&saved)) {
+        printf("wrong config at the end\n");
+        failures++;
+    }
+
+    printf("%d saves, %d power cuts, newest record %u\n", nsaves, power_cuts, newest_sequence());
+    printf("erases per sector:");
+    for (int sector = 0; sector < CONFIG_STORE_SECTORS; sector++) {
+        printf(" %u", host_flash_erases(sector));
+    }
+    printf(" (erasing on every save would have been %d)\n", nsaves);
+    printf("%s\n", failures == 0 ? "OK" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
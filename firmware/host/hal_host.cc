@@ -0,0 +1,176 @@
+#include <string.h>
+
+#include "config_store.h"
+#include "hal_host.h"
+
+static uint64_t time_us = 0;
+static uint32_t buttons = 0;
+static uint32_t press_us = 0;
+static sensor_reading_t pending_motion[NSENSORS];
+static unsigned int sensor_cpi[NSENSORS];
+static sensor_rest_t sensor_rest[NSENSORS];
+static uint32_t remote_wakeups = 0;
+static bool hid_ready = true;
+static host_report_callback_t report_callback = nullptr;
+static uint8_t flash[CONFIG_STORE_SIZE];
+static bool flash_initialized = false;
+static uint32_t flash_erases[CONFIG_STORE_SECTORS];
+static int flash_program_limit = -1;
+static bool reset_requested = false;
+
+void host_set_time_us(uint64_t t) {
+    time_us = t;
+}
+
+void host_set_buttons(uint32_t b) {
+    if (b & ~buttons) {
+        press_us = time_us;
+    }
+    buttons = b;
+}
+
+void host_add_motion(int sensor, int16_t dx, int16_t dy) {
+    pending_motion[sensor].movement[0] += dx;
+    pending_motion[sensor].movement[1] += dy;
+    pending_motion[sensor].motion |= dx != 0 || dy != 0;
+}
+
+unsigned int host_sensor_cpi(int sensor) {
+    return sensor_cpi[sensor];
+}
+
+const sensor_rest_t* host_sensor_rest(int sensor) {
+    return &sensor_rest[sensor];
+}
+
+uint32_t host_remote_wakeups() {
+    return remote_wakeups;
+}
+
+void host_set_hid_ready(bool ready) {
+    hid_ready = ready;
+}
+
+void host_set_report_callback(host_report_callback_t callback) {
+    report_callback = callback;
+}
+
+uint8_t* host_flash_store() {
+    if (!flash_initialized) {
+        memset(flash, 0xff, sizeof(flash));
+        flash_initialized = true;
+    }
+    return flash;
+}
+
+uint32_t host_flash_erases(int sector) {
+    return flash_erases[sector];
+}
+
+void host_flash_cut_power_after(int bytes) {
+    flash_program_limit = bytes;
+}
+
+bool host_reset_into_bootloader_requested() {
+    return reset_requested;
+}
+
+uint64_t hal_time_us() {
+    return time_us;
+}
+
+// there's nothing meaningful to count on the host
+uint32_t hal_cycle_count() {
+    return 0;
+}
+
+uint32_t hal_buttons_get() {
+    return buttons;
+}
+
+uint32_t hal_buttons_press_us() {
+    return press_us;
+}
+
+// the buttons set are taken as already debounced
+uint32_t hal_button_bounces() {
+    return 0;
+}
+
+void hal_sensors_read(sensor_reading_t readings[NSENSORS]) {
+    memcpy(readings, pending_motion, sizeof(pending_motion));
+    memset(pending_motion, 0, sizeof(pending_motion));
+}
+
+void hal_sensor_set_cpi(int sensor, unsigned int cpi) {
+    sensor_cpi[sensor] = cpi;
+}
+
+void hal_sensor_set_rest(int sensor, const sensor_rest_t* rest) {
+    sensor_rest[sensor] = *rest;
+}
+
+const uint8_t* hal_flash_store() {
+    return host_flash_store();
+}
+
+void hal_flash_erase(uint32_t offset) {
+    memset(host_flash_store() + offset, 0xff, CONFIG_STORE_SECTOR_SIZE);
+    flash_erases[offset / CONFIG_STORE_SECTOR_SIZE]++;
+}
+
+// like NOR flash, programming only clears bits
+void hal_flash_program(uint32_t offset, const uint8_t* data, uint32_t len) {
+    if (flash_program_limit >= 0 && len > (uint32_t) flash_program_limit) {
+        len = flash_program_limit;
+        flash_program_limit = -1;
+    }
+    uint8_t* store = host_flash_store();
+    for (uint32_t i = 0; i < len; i++) {
+        store[offset + i] &= data[i];
+    }
+}
+
+bool hal_hid_ready(bool urgent) {
+    return hid_ready;
+}
+
+void hal_hid_report(uint8_t report_id, const void* report, uint16_t len) {
+    if (report_callback != nullptr) {
+        report_callback(report_id, report, len);
+    }
+    // reports go out right away here
+    handle_report_complete(report_id);
+}
+
+// the host resumes when the caller says so, with handle_resume()
+void hal_usb_remote_wakeup() {
+    remote_wakeups++;
+}
+
+// no sensors to capture frames from on the host
+void hal_frame_capture(int sensor) {
+}
+
+const uint8_t* hal_frame_get() {
+    return nullptr;
+}
+
+void hal_frame_release() {
+}
+
+// no bulk stream on the host
+uint32_t hal_stream_available() {
+    return 0;
+}
+
+void hal_stream_write(const void* data, uint32_t len) {
+}
+
+uint32_t hal_stream_read(void* data, uint32_t len) {
+    return 0;
+}
+
+void hal_reset_into_bootloader() {
+    reset_requested = true;
+}
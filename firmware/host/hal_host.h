@@ -0,0 +1,43 @@
+#ifndef _HAL_HOST_H_
+#define _HAL_HOST_H_
+
+#include <stdint.h>
+
+#include "hal.h"
+
+// HAL implementation for running the trackball logic on a regular computer.
+// Nothing happens on its own: time only moves when host_set_time_us() is called,
+// sensor motion and buttons are whatever the caller sets and reports are passed
+// to the callback. Call sensor_task() and hid_task() to make the logic run.
+
+typedef void (*host_report_callback_t)(uint8_t report_id, const void* report, uint16_t len);
+
+void host_set_time_us(uint64_t time_us);
+// already debounced, buttons that go down are pressed at the current time
+void host_set_buttons(uint32_t buttons);
+
+// motion is accumulated until the logic reads the sensors
+void host_add_motion(int sensor, int16_t dx, int16_t dy);
+
+// the CPI the logic last set, 0 if it hasn't set any yet
+unsigned int host_sensor_cpi(int sensor);
+// the rest mode settings the logic last set, all zero if it hasn't set any yet
+const sensor_rest_t* host_sensor_rest(int sensor);
+
+// hal_usb_remote_wakeup() calls so far
+uint32_t host_remote_wakeups();
+
+void host_set_hid_ready(bool ready);
+void host_set_report_callback(host_report_callback_t callback);
+
+// the config store's flash, starts out erased
+uint8_t* host_flash_store();
+// how many times a sector of it was erased
+uint32_t host_flash_erases(int sector);
+// the next hal_flash_program() only programs this many bytes, as if the
+// power went out in the middle
+void host_flash_cut_power_after(int bytes);
+
+bool host_reset_into_bootloader_requested();
+
+#endif
@@ -0,0 +1,137 @@
+// Throws the largest motion the sensors can report at the logic, with both
+// sensors moving the cursor together, while the host stops picking up
+// reports for a while every now and then and core 0 falls behind core 1.
+// Checks that the reports add up to exactly the motion the sensors saw and
+// that the sensor overflows were all counted.
+//
+// usage: motion_stress [samples]
+//
+// Exits with status 1 if any counts went missing.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal_host.h"
+#include "stats.h"
+
+static int64_t reported[2] = { 0, 0 };
+static uint32_t nreports = 0;
+
+static void add_report(uint8_t report_id, const void* data, uint16_t len) {
+    if (report_id != 1) {
+        return;
+    }
+    const hid_report_t* report = (const hid_report_t*) data;
+    reported[0] += report->dx;
+    reported[1] += report->dy;
+    nreports++;
+}
+
+static int16_t random_movement(uint32_t* overflows) {
+    switch (rand() % 8) {
+        case 0:
+            (*overflows)++;
+            return (rand() % 2) ? INT16_MAX : INT16_MIN;
+        case 1:
+            return rand() % 201 - 100;
+        default:
+            return rand() % 65533 - 32766;  // below the limits
+    }
+}
+
+static stats_motion_t read_motion_stats() {
+    uint8_t page = STATS_PAGE_MOTION;
+    handle_set_report(STATS_REPORT_ID, &page, 1);
+    uint8_t buffer[STATS_REPORT_SIZE];
+    handle_get_report(STATS_REPORT_ID, buffer, sizeof(buffer));
+    stats_motion_t motion;
+    memcpy(&motion, buffer + 3, sizeof(motion));
+    return motion;
+}
+
+int main(int argc, char** argv) {
+    int nsamples = argc > 1 ? atoi(argv[1]) : 200000;
+
+    for (int sensor = 0; sensor < NSENSORS; sensor++) {
+        config.sensor_function[sensor][0] = SensorFunction::CURSOR_X;
+        config.sensor_function[sensor][1] = sensor == 0 ? SensorFunction::CURSOR_Y : SensorFunction::CURSOR_Y_INVERTED;
+        memcpy(config.sensor_shifted_function[sensor], config.sensor_function[sensor],
+            sizeof(config.sensor_function[sensor]));
+    }
+    reset_state();
+    host_set_report_callback(add_report);
+
+    srand(1);
+    int64_t sensed[2] = { 0, 0 };
+    uint32_t expected_overflows = 0;
+    uint64_t time_us = 1000000;
+    int stall = 0;  // samples left without the host polling
+    int behind = 0;  // samples left without hid_task() running at all
+    for (int n = 0; n < nsamples; n++) {
+        if (stall == 0 && behind == 0) {
+            switch (rand() % 500) {
+                case 0:
+                    stall = rand() % 200;
+                    break;
+                case 1:
+                    behind = rand() % 150;
+                    break;
+            }
+        }
+
+        host_set_time_us(time_us);
+        int16_t movement[NSENSORS][2];
+        for (int sensor = 0; sensor < NSENSORS; sensor++) {
+            for (int axis = 0; axis < 2; axis++) {
+                movement[sensor][axis] = random_movement(&expected_overflows);
+            }
+            host_add_motion(sensor, movement[sensor][0], movement[sensor][1]);
+        }
+        sensor_task();
+        for (int sensor = 0; sensor < NSENSORS; sensor++) {
+            for (int axis = 0; axis < 2; axis++) {
+                // the most negative value is taken as one less, so that it can be inverted
+                int32_t m = movement[sensor][axis] == INT16_MIN ? -INT16_MAX : movement[sensor][axis];
+                sensed[axis] += (axis == 1 && sensor == 1) ? -m : m;
+            }
+        }
+
+        host_set_hid_ready(stall == 0);
+        if (behind == 0) {
+            hid_task();
+        }
+        if (stall > 0) {
+            stall--;
+        }
+        if (behind > 0) {
+            behind--;
+        }
+        time_us += 1000;
+    }
+
+    // let everything that was carried over go out, until there's nothing to send
+    host_set_hid_ready(true);
+    uint32_t reports_before;
+    do {
+        reports_before = nreports;
+        time_us += 1000;
+        host_set_time_us(time_us);
+        sensor_task();
+        hid_task();
+    } while (nreports != reports_before);
+
+    stats_motion_t stats = read_motion_stats();
+    printf("%d samples, %u reports\n", nsamples, nreports);
+    printf("sensed %lld, %lld, reported %lld, %lld\n", (long long) sensed[0], (long long) sensed[1],
+        (long long) reported[0], (long long) reported[1]);
+    printf("sensor overflows %u (expected %u), saturated samples %u, carried reports %u, %u counts carried at most, "
+           "%u reports not sent\n",
+        stats.sensor_overflows, expected_overflows, stats.saturated_samples, stats.carried_reports,
+        stats.carried_max, stats.suppressed_reports);
+
+    bool ok = sensed[0] == reported[0] && sensed[1] == reported[1] && stats.sensor_overflows == expected_overflows &&
+              stats.saturated_samples == 0;
+    printf("%s\n", ok ? "OK" : "COUNTS LOST");
+    return ok ? 0 : 1;
+}
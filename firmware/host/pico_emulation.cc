@@ -0,0 +1,396 @@
+#include <string.h>
+
+#include <hardware/clocks.h>
+#include <hardware/dma.h>
+#include <hardware/gpio.h>
+#include <hardware/spi.h>
+#include <hardware/structs/systick.h>
+#include <pico/stdlib.h>
+
+#include "pico_emulation.h"
+
+#define MAX_SENSORS 4
+#define NGPIOS 30
+#define NDMA_CHANNELS 12
+#define NDMA_TIMERS 4
+
+#define DREQ_SPI0_TX 16
+#define DREQ_DMA_TIMER0 59
+
+struct spi_inst {
+    uint index;
+    uint baudrate;
+    int64_t busy_until_ns;
+    spi_hw_t hw;
+};
+
+struct dma_channel {
+    bool claimed;
+    bool read_increment;
+    bool write_increment;
+    uint dreq;
+    volatile void* write_addr;
+    const volatile void* read_addr;
+    uint transfer_count;
+    int64_t busy_until_ns;
+};
+
+static int64_t now_ns = 0;
+static int64_t wfe_ns = 0;
+
+static PMW3360Emulator* attached[MAX_SENSORS];
+static int nattached = 0;
+
+static gpio_function pin_function[NGPIOS];
+static bool pin_level[NGPIOS];
+
+static spi_inst spi_instances[2] = { { 0 }, { 1 } };
+spi_inst_t* const spi0 = &spi_instances[0];
+spi_inst_t* const spi1 = &spi_instances[1];
+
+static dma_channel dma_channels[NDMA_CHANNELS];
+static bool dma_timer_claimed[NDMA_TIMERS];
+static int64_t dma_timer_period_ns[NDMA_TIMERS];
+
+static systick_hw_t systick;
+systick_hw_t* const systick_hw = &systick;
+
+static void sdk_call() {
+    now_ns += EMULATED_SDK_CALL_NS;
+}
+
+void pico_emulation_attach(PMW3360Emulator* sensor) {
+    if (nattached < MAX_SENSORS) {
+        attached[nattached++] = sensor;
+    }
+}
+
+int64_t pico_emulation_time_ns() {
+    return now_ns;
+}
+
+int64_t pico_emulation_wfe_ns() {
+    return wfe_ns;
+}
+
+// time
+
+void sleep_us(uint64_t us) {
+    now_ns += us * 1000;
+}
+
+void sleep_ms(uint32_t ms) {
+    now_ns += (int64_t) ms * 1000000;
+}
+
+void busy_wait_at_least_cycles(uint32_t minimum_cycles) {
+    now_ns += (int64_t) minimum_cycles * 1000000000 / EMULATED_CLK_SYS_HZ;
+}
+
+uint32_t time_us_32() {
+    sdk_call();
+    return now_ns / 1000;
+}
+
+uint64_t time_us_64() {
+    sdk_call();
+    return now_ns / 1000;
+}
+
+absolute_time_t make_timeout_time_us(uint64_t us) {
+    return time_us_64() + us;
+}
+
+bool best_effort_wfe_or_timeout(absolute_time_t timeout_timestamp) {
+    sdk_call();
+    int64_t timeout_ns = (int64_t) timeout_timestamp * 1000;
+    if (timeout_ns > now_ns) {
+        wfe_ns += timeout_ns - now_ns;
+        now_ns = timeout_ns;
+    }
+    return true;
+}
+
+// counts down at clk_sys like the real one
+systick_cvr_t::operator uint32_t() const {
+    sdk_call();
+    return (0x00ffffff - (now_ns * (EMULATED_CLK_SYS_HZ / 1000000) / 1000)) & 0x00ffffff;
+}
+
+uint32_t clock_get_hz(enum clock_index clk_index) {
+    return EMULATED_CLK_SYS_HZ;
+}
+
+// GPIO
+
+void gpio_init(uint gpio) {
+    sdk_call();
+    gpio_set_function(gpio, GPIO_FUNC_SIO);
+    pin_level[gpio] = false;
+}
+
+void gpio_set_function(uint gpio, enum gpio_function fn) {
+    sdk_call();
+    for (int i = 0; i < nattached; i++) {
+        PMW3360Emulator* sensor = attached[i];
+        if (gpio == sensor->sck_pin && fn != pin_function[gpio] && !pin_level[sensor->ncs_pin] &&
+            pin_function[sensor->ncs_pin] == GPIO_FUNC_SIO) {
+            sensor->pins_changed_while_selected(now_ns);
+        }
+    }
+    pin_function[gpio] = fn;
+}
+
+void gpio_set_dir(uint gpio, bool out) {
+    sdk_call();
+}
+
+void gpio_put(uint gpio, bool value) {
+    sdk_call();
+    if (pin_level[gpio] == value) {
+        return;
+    }
+    pin_level[gpio] = value;
+    for (int i = 0; i < nattached; i++) {
+        if (attached[i]->ncs_pin == gpio) {
+            attached[i]->ncs_changed(value, now_ns);
+        }
+    }
+}
+
+// SPI
+
+static int64_t byte_ns(const spi_inst_t* spi) {
+    return 8000000000ll / spi->baudrate;
+}
+
+// clocks one byte out of spi starting at t_ns, returns what came back on MISO
+static uint8_t clock_byte(spi_inst_t* spi, uint8_t mosi, int64_t t_ns) {
+    uint8_t miso = 0;
+    for (int i = 0; i < nattached; i++) {
+        PMW3360Emulator* sensor = attached[i];
+        if (sensor->spi_index != spi->index || pin_level[sensor->ncs_pin] ||
+            pin_function[sensor->sck_pin] != GPIO_FUNC_SPI || pin_function[sensor->mosi_pin] != GPIO_FUNC_SPI) {
+            continue;
+        }
+        uint8_t data = sensor->transfer(mosi, t_ns, byte_ns(spi));
+        if (pin_function[sensor->miso_pin] == GPIO_FUNC_SPI) {
+            miso |= data;
+        }
+    }
+    return miso;
+}
+
+static int64_t spi_start_ns(spi_inst_t* spi) {
+    return now_ns > spi->busy_until_ns ? now_ns : spi->busy_until_ns;
+}
+
+uint spi_init(spi_inst_t* spi, uint baudrate) {
+    sdk_call();
+    return spi_set_baudrate(spi, baudrate);
+}
+
+uint spi_set_baudrate(spi_inst_t* spi, uint baudrate) {
+    sdk_call();
+    spi->baudrate = baudrate;
+    return baudrate;
+}
+
+void spi_set_format(spi_inst_t* spi, uint data_bits, spi_cpol_t cpol, spi_cpha_t cpha, spi_order_t order) {
+    sdk_call();
+}
+
+int spi_write_blocking(spi_inst_t* spi, const uint8_t* src, size_t len) {
+    sdk_call();
+    int64_t t = spi_start_ns(spi);
+    for (size_t i = 0; i < len; i++) {
+        clock_byte(spi, src[i], t);
+        t += byte_ns(spi);
+    }
+    now_ns = spi->busy_until_ns = t;
+    return len;
+}
+
+int spi_read_blocking(spi_inst_t* spi, uint8_t repeated_tx_data, uint8_t* dst, size_t len) {
+    sdk_call();
+    int64_t t = spi_start_ns(spi);
+    for (size_t i = 0; i < len; i++) {
+        dst[i] = clock_byte(spi, repeated_tx_data, t);
+        t += byte_ns(spi);
+    }
+    now_ns = spi->busy_until_ns = t;
+    return len;
+}
+
+spi_hw_t* spi_get_hw(spi_inst_t* spi) {
+    return &spi->hw;
+}
+
+uint spi_get_index(const spi_inst_t* spi) {
+    return spi->index;
+}
+
+uint spi_get_dreq(spi_inst_t* spi, bool is_tx) {
+    return DREQ_SPI0_TX + spi->index * 2 + (is_tx ? 0 : 1);
+}
+
+bool spi_is_busy(const spi_inst_t* spi) {
+    sdk_call();
+    return now_ns < spi->busy_until_ns;
+}
+
+// received bytes are handed over directly, the RX FIFO is always empty
+bool spi_is_readable(const spi_inst_t* spi) {
+    sdk_call();
+    return false;
+}
+
+// DMA
+
+static spi_inst_t* spi_for_data_register(const volatile void* addr) {
+    for (int i = 0; i < 2; i++) {
+        if (addr == &spi_instances[i].hw.dr) {
+            return &spi_instances[i];
+        }
+    }
+    return nullptr;
+}
+
+int dma_claim_unused_channel(bool required) {
+    for (int i = 0; i < NDMA_CHANNELS; i++) {
+        if (!dma_channels[i].claimed) {
+            dma_channels[i].claimed = true;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// the config only holds the channel it was made for, settings go straight to the channel
+dma_channel_config dma_channel_get_default_config(uint channel) {
+    dma_channels[channel].read_increment = true;
+    dma_channels[channel].write_increment = false;
+    dma_channels[channel].dreq = 0x3f;
+    return { channel };
+}
+
+void channel_config_set_transfer_data_size(dma_channel_config* c, enum dma_channel_transfer_size size) {
+}
+
+void channel_config_set_read_increment(dma_channel_config* c, bool incr) {
+    dma_channels[c->ctrl].read_increment = incr;
+}
+
+void channel_config_set_write_increment(dma_channel_config* c, bool incr) {
+    dma_channels[c->ctrl].write_increment = incr;
+}
+
+void channel_config_set_dreq(dma_channel_config* c, uint dreq) {
+    dma_channels[c->ctrl].dreq = dreq;
+}
+
+void dma_channel_configure(uint channel, const dma_channel_config* config, volatile void* write_addr,
+    const volatile void* read_addr, uint transfer_count, bool trigger) {
+    sdk_call();
+    dma_channels[channel].write_addr = write_addr;
+    dma_channels[channel].read_addr = read_addr;
+    dma_channels[channel].transfer_count = transfer_count;
+    if (trigger) {
+        dma_start_channel_mask(1u << channel);
+    }
+}
+
+void dma_channel_set_write_addr(uint channel, volatile void* write_addr, bool trigger) {
+    sdk_call();
+    dma_channels[channel].write_addr = write_addr;
+    if (trigger) {
+        dma_start_channel_mask(1u << channel);
+    }
+}
+
+void dma_channel_set_trans_count(uint channel, uint32_t trans_count, bool trigger) {
+    sdk_call();
+    dma_channels[channel].transfer_count = trans_count;
+    if (trigger) {
+        dma_start_channel_mask(1u << channel);
+    }
+}
+
+// Only the transfers pmw3360.cc does are supported: memory to an SPI data
+// register, paced by the SPI or by a DMA timer, optionally together with a
+// channel started at the same time that reads the data register into memory.
+// The whole transfer is clocked through the sensors right away with the
+// timestamps it will have, and the channels stay busy until then.
+void dma_start_channel_mask(uint32_t chan_mask) {
+    sdk_call();
+    for (int tx = 0; tx < NDMA_CHANNELS; tx++) {
+        dma_channel& c = dma_channels[tx];
+        spi_inst_t* spi = spi_for_data_register(c.write_addr);
+        if (!(chan_mask & (1u << tx)) || spi == nullptr) {
+            continue;
+        }
+
+        dma_channel* rx = nullptr;
+        for (int i = 0; i < NDMA_CHANNELS; i++) {
+            if ((chan_mask & (1u << i)) && spi_for_data_register(dma_channels[i].read_addr) == spi) {
+                rx = &dma_channels[i];
+            }
+        }
+
+        int64_t period = byte_ns(spi);
+        int64_t t = spi_start_ns(spi);
+        if (c.dreq >= DREQ_DMA_TIMER0 && c.dreq < DREQ_DMA_TIMER0 + NDMA_TIMERS) {
+            period = dma_timer_period_ns[c.dreq - DREQ_DMA_TIMER0];
+            t += period;
+        }
+
+        const volatile uint8_t* src = (const volatile uint8_t*) c.read_addr;
+        volatile uint8_t* dst = rx != nullptr ? (volatile uint8_t*) rx->write_addr : nullptr;
+        for (uint i = 0; i < c.transfer_count; i++) {
+            uint8_t miso = clock_byte(spi, *src, t);
+            if (c.read_increment) {
+                src++;
+            }
+            if (dst != nullptr) {
+                *dst = miso;
+                if (rx->write_increment) {
+                    dst++;
+                }
+            }
+            t += (i + 1 < c.transfer_count) ? period : byte_ns(spi);
+        }
+
+        c.busy_until_ns = t;
+        spi->busy_until_ns = t;
+        if (rx != nullptr) {
+            rx->busy_until_ns = t;
+        }
+    }
+}
+
+bool dma_channel_is_busy(uint channel) {
+    sdk_call();
+    return now_ns < dma_channels[channel].busy_until_ns;
+}
+
+int dma_claim_unused_timer(bool required) {
+    for (int i = 0; i < NDMA_TIMERS; i++) {
+        if (!dma_timer_claimed[i]) {
+            dma_timer_claimed[i] = true;
+            return i;
+        }
+    }
+    return -1;
+}
+
+void dma_timer_unclaim(uint timer) {
+    dma_timer_claimed[timer] = false;
+}
+
+void dma_timer_set_fraction(uint timer, uint16_t numerator, uint16_t denominator) {
+    dma_timer_period_ns[timer] = (int64_t) 1000000000 * denominator / ((int64_t) numerator * EMULATED_CLK_SYS_HZ);
+}
+
+uint dma_get_timer_dreq(uint timer_num) {
+    return DREQ_DMA_TIMER0 + timer_num;
+}
@@ -0,0 +1,27 @@
+#ifndef _PICO_EMULATION_H_
+#define _PICO_EMULATION_H_
+
+#include <stdint.h>
+
+#include "pmw3360_emulator.h"
+
+// The part of the Pico SDK used by pmw3360.cc (SPI, DMA, DMA timers, GPIO,
+// the 1us timer and SysTick), emulated on the host with the sensors
+// replaced by PMW3360Emulator. Time is virtual: it only advances when the
+// code under test sleeps, waits for a transfer or calls into the SDK, which
+// costs EMULATED_SDK_CALL_NS per call so that polling loops make progress.
+// Bytes are clocked at the configured SPI baud rate with no gaps.
+
+#define EMULATED_SDK_CALL_NS 100
+#define EMULATED_CLK_SYS_HZ 125000000
+
+// A sensor sees the bus when its chip select is low and its SCK pin is
+// connected to its SPI peripheral; MISO is only seen by the RP2040 when
+// that pin is connected as well.
+void pico_emulation_attach(PMW3360Emulator* sensor);
+
+int64_t pico_emulation_time_ns();
+// time spent in best_effort_wfe_or_timeout()
+int64_t pico_emulation_wfe_ns();
+
+#endif
@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "pmw3360_emulator.h"
+
+#include "registers.h"
+#include "srom.h"
+
+#define SROM_ID_LOADED 0x04
+
+PMW3360Emulator::PMW3360Emulator(uint8_t spi_index, uint8_t miso_pin, uint8_t mosi_pin, uint8_t sck_pin, uint8_t ncs_pin)
+    : spi_index(spi_index), miso_pin(miso_pin), mosi_pin(mosi_pin), sck_pin(sck_pin), ncs_pin(ncs_pin) {
+    reset();
+    // before the first Power_Up_Reset we don't know how long it's been powered
+    reset_ns = -EMU_tPOWER_UP_RESET;
+}
+
+void PMW3360Emulator::reset() {
+    memset(registers, 0, sizeof(registers));
+    registers[Product_ID] = 0x42;
+    registers[Revision_ID] = 0x01;
+    registers[Inverse_Product_ID] = 0xbd;
+    registers[Config1] = 0x31;
+    registers[Config2] = 0x20;
+    registers[Run_Downshift] = 0x32;
+    registers[Rest1_Downshift] = 0x1f;
+    registers[Rest2_Rate_Lower] = 0x63;
+    registers[Rest2_Downshift] = 0xbc;
+    registers[Rest3_Rate_Lower] = 0xf3;
+    registers[Rest3_Rate_Upper] = 0x01;
+    registers[SQUAL] = 0x40;
+    burst_armed = false;
+    srom_enabled = false;
+    frame_capture_step = 0;
+    motion[0] = 0;
+    motion[1] = 0;
+}
+
+void PMW3360Emulator::add_motion(int32_t dx, int32_t dy) {
+    motion[0] += dx;
+    motion[1] += dy;
+}
+
+void PMW3360Emulator::set_lifted(bool lifted_) {
+    lifted = lifted_;
+}
+
+void PMW3360Emulator::set_squal(uint8_t squal) {
+    registers[SQUAL] = squal;
+}
+
+void PMW3360Emulator::set_shutter(uint16_t shutter) {
+    registers[Shutter_Upper] = shutter >> 8;
+    registers[Shutter_Lower] = shutter & 0xff;
+}
+
+bool PMW3360Emulator::srom_loaded() const {
+    return registers[SROM_ID] != 0;
+}
+
+unsigned int PMW3360Emulator::cpi() const {
+    return (registers[Config1] + 1) * 100;
+}
+
+bool PMW3360Emulator::rest_enabled() const {
+    return registers[Config2] & 0x20;
+}
+
+uint8_t PMW3360Emulator::register_value(uint8_t reg) const {
+    return registers[reg];
+}
+
+// The delta registers are 16 bits, anything beyond that is lost.
+void PMW3360Emulator::latch_motion() {
+    for (int axis = 0; axis < 2; axis++) {
+        if (motion[axis] > 32767) {
+            motion[axis] = 32767;
+        }
+        if (motion[axis] < -32768) {
+            motion[axis] = -32768;
+        }
+    }
+    registers[Delta_X_L] = motion[0] & 0xff;
+    registers[Delta_X_H] = (motion[0] >> 8) & 0xff;
+    registers[Delta_Y_L] = motion[1] & 0xff;
+    registers[Delta_Y_H] = (motion[1] >> 8) & 0xff;
+    registers[Motion] = ((motion[0] != 0 || motion[1] != 0) ? (1 << 7) : 0) | (lifted ? (1 << 3) : 0);
+    motion[0] = 0;
+    motion[1] = 0;
+
+    burst[0] = registers[Motion];
+    burst[1] = registers[Observation];
+    burst[2] = registers[Delta_X_L];
+    burst[3] = registers[Delta_X_H];
+    burst[4] = registers[Delta_Y_L];
+    burst[5] = registers[Delta_Y_H];
+    burst[6] = registers[SQUAL];
+    burst[7] = registers[Raw_Data_Sum];
+    burst[8] = registers[Maximum_Raw_data];
+    burst[9] = registers[Minimum_Raw_data];
+    burst[10] = registers[Shutter_Upper];
+    burst[11] = registers[Shutter_Lower];
+}
+
+uint8_t PMW3360Emulator::read(uint8_t reg) {
+    if (reg == Motion) {
+        // reading Motion freezes the delta registers
+        latch_motion();
+    }
+    return registers[reg];
+}
+
+void PMW3360Emulator::write(uint8_t reg, uint8_t value, int64_t t_ns) {
+    switch (reg) {
+        case Frame_Capture:
+            if (value == 0x83) {
+                frame_capture_step = 1;
+            } else if (value == 0xc5 && frame_capture_step == 1) {
+                if (rest_enabled()) {
+                    violation(t_ns, "frame capture with rest mode on", 0, 0);
+                }
+                // the SROM is gone until the next download
+                frame_capture_step = 2;
+                frame_capture_ns = t_ns;
+                registers[SROM_ID] = 0;
+            } else {
+                frame_capture_step = 0;
+            }
+            break;
+        case Power_Up_Reset:
+            if (value == 0x5a) {
+                reset();
+            }
+            break;
+        case SROM_Enable:
+            srom_enabled = (value == 0x18);
+            registers[reg] = value;
+            break;
+        case Motion_Burst:
+            burst_armed = true;
+            break;
+        case Product_ID:
+        case Revision_ID:
+        case Inverse_Product_ID:
+        case SROM_ID:
+        case SQUAL:
+            break;  // read only
+        default:
+            registers[reg] = value;
+            break;
+    }
+}
+
+void PMW3360Emulator::ncs_changed(bool level, int64_t t_ns) {
+    if (!level && !selected) {
+        if (prev_was_burst && t_ns - last_deselect_ns < EMU_tBEXIT) {
+            violation(t_ns, "tBEXIT", t_ns - last_deselect_ns, EMU_tBEXIT);
+        }
+        selected = true;
+        selected_at_ns = t_ns;
+        first_byte = true;
+        state = State::IDLE;
+    } else if (level && selected) {
+        selected = false;
+        selected_ns += t_ns - selected_at_ns;
+        // toggling chip select without any bytes (to reset the serial port)
+        // doesn't start another tBEXIT
+        if (state != State::IDLE) {
+            last_deselect_ns = t_ns;
+        }
+
+        switch (state) {
+            case State::WRITE_DONE:
+                if (t_ns - last_sclk_ns < EMU_tSCLK_NCS_WRITE) {
+                    violation(t_ns, "tSCLK-NCS (write)", t_ns - last_sclk_ns, EMU_tSCLK_NCS_WRITE);
+                }
+                break;
+            case State::RAW_BURST:
+                if (raw_index < EMU_FRAME_SIZE) {
+                    violation(t_ns, "frame read incomplete", raw_index, EMU_FRAME_SIZE);
+                } else {
+                    frames++;
+                }
+                frame_capture_step = 0;
+                // fall through
+            case State::READ_DONE:
+            case State::BURST:
+                if (t_ns - last_sclk_ns < EMU_tSCLK_NCS_READ) {
+                    violation(t_ns, "tSCLK-NCS (read)", t_ns - last_sclk_ns, EMU_tSCLK_NCS_READ);
+                }
+                break;
+            case State::SROM_DOWNLOAD:
+                if (srom_matches && srom_received == firmware_length) {
+                    registers[SROM_ID] = SROM_ID_LOADED;
+                } else {
+                    violation(t_ns, "SROM download incomplete", srom_received, firmware_length);
+                }
+                srom_enabled = false;
+                break;
+            default:
+                break;
+        }
+
+        if (state != State::IDLE) {
+            transactions++;
+            prev_was_write = (state == State::WRITE_DONE || state == State::SROM_DOWNLOAD);
+            prev_was_burst = (state == State::BURST || state == State::RAW_BURST);
+        }
+        state = State::IDLE;
+    }
+}
+
+uint8_t PMW3360Emulator::transfer(uint8_t mosi, int64_t t_ns, int64_t duration_ns) {
+    uint8_t miso = 0;
+
+    if (first_byte) {
+        first_byte = false;
+        address = mosi & 0x7f;
+        bool is_write = mosi & 0x80;
+
+        if (t_ns - selected_at_ns < EMU_tNCS_SCLK) {
+            violation(t_ns, "tNCS-SCLK", t_ns - selected_at_ns, EMU_tNCS_SCLK);
+        }
+        if (t_ns - reset_ns < EMU_tPOWER_UP_RESET) {
+            violation(t_ns, "access during reset", t_ns - reset_ns, EMU_tPOWER_UP_RESET);
+        }
+        if (!prev_was_burst) {
+            int64_t required = prev_was_write ? (is_write ? EMU_tSWW : EMU_tSWR) : (is_write ? EMU_tSRW : EMU_tSRR);
+            const char* name = prev_was_write ? (is_write ? "tSWW" : "tSWR") : (is_write ? "tSRW" : "tSRR");
+            if (t_ns - last_sclk_ns < required) {
+                violation(t_ns, name, t_ns - last_sclk_ns, required);
+            }
+        }
+
+        if (is_write) {
+            if (address == SROM_Load_Burst && srom_enabled) {
+                state = State::SROM_DOWNLOAD;
+                srom_received = 0;
+                srom_matches = true;
+            } else {
+                state = State::WRITE_DATA;
+            }
+        } else if (address == Raw_Data_Burst && frame_capture_step == 2) {
+            state = State::RAW_BURST;
+            raw_index = 0;
+        } else if (address == Motion_Burst && burst_armed) {
+            state = State::BURST;
+            burst_index = 0;
+            latch_motion();
+        } else {
+            state = State::READ_WAIT;
+        }
+        address_end_ns = t_ns + duration_ns;
+    } else {
+        switch (state) {
+            case State::READ_WAIT:
+                if (t_ns - address_end_ns < EMU_tSRAD) {
+                    violation(t_ns, "tSRAD", t_ns - address_end_ns, EMU_tSRAD);
+                }
+                burst_armed = false;
+                miso = read(address);
+                state = State::READ_DONE;
+                break;
+            case State::BURST:
+                if (burst_index == 0 && t_ns - address_end_ns < EMU_tSRAD_MOTBR) {
+                    violation(t_ns, "tSRAD_MOTBR", t_ns - address_end_ns, EMU_tSRAD_MOTBR);
+                }
+                if (burst_index < (int) sizeof(burst)) {
+                    miso = burst[burst_index++];
+                }
+                break;
+            case State::RAW_BURST:
+                if (raw_index == 0) {
+                    if (t_ns - address_end_ns < EMU_tSRAD) {
+                        violation(t_ns, "tSRAD", t_ns - address_end_ns, EMU_tSRAD);
+                    }
+                    if (t_ns - frame_capture_ns < EMU_tFRAME_CAPTURE) {
+                        violation(t_ns, "frame read too early", t_ns - frame_capture_ns, EMU_tFRAME_CAPTURE);
+                    }
+                }
+                if (raw_index < EMU_FRAME_SIZE) {
+                    miso = image[raw_index++];
+                }
+                break;
+            case State::WRITE_DATA:
+                if (address != Motion_Burst) {
+                    burst_armed = false;
+                }
+                write(address, mosi, t_ns);
+                if (address == Power_Up_Reset && mosi == 0x5a) {
+                    reset_ns = t_ns + duration_ns;
+                }
+                state = State::WRITE_DONE;
+                break;
+            case State::SROM_DOWNLOAD: {
+                int64_t previous_end = (srom_received == 0) ? address_end_ns : last_sclk_ns;
+                if (t_ns - previous_end < EMU_tLOAD) {
+                    violation(t_ns, "tLOAD", t_ns - previous_end, EMU_tLOAD);
+                }
+                if (srom_received >= firmware_length || firmware_data[srom_received] != mosi) {
+                    srom_matches = false;
+                }
+                srom_received++;
+                break;
+            }
+            case State::READ_DONE:
+            case State::WRITE_DONE:
+            case State::IDLE:
+                violation(t_ns, "unexpected byte", 0, 0);
+                break;
+        }
+    }
+
+    last_sclk_ns = t_ns + duration_ns;
+
+    return miso;
+}
+
+void PMW3360Emulator::pins_changed_while_selected(int64_t t_ns) {
+    violation(t_ns, "SPI pins switched with chip select low", 0, 0);
+}
+
+void PMW3360Emulator::violation(int64_t t_ns, const char* what, int64_t actual_ns, int64_t required_ns) {
+    if (violations < PMW3360_EMULATOR_MAX_VIOLATIONS_LOGGED) {
+        snprintf(violation_log[violations], sizeof(violation_log[0]), "%lld us: %s (%lld < %lld)",
+            (long long) (t_ns / 1000), what, (long long) actual_ns, (long long) required_ns);
+    }
+    violations++;
+}
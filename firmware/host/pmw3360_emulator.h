@@ -0,0 +1,111 @@
+#ifndef _PMW3360_EMULATOR_H_
+#define _PMW3360_EMULATOR_H_
+
+#include <stdint.h>
+
+// Register-level model of a PMW3360 for host builds. The emulated Pico SDK in
+// pico_emulation.cc delivers SPI bytes and chip select changes to it, with
+// timestamps in nanoseconds of emulated time. Every access is checked against
+// the datasheet timings and violations are counted and logged.
+
+#define PMW3360_EMULATOR_MAX_VIOLATIONS_LOGGED 16
+
+// minimum timings from the datasheet, in nanoseconds
+#define EMU_tNCS_SCLK 120
+#define EMU_tSCLK_NCS_READ 120
+#define EMU_tSCLK_NCS_WRITE 35000
+#define EMU_tSRAD 160000
+#define EMU_tSRAD_MOTBR 35000
+#define EMU_tSWW 180000
+#define EMU_tSWR 180000
+#define EMU_tSRW 20000
+#define EMU_tSRR 20000
+#define EMU_tBEXIT 500
+#define EMU_tLOAD 15000
+#define EMU_tPOWER_UP_RESET 50000000
+#define EMU_tFRAME_CAPTURE 20000000
+
+#define EMU_FRAME_SIZE 1296
+
+class PMW3360Emulator {
+   public:
+    PMW3360Emulator(uint8_t spi_index, uint8_t miso_pin, uint8_t mosi_pin, uint8_t sck_pin, uint8_t ncs_pin);
+
+    // bus events, called by the SDK emulation
+    void ncs_changed(bool level, int64_t t_ns);
+    // byte clocked from first SCLK edge at t_ns to t_ns + duration_ns, returns MISO
+    uint8_t transfer(uint8_t mosi, int64_t t_ns, int64_t duration_ns);
+    // chip select is low and the SPI pins were disconnected, glitching SCLK
+    void pins_changed_while_selected(int64_t t_ns);
+
+    // the ball
+    void add_motion(int32_t dx, int32_t dy);
+    void set_lifted(bool lifted);
+    void set_squal(uint8_t squal);
+    void set_shutter(uint16_t shutter);
+    // what frame capture returns
+    uint8_t image[EMU_FRAME_SIZE] = { 0 };
+
+    bool srom_loaded() const;
+    unsigned int cpi() const;
+    bool rest_enabled() const;
+    uint8_t register_value(uint8_t reg) const;
+
+    const uint8_t spi_index;
+    const uint8_t miso_pin;
+    const uint8_t mosi_pin;
+    const uint8_t sck_pin;
+    const uint8_t ncs_pin;
+
+    uint32_t violations = 0;
+    char violation_log[PMW3360_EMULATOR_MAX_VIOLATIONS_LOGGED][96];
+
+    // statistics
+    uint32_t transactions = 0;
+    int64_t selected_ns = 0;  // total time with chip select low
+    uint32_t frames = 0;  // frames read out completely
+
+   private:
+    enum class State : uint8_t {
+        IDLE,
+        READ_WAIT,
+        READ_DONE,
+        WRITE_DATA,
+        WRITE_DONE,
+        BURST,
+        RAW_BURST,
+        SROM_DOWNLOAD,
+    };
+
+    uint8_t registers[128];
+    State state = State::IDLE;
+    bool selected = false;
+    int64_t selected_at_ns = 0;
+    bool first_byte = true;
+    uint8_t address = 0;
+    int64_t address_end_ns = 0;
+    int64_t last_sclk_ns = -1000000000;
+    int64_t last_deselect_ns = -1000000000;
+    int64_t reset_ns = -1000000000;
+    bool prev_was_write = false;
+    bool prev_was_burst = false;
+    bool burst_armed = false;
+    uint8_t burst[12];
+    int burst_index = 0;
+    uint8_t frame_capture_step = 0;  // 0x83 and 0xc5 written to Frame_Capture
+    int64_t frame_capture_ns = 0;
+    int raw_index = 0;
+    bool srom_enabled = false;
+    int srom_received = 0;
+    bool srom_matches = false;
+    int32_t motion[2] = { 0, 0 };
+    bool lifted = false;
+
+    void reset();
+    void latch_motion();
+    uint8_t read(uint8_t reg);
+    void write(uint8_t reg, uint8_t value, int64_t t_ns);
+    void violation(int64_t t_ns, const char* what, int64_t actual_ns, int64_t required_ns);
+};
+
+#endif
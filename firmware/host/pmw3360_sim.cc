@@ -0,0 +1,228 @@
+// Runs the real PMW3360 driver against two emulated sensors and checks every
+// SPI access against the datasheet timings. Also reports how long startup
+// takes, how busy the bus is and how long a sample takes, in emulated time,
+// and how much of that the CPU sleeps.
+// Then turns on rest mode, captures frames from one sensor and checks that
+// it tracks again, with its CPI and rest mode, after being started up again.
+//
+// usage: pmw3360_sim [--spi1] [samples]
+//   --spi1   second sensor on spi1 instead of sharing spi0 (SENSOR1_ON_SPI1)
+//
+// Exits with status 1 if there were timing violations or wrong readings.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico_emulation.h"
+#include "pmw3360.h"
+#include "pmw3360_emulator.h"
+#include "registers.h"
+
+#define NSENSORS 2
+#define SAMPLE_INTERVAL_US 1000
+
+static int mismatches = 0;
+
+static const PMW3360::RestSettings rest_settings = { true, 0x05, 0x0002, 0x10, 0x00c7, 0x40, 0x03e7 };
+
+static bool rest_settings_match(PMW3360Emulator* emulator, const PMW3360::RestSettings& rest) {
+    return emulator->rest_enabled() == rest.enabled && emulator->register_value(Run_Downshift) == rest.run_downshift &&
+           emulator->register_value(Rest1_Rate_Lower) == (rest.rest1_rate & 0xff) &&
+           emulator->register_value(Rest1_Rate_Upper) == (rest.rest1_rate >> 8) &&
+           emulator->register_value(Rest1_Downshift) == rest.rest1_downshift &&
+           emulator->register_value(Rest2_Rate_Lower) == (rest.rest2_rate & 0xff) &&
+           emulator->register_value(Rest2_Rate_Upper) == (rest.rest2_rate >> 8) &&
+           emulator->register_value(Rest2_Downshift) == rest.rest2_downshift &&
+           emulator->register_value(Rest3_Rate_Lower) == (rest.rest3_rate & 0xff) &&
+           emulator->register_value(Rest3_Rate_Upper) == (rest.rest3_rate >> 8);
+}
+
+static void sleep_until_ns(int64_t t_ns) {
+    int64_t now = pico_emulation_time_ns();
+    if (t_ns > now) {
+        sleep_us((t_ns - now + 999) / 1000);
+    }
+}
+
+// Takes samples at SAMPLE_INTERVAL_US with random motion on every sensor and
+// checks that the driver reads back exactly what the sensors saw.
+static void run_samples(const char* name, PMW3360* sensors, PMW3360Emulator** emulators, int nsamples) {
+    int64_t selected_before = 0;
+    for (int i = 0; i < NSENSORS; i++) {
+        selected_before += emulators[i]->selected_ns;
+    }
+    int64_t start_ns = pico_emulation_time_ns();
+    int64_t total_ns = 0;
+    int64_t worst_ns = 0;
+    int64_t asleep_ns = 0;
+
+    for (int n = 0; n < nsamples; n++) {
+        sleep_until_ns(start_ns + (int64_t) n * SAMPLE_INTERVAL_US * 1000);
+
+        int16_t expected[NSENSORS][2];
+        for (int i = 0; i < NSENSORS; i++) {
+            expected[i][0] = rand() % 601 - 300;
+            expected[i][1] = rand() % 601 - 300;
+            emulators[i]->add_motion(expected[i][0], expected[i][1]);
+        }
+
+        int64_t t0 = pico_emulation_time_ns();
+        int64_t wfe0 = pico_emulation_wfe_ns();
+        PMW3360::update_all(sensors, NSENSORS);
+        int64_t elapsed = pico_emulation_time_ns() - t0;
+        total_ns += elapsed;
+        asleep_ns += pico_emulation_wfe_ns() - wfe0;
+        if (elapsed > worst_ns) {
+            worst_ns = elapsed;
+        }
+
+        for (int i = 0; i < NSENSORS; i++) {
+            bool moved = expected[i][0] != 0 || expected[i][1] != 0;
+            if (sensors[i].movement[0] != expected[i][0] || sensors[i].movement[1] != expected[i][1] ||
+                sensors[i].motion != moved) {
+                if (mismatches < 10) {
+                    printf("  sample %d sensor %d: read %d,%d expected %d,%d\n", n, i,
+                        sensors[i].movement[0], sensors[i].movement[1], expected[i][0], expected[i][1]);
+                }
+                mismatches++;
+            }
+        }
+    }
+
+    int64_t selected = -selected_before;
+    for (int i = 0; i < NSENSORS; i++) {
+        selected += emulators[i]->selected_ns;
+    }
+    int64_t elapsed_ns = pico_emulation_time_ns() - start_ns;
+
+    printf("%s: %d samples, %.1f us average (CPU asleep for %.1f), %.1f us worst, chip select low %.1f%% of the "
+           "time\n",
+        name, nsamples, total_ns / 1000.0 / nsamples, asleep_ns / 1000.0 / nsamples, worst_ns / 1000.0,
+        100.0 * selected / elapsed_ns);
+}
+
+// Captures a few frames from one sensor, the way hal_pico.cc does, and
+// brings it back up afterwards.
+static void run_frame_capture(PMW3360* sensors, PMW3360Emulator** emulators, int sensor, int nframes) {
+    static uint8_t frame[PMW3360_FRAME_SIZE];
+    int64_t start_ns = pico_emulation_time_ns();
+    for (int n = 0; n < nframes; n++) {
+        for (int i = 0; i < PMW3360_FRAME_SIZE; i++) {
+            emulators[sensor]->image[i] = (i * 7 + n * 13) & 0x7f;
+        }
+        sensors[sensor].queue_frame_capture(frame);
+        while (sensors[sensor].poll()) {
+        }
+        if (memcmp(frame, emulators[sensor]->image, PMW3360_FRAME_SIZE) != 0) {
+            printf("  sensor %d: frame %d doesn't match the image\n", sensor, n);
+            mismatches++;
+        }
+    }
+    int64_t capture_ns = pico_emulation_time_ns() - start_ns;
+
+    PMW3360Startup startup(&sensors[sensor], 1);
+    startup.begin();
+    while (startup.poll()) {
+    }
+    printf("frame capture: %d frames from sensor %d, %.1f ms per frame, %.1f ms to start up again\n", nframes,
+        sensor, capture_ns / 1e6 / nframes, (pico_emulation_time_ns() - start_ns - capture_ns) / 1e6);
+    if (emulators[sensor]->frames != (uint32_t) nframes) {
+        printf("  sensor %d: %u frames read\n", sensor, emulators[sensor]->frames);
+        mismatches++;
+    }
+    if (!emulators[sensor]->srom_loaded() || emulators[sensor]->cpi() != 1200 ||
+        !rest_settings_match(emulators[sensor], rest_settings)) {
+        printf("  sensor %d: not back up after frame capture\n", sensor);
+        mismatches++;
+    }
+}
+
+int main(int argc, char** argv) {
+    bool sensor1_on_spi1 = false;
+    int nsamples = 5000;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--spi1")) {
+            sensor1_on_spi1 = true;
+        } else {
+            nsamples = atoi(argv[i]);
+        }
+    }
+
+    // same pins as hal_pico.cc
+    PMW3360Emulator emulator0(0, 4, 3, 2, 9);
+    PMW3360Emulator emulator1_spi0(0, 20, 23, 18, 25);
+    PMW3360Emulator emulator1_spi1(1, 12, 11, 10, 13);
+    PMW3360Emulator* emulators[NSENSORS] = { &emulator0, sensor1_on_spi1 ? &emulator1_spi1 : &emulator1_spi0 };
+    for (int i = 0; i < NSENSORS; i++) {
+        pico_emulation_attach(emulators[i]);
+    }
+
+    PMW3360 sensors[NSENSORS] = {
+        PMW3360(spi0, 4, 3, 2, 9, !sensor1_on_spi1),
+        sensor1_on_spi1 ? PMW3360(spi1, 12, 11, 10, 13, false) : PMW3360(spi0, 20, 23, 18, 25, true),
+    };
+
+    printf("sensor 1 on %s\n", sensor1_on_spi1 ? "spi1" : "spi0 (shared)");
+
+    int64_t t0 = pico_emulation_time_ns();
+    PMW3360Startup startup(sensors, NSENSORS);
+    startup.begin();
+    while (startup.poll()) {
+    }
+    printf("startup: %.1f ms%s\n", (pico_emulation_time_ns() - t0) / 1e6, startup.failed ? ", FAILED" : "");
+    for (int i = 0; i < NSENSORS; i++) {
+        if (!emulators[i]->srom_loaded() || sensors[i].srom_id == 0) {
+            printf("  sensor %d: SROM not loaded\n", i);
+            mismatches++;
+        }
+    }
+
+    run_samples("motion burst", sensors, emulators, nsamples);
+
+    for (int i = 0; i < NSENSORS; i++) {
+        sensors[i].use_motion_burst = false;
+    }
+    run_samples("register reads", sensors, emulators, nsamples / 10);
+
+    for (int i = 0; i < NSENSORS; i++) {
+        sensors[i].use_motion_burst = true;
+        sensors[i].set_cpi(1200);
+        if (emulators[i]->cpi() != 1200) {
+            printf("  sensor %d: CPI is %u after set_cpi(1200)\n", i, emulators[i]->cpi());
+            mismatches++;
+        }
+    }
+    run_samples("after set_cpi", sensors, emulators, nsamples / 10);
+
+    for (int i = 0; i < NSENSORS; i++) {
+        if (emulators[i]->rest_enabled()) {
+            printf("  sensor %d: rest mode on after startup\n", i);
+            mismatches++;
+        }
+        sensors[i].set_rest(rest_settings);
+        if (!rest_settings_match(emulators[i], rest_settings)) {
+            printf("  sensor %d: wrong rest mode settings after set_rest()\n", i);
+            mismatches++;
+        }
+    }
+    run_samples("after set_rest", sensors, emulators, nsamples / 10);
+
+    run_frame_capture(sensors, emulators, 1, 5);
+    run_samples("after frame capture", sensors, emulators, nsamples / 10);
+
+    uint32_t violations = 0;
+    for (int i = 0; i < NSENSORS; i++) {
+        printf("sensor %d: %u transactions, %u timing violations\n", i, emulators[i]->transactions,
+            emulators[i]->violations);
+        for (uint32_t j = 0; j < emulators[i]->violations && j < PMW3360_EMULATOR_MAX_VIOLATIONS_LOGGED; j++) {
+            printf("  %s\n", emulators[i]->violation_log[j]);
+        }
+        violations += emulators[i]->violations;
+    }
+    if (mismatches > 0) {
+        printf("%d wrong readings\n", mismatches);
+    }
+
+    return (violations > 0 || mismatches > 0) ? 1 : 0;
+}
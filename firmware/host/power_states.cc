@@ -0,0 +1,172 @@
+// Takes the logic through the power states the way a day at the desk
+// would: moving the ball, leaving it long enough for every rest mode,
+// suspending the bus with and without remote wakeup allowed, and waking up
+// with motion and with a button press. Checks the time in each state and
+// the wakeups against what the rest mode settings the sensors were given
+// say, and that nothing moved the cursor while the bus was suspended.
+//
+// usage: power_states
+//
+// Exits with status 1 if anything was off.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc.h"
+#include "hal_host.h"
+#include "stats.h"
+
+// the logic's sample intervals, the states can be off by about one
+#define TOLERANCE_US 20000
+
+static const char* state_names[NPOWER_STATES] = { "run", "rest 1", "rest 2", "rest 3", "suspended" };
+
+static uint64_t time_us = 0;
+static int64_t reported_dx = 0;
+static uint64_t expected_us[NPOWER_STATES];
+static uint64_t still_us = 0;  // how long the ball has been still
+static int failures = 0;
+
+static void add_report(uint8_t report_id, const void* data, uint16_t len) {
+    if (report_id == 1) {
+        reported_dx += ((const hid_report_t*) data)->dx;
+    }
+}
+
+static void send_config() {
+    config.crc32 = crc32((const uint8_t*) &config, CONFIG_SIZE - 4);
+    config_t c = config;
+    handle_set_report(3, (const uint8_t*) &c, CONFIG_SIZE);
+}
+
+// the datasheet's downshift times for what the sensors were set to
+static void rest_after_us(uint64_t after[3]) {
+    const sensor_rest_t* rest = host_sensor_rest(0);
+    after[0] = rest->run_downshift * 10000ull;
+    after[1] = after[0] + rest->rest1_downshift * 320ull * (rest->rest1_rate + 1) * 1000;
+    after[2] = after[1] + rest->rest2_downshift * 32ull * (rest->rest2_rate + 1) * 1000;
+}
+
+// Runs the logic for duration_us with dx counts per sample, and adds up
+// where the time should have gone.
+static void run(uint64_t duration_us, int16_t dx, bool suspended = false) {
+    uint64_t end = time_us + duration_us;
+    while (time_us < end) {
+        host_set_time_us(time_us);
+        host_add_motion(0, dx, 0);
+        sensor_task();
+        hid_task();
+        time_us += sample_interval_us();
+    }
+
+    if (suspended) {
+        expected_us[POWER_SUSPENDED] += duration_us;
+    } else if (dx != 0 || !host_sensor_rest(0)->enabled) {
+        expected_us[POWER_RUN] += duration_us;
+    } else {
+        uint64_t after[3];
+        rest_after_us(after);
+        uint64_t from = still_us;
+        uint64_t to = still_us + duration_us;
+        uint64_t bounds[5] = { 0, after[0], after[1], after[2], UINT64_MAX };
+        for (int state = POWER_RUN; state <= POWER_REST3; state++) {
+            uint64_t start = from > bounds[state] ? from : bounds[state];
+            uint64_t stop = to < bounds[state + 1] ? to : bounds[state + 1];
+            if (stop > start) {
+                expected_us[state] += stop - start;
+            }
+        }
+    }
+    still_us = dx != 0 ? 0 : still_us + duration_us;
+}
+
+static stats_power_t read_power_stats() {
+    uint8_t page = STATS_PAGE_POWER;
+    handle_set_report(STATS_REPORT_ID, &page, 1);
+    uint8_t buffer[STATS_REPORT_SIZE];
+    handle_get_report(STATS_REPORT_ID, buffer, sizeof(buffer));
+    stats_power_t power;
+    memcpy(&power, buffer + 3, sizeof(power));
+    return power;
+}
+
+static void check(bool ok, const char* what) {
+    if (!ok) {
+        printf("%s\n", what);
+        failures++;
+    }
+}
+
+int main(int argc, char** argv) {
+    reset_state();
+    host_set_report_callback(add_report);
+    config.sensor_function[0][0] = SensorFunction::CURSOR_X;
+    config.rest_after[0] = 5;
+    config.rest_after[1] = 100;
+    config.rest_after[2] = 6000;
+    config.rest_period_ms[0] = 1;
+    config.rest_period_ms[1] = 100;
+    config.rest_period_ms[2] = 500;
+    send_config();
+
+    // long enough for every rest mode, then woken up from the last one
+    run(2000000, 5);
+    check(host_sensor_rest(0)->enabled && host_sensor_rest(1)->enabled, "rest mode not turned on");
+    run(700000000, 0);
+    run(1000000, 5);
+
+    // the motion while suspended wakes the host up, once
+    handle_suspend(true);
+    check(sample_interval_us() > 1000, "sampling as fast as ever while suspended");
+    run(5000000, 0, true);
+    int64_t dx_before_suspended_motion = reported_dx;
+    run(100000, 5, true);
+    check(host_remote_wakeups() == 1, "no remote wakeup, or more than one");
+    handle_resume();
+    run(1000000, 0);
+    check(reported_dx == dx_before_suspended_motion, "motion while suspended was reported");
+
+    // without remote wakeup a press does nothing until the host comes back
+    handle_suspend(false);
+    run(1000000, 0, true);
+    host_set_buttons(1);
+    run(200000, 0, true);
+    host_set_buttons(0);
+    run(800000, 0, true);
+    handle_resume();
+    check(host_remote_wakeups() == 1, "remote wakeup when it wasn't allowed");
+
+    // with rest mode off in the config, the sensors still rest while suspended
+    config.rest_after[0] = 0;
+    send_config();
+    run(1000000, 5);
+    check(!host_sensor_rest(0)->enabled, "rest mode not turned off");
+    handle_suspend(false);
+    run(100000, 0, true);
+    check(host_sensor_rest(0)->enabled, "no rest mode while suspended");
+    handle_resume();
+    run(100000, 0);
+    check(!host_sensor_rest(0)->enabled, "rest mode still on after resuming");
+
+    stats_power_t power = read_power_stats();
+    for (int state = 0; state < NPOWER_STATES; state++) {
+        int64_t error_us = (int64_t) power.state_ms[state] * 1000 - (int64_t) expected_us[state];
+        printf("%-10s %9.3f s (expected %9.3f s), %u wakeups\n", state_names[state], power.state_ms[state] / 1000.0,
+            expected_us[state] / 1e6, power.wakeups[state]);
+        if (llabs(error_us) > TOLERANCE_US) {
+            failures++;
+        }
+    }
+    printf("%u remote wakeups, wake latency %u us average, %u us min, %u us max\n", power.remote_wakeups,
+        power.wake_latency_average_us, power.wake_latency_min_us, power.wake_latency_max_us);
+    check(power.wakeups[POWER_REST3] == 1, "the wakeup from rest 3 wasn't counted");
+    check(power.wakeups[POWER_SUSPENDED] == 2, "the wakeups while suspended weren't counted");
+    check(power.remote_wakeups == 1, "the remote wakeup wasn't counted");
+    // the first report after resuming, 100 ms after the motion
+    check(power.wake_latency_max_us >= 100000 && power.wake_latency_max_us < 100000 + TOLERANCE_US,
+        "wrong latency for the remote wakeup");
+
+    printf("%s\n", failures == 0 ? "OK" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
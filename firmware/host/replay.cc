@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "replay.h"
+
+#include "hal_host.h"
+
+bool trace_load(const char* path, trace_t* trace) {
+    FILE* f = fopen(path, "rb");
+    if (f == nullptr) {
+        return false;
+    }
+    bool ok = fread(&trace->header, sizeof(trace->header), 1, f) == 1 &&
+              trace->header.magic == TRACE_MAGIC &&
+              trace->header.version == TRACE_VERSION &&
+              trace->header.nsensors == NSENSORS &&
+              trace->header.config.version == CONFIG_VERSION;
+    trace->records.clear();
+    trace_record_t record;
+    while (ok && fread(&record, sizeof(record), 1, f) == 1) {
+        trace->records.push_back(record);
+    }
+    fclose(f);
+    return ok;
+}
+
+bool trace_save(const char* path, const trace_t& trace) {
+    FILE* f = fopen(path, "wb");
+    if (f == nullptr) {
+        return false;
+    }
+    bool ok = fwrite(&trace.header, sizeof(trace.header), 1, f) == 1 &&
+              fwrite(trace.records.data(), sizeof(trace_record_t), trace.records.size(), f) == trace.records.size();
+    return (fclose(f) == 0) && ok;
+}
+
+trace_header_t trace_default_header() {
+    trace_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.nsensors = NSENSORS;
+    header.config = config;
+    return header;
+}
+
+void trace_replay(const trace_t& trace) {
+    config = trace.header.config;
+    config.command = ConfigCommand::NO_COMMAND;
+    reset_state();
+    handle_set_report(2, &trace.header.resolution_multiplier, 1);
+
+    // the records only have the lower 32 bits of the time
+    uint64_t time_us = trace.records.empty() ? 0 : trace.records[0].time_us;
+    for (const trace_record_t& record : trace.records) {
+        time_us += (uint32_t) (record.time_us - (uint32_t) time_us);
+        host_set_time_us(time_us);
+        host_set_buttons(record.buttons);
+        for (int sensor = 0; sensor < NSENSORS; sensor++) {
+            host_add_motion(sensor, record.movement[sensor][0], record.movement[sensor][1]);
+        }
+        sensor_task();
+        hid_task();
+    }
+}
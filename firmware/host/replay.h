@@ -0,0 +1,33 @@
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "trace.h"
+
+// Deterministic replay of motion traces recorded on the device (see trace.h).
+// The records are fed through the same sensor_task() and hid_task() that run
+// on the device, one call each per record, through the host HAL. Whenever
+// there's something new to report, hid_task() sends it to the callback set
+// with host_set_report_callback(). Replays always start from the power-on state
+// with the config and resolution multiplier from the trace header, so
+// replaying the same trace with the same code gives the same reports, bit
+// for bit.
+
+struct trace_t {
+    trace_header_t header;
+    std::vector<trace_record_t> records;
+};
+
+// Returns false if the file can't be read or isn't a trace for this build.
+bool trace_load(const char* path, trace_t* trace);
+bool trace_save(const char* path, const trace_t& trace);
+
+// A header for traces made up on the host, with the current config.
+trace_header_t trace_default_header();
+
+void trace_replay(const trace_t& trace);
+
+#endif
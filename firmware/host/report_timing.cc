@@ -0,0 +1,132 @@
+// Runs the just-in-time report logic (poll_phase.cc) against a simulated
+// host that sends a SOF every FRAME_US and polls the mouse endpoint at a
+// fixed point in the frame, while the ball keeps moving so there is always
+// a report to send. The USB callbacks are late by a few microseconds, like
+// they are when tud_task() gets to them.
+//
+// usage: report_timing [frames]
+//
+// Checks that reports go out in every frame right after mounting, while
+// the poll phase isn't known yet, that once it's learned they're handed to
+// the endpoint at most REPORT_LEAD_US before the poll, that they aren't held
+// back when the SOFs stop, and that all of this starts over after the host
+// re-enumerates the device and polls at a different point in the frame.
+// Exits with status 1 if not.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "poll_phase.h"
+
+// how often hid_task() gets to run on core 0
+#define TASK_STEP_US 5
+#define MAX_CALLBACK_DELAY_US 5
+
+struct host_t {
+    uint32_t poll_offset_us;  // from the SOF
+    uint32_t now_us;
+    bool queued;  // a report is waiting in the endpoint
+    uint32_t queued_us;
+};
+
+struct result_t {
+    uint32_t polls;
+    uint32_t reports;  // polls that got one
+    uint32_t early;  // reports queued more than REPORT_LEAD_US before the poll
+    uint32_t worst_wait_us;  // from queueing to the poll
+};
+
+static poll_phase_t p;
+static int failures = 0;
+
+static uint32_t callback_delay() {
+    return rand() % (MAX_CALLBACK_DELAY_US + 1);
+}
+
+// one frame of the device's main loop and the host's polling
+static void run_frame(host_t* h, result_t* r) {
+    uint32_t sof_us = h->now_us;
+    uint32_t poll_us = sof_us + h->poll_offset_us;
+    uint32_t sof_seen_us = sof_us + callback_delay();
+    bool sof_seen = false;
+    bool polled = false;
+    for (uint32_t t = sof_us; t < sof_us + FRAME_US; t += TASK_STEP_US) {
+        if (!sof_seen && t >= sof_seen_us) {
+            sof_seen = true;
+            poll_phase_sof(&p, t);
+        }
+        if (!h->queued && poll_phase_report_due(&p, t, false)) {
+            h->queued = true;
+            h->queued_us = t;
+        }
+        if (!polled && t >= poll_us) {
+            polled = true;
+            r->polls++;
+            if (h->queued) {
+                uint32_t wait = poll_us - h->queued_us;
+                r->reports++;
+                if (wait > REPORT_LEAD_US + TASK_STEP_US) {
+                    r->early++;
+                }
+                if (wait > r->worst_wait_us) {
+                    r->worst_wait_us = wait;
+                }
+                h->queued = false;
+                poll_phase_report_complete(&p, t + callback_delay());
+            }
+        }
+    }
+    h->now_us += FRAME_US;
+}
+
+static result_t run_frames(host_t* h, int frames) {
+    result_t r = { 0, 0, 0, 0 };
+    for (int i = 0; i < frames; i++) {
+        run_frame(h, &r);
+    }
+    return r;
+}
+
+static void check(bool ok, const char* what) {
+    if (!ok) {
+        printf("%s\n", what);
+        failures++;
+    }
+}
+
+// mount, then check the reports before and after the phase is learned
+static void mount(host_t* h, uint32_t poll_offset_us, int frames) {
+    h->poll_offset_us = poll_offset_us;
+    h->queued = false;
+    poll_phase_reset(&p);
+
+    result_t unknown = run_frames(h, POLL_PHASE_FRAMES);
+    printf("poll at %3u us: %u of %u polls with a report before the phase is known\n", poll_offset_us,
+        unknown.reports, unknown.polls);
+    check(unknown.reports == unknown.polls, "reports held back while the poll phase is unknown");
+
+    result_t known = run_frames(h, frames);
+    printf("poll at %3u us: %u of %u polls with a report after, at most %u us early\n", poll_offset_us,
+        known.reports, known.polls, known.worst_wait_us);
+    check(known.reports == known.polls, "polls missed once the poll phase is known");
+    check(known.early == 0, "reports queued more than REPORT_LEAD_US before the poll");
+}
+
+int main(int argc, char** argv) {
+    int frames = argc > 1 ? atoi(argv[1]) : 2000;
+    srand(1);
+
+    host_t h = { 0, 12345, false, 0 };
+    mount(&h, 370, frames);
+
+    // no SOFs (suspended, or the host stopped sending them)
+    h.now_us += 3 * FRAME_US;
+    check(poll_phase_time_to_poll_us(&p, h.now_us) == POLL_PHASE_UNKNOWN, "poll expected without SOFs");
+    check(poll_phase_report_due(&p, h.now_us, false), "report held back without SOFs");
+
+    // re-enumerated, polled at a different point in the frame
+    mount(&h, 820, frames);
+
+    printf("%s\n", failures == 0 ? "OK" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,12 @@
+#ifndef _HARDWARE_CLOCKS_H
+#define _HARDWARE_CLOCKS_H
+
+#include "pico/types.h"
+
+enum clock_index {
+    clk_sys = 5,
+};
+
+uint32_t clock_get_hz(enum clock_index clk_index);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef _HARDWARE_SPI_H
+#define _HARDWARE_SPI_H
+
+#include "pico/stdlib.h"
+
+typedef struct {
+    volatile uint32_t cr0, cr1, dr, sr, cpsr, imsc, ris, mis, icr, dmacr;
+} spi_hw_t;
+
+typedef struct spi_inst spi_inst_t;
+
+extern spi_inst_t* const spi0;
+extern spi_inst_t* const spi1;
+
+typedef enum { SPI_CPOL_0 = 0, SPI_CPOL_1 = 1 } spi_cpol_t;
+typedef enum { SPI_CPHA_0 = 0, SPI_CPHA_1 = 1 } spi_cpha_t;
+typedef enum { SPI_LSB_FIRST = 0, SPI_MSB_FIRST = 1 } spi_order_t;
+
+#define SPI_SSPICR_RORIC_BITS 0x00000001
+
+uint spi_init(spi_inst_t* spi, uint baudrate);
+uint spi_set_baudrate(spi_inst_t* spi, uint baudrate);
+void spi_set_format(spi_inst_t* spi, uint data_bits, spi_cpol_t cpol, spi_cpha_t cpha, spi_order_t order);
+int spi_write_blocking(spi_inst_t* spi, const uint8_t* src, size_t len);
+int spi_read_blocking(spi_inst_t* spi, uint8_t repeated_tx_data, uint8_t* dst, size_t len);
+spi_hw_t* spi_get_hw(spi_inst_t* spi);
+uint spi_get_index(const spi_inst_t* spi);
+uint spi_get_dreq(spi_inst_t* spi, bool is_tx);
+bool spi_is_busy(const spi_inst_t* spi);
+bool spi_is_readable(const spi_inst_t* spi);
+
+#endif
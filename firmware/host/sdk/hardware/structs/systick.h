@@ -0,0 +1,21 @@
+#ifndef _HARDWARE_STRUCTS_SYSTICK_H
+#define _HARDWARE_STRUCTS_SYSTICK_H
+
+#include "pico/types.h"
+
+// cvr reads are turned into the emulated cycle count
+struct systick_cvr_t {
+    operator uint32_t() const;
+    void operator=(uint32_t value) {}
+};
+
+struct systick_hw_t {
+    volatile uint32_t csr;
+    volatile uint32_t rvr;
+    systick_cvr_t cvr;
+    volatile uint32_t calib;
+};
+
+extern systick_hw_t* const systick_hw;
+
+#endif
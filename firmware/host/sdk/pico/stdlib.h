@@ -0,0 +1,13 @@
+#ifndef _PICO_STDLIB_H
+#define _PICO_STDLIB_H
+
+#include "pico/time.h"
+#include "pico/types.h"
+
+void sleep_us(uint64_t us);
+void sleep_ms(uint32_t ms);
+uint32_t time_us_32();
+uint64_t time_us_64();
+void busy_wait_at_least_cycles(uint32_t minimum_cycles);
+
+#endif
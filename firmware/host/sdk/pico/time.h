@@ -0,0 +1,12 @@
+#ifndef _PICO_TIME_H
+#define _PICO_TIME_H
+
+#include "pico/types.h"
+
+typedef uint64_t absolute_time_t;
+
+absolute_time_t make_timeout_time_us(uint64_t us);
+// nothing sends events, so this always sleeps until the timeout
+bool best_effort_wfe_or_timeout(absolute_time_t timeout_timestamp);
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef _PICO_TYPES_H
+#define _PICO_TYPES_H
+
+// Just enough of the Pico SDK for pmw3360.cc to build on the host,
+// implemented in host/pico_emulation.cc on top of the PMW3360 emulator.
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef unsigned int uint;
+
+#endif
@@ -0,0 +1,52 @@
+// Replays a motion trace through the trackball logic and prints the reports.
+//
+// usage: trace_replay trace.bin
+//
+// Prints one line per report: time in us, buttons, dx, dy, vwheel, hwheel.
+// The last line has the number of reports and a CRC32 of all of them, which
+// makes it easy to tell whether a change to the logic changed its output.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "crc.h"
+#include "hal_host.h"
+#include "replay.h"
+
+static uint32_t nreports = 0;
+static uint32_t reports_crc = 0;
+
+static void print_report(uint8_t report_id, const void* data, uint16_t len) {
+    if (report_id != 1) {
+        return;
+    }
+    const hid_report_t* report = (const hid_report_t*) data;
+    printf("%u %u %d %d %d %d\n", (unsigned int) hal_time_us(), report->buttons, report->dx, report->dy,
+        report->vwheel, report->hwheel);
+    // chain the CRC over all reports
+    uint8_t buf[4 + sizeof(hid_report_t)];
+    memcpy(buf, &reports_crc, 4);
+    memcpy(buf + 4, report, sizeof(hid_report_t));
+    reports_crc = crc32(buf, sizeof(buf));
+    nreports++;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s trace.bin\n", argv[0]);
+        return 2;
+    }
+
+    trace_t trace;
+    if (!trace_load(argv[1], &trace)) {
+        fprintf(stderr, "%s: not a valid trace\n", argv[1]);
+        return 1;
+    }
+
+    host_set_report_callback(print_report);
+    trace_replay(trace);
+
+    printf("%u reports, crc32 %08x\n", nreports, reports_crc);
+
+    return 0;
+}
@@ -0,0 +1,514 @@
+// Benchmark for the twist-to-scroll classifier in handle_twist_to_scroll().
+//
+// usage: twist_benchmark [--interval US] [--save DIR] [TRACE...]
+//
+// Runs a corpus of labeled motion traces through the logic with the trace
+// replay engine and reports, per scenario:
+//   FP%        cursor gestures during which any scrolling came out
+//   FN%        scroll gestures that lost more than half of their scrolling
+//   to scroll  time from the start of a scroll gesture to the first scroll
+//              output, median and 90th percentile
+//   lost cursor  cursor counts that didn't come out as they went in, as a
+//              percentage of all cursor counts in cursor gestures
+//   lost scroll  the same for scroll gestures
+//
+// The built-in corpus is synthetic: minimum-jerk gestures with cross-talk
+// between the sensors and some noise, made with a fixed seed so that the
+// numbers only change when the logic does. Gesture sizes are in counts at
+// the default 600/800 CPI, sampled every 1000 us unless --interval says
+// otherwise. Besides the default mapping there's twisting to scroll
+// horizontally while shift is held, and the side sensor mounted turned a
+// quarter with the config saying so. --save writes the corpus out as trace files that trace_replay
+// can read.
+//
+// Traces recorded with config-tool/trackball-trace.py can be added to the
+// benchmark. They're labeled by the start of their file name (cursor, twist
+// or shifted) and the whole trace counts as one gesture of that kind.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "hal_host.h"
+#include "replay.h"
+
+#define DEFAULT_SAMPLE_INTERVAL_US 1000
+#define SEGMENTS_PER_SCENARIO 200
+#define SHIFT_BUTTON 3
+// The side sensor sees the rolling towards and away from the user on its Y
+// axis, as far as the bottom sensor sees it on its X axis, but at 800 CPI
+// instead of 600.
+#define SIDE_PER_BOTTOM_COUNT (800.0 / 600)
+
+// both wheels reported as-is, so that every count can be accounted for
+#define RESOLUTION_MULTIPLIER ((1 << 0) | (1 << 2))
+
+enum class Label : uint8_t {
+    CURSOR,
+    TWIST,
+    SHIFTED_SCROLL,
+};
+
+struct segment_t {
+    Label label;
+    size_t start;  // first record, the segment lasts until the next one starts
+};
+
+struct labeled_trace_t {
+    std::string scenario;
+    trace_t trace;
+    std::vector<segment_t> segments;
+};
+
+struct output_t {
+    int32_t dx;
+    int32_t dy;
+    int32_t vwheel;
+    int32_t hwheel;
+};
+
+static uint32_t corpus_interval_us = DEFAULT_SAMPLE_INTERVAL_US;
+
+// xorshift32, so that the corpus is the same everywhere
+static uint32_t rng_state;
+
+static double random_uniform(double min, double max) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return min + (max - min) * (rng_state / 4294967296.0);
+}
+
+static double random_sign() {
+    return random_uniform(0, 1) < 0.5 ? -1 : 1;
+}
+
+class TraceBuilder {
+   public:
+    TraceBuilder(const char* scenario, const config_t& config) {
+        t.scenario = scenario;
+        t.trace.header = trace_default_header();
+        t.trace.header.config = config;
+        t.trace.header.resolution_multiplier = RESOLUTION_MULTIPLIER;
+    }
+
+    void idle(double ms, uint8_t buttons = 0) {
+        for (int i = 0; i < ms * 1000 / corpus_interval_us; i++) {
+            add_record(buttons, 0, 0, 0, 0);
+        }
+    }
+
+    // Moves the given total counts on each sensor axis with a minimum-jerk
+    // velocity profile. The twist axis (s1x) can be ahead of the others by
+    // twist_lead of the gesture's duration.
+    void gesture(Label label, double ms, double s0x, double s0y, double s1x, double s1y, uint8_t buttons = 0,
+        double twist_lead = 0) {
+        t.segments.push_back({ label, t.trace.records.size() });
+        int n = ms * 1000 / corpus_interval_us;
+        double total[4] = { s0x, s0y, s1x, s1y };
+        double done[4] = { 0, 0, 0, 0 };
+        for (int i = 1; i <= n; i++) {
+            int16_t delta[4];
+            for (int axis = 0; axis < 4; axis++) {
+                double s = std::min(1.0, (double) i / n + (axis == 2 ? twist_lead : 0));
+                double position = s * s * s * (10 - 15 * s + 6 * s * s);
+                double target = total[axis] * position + random_uniform(-0.5, 0.5);
+                delta[axis] = lround(target - done[axis]);
+                done[axis] += delta[axis];
+            }
+            add_record(buttons, delta[0], delta[1], delta[2], delta[3]);
+        }
+    }
+
+    // Rolling the ball towards some direction. The side sensor sees part of it
+    // on its Y axis and some twist from the hand not moving straight, which
+    // sometimes starts before the rolling does.
+    void cursor(double distance, double ms, double max_leak) {
+        double angle = random_uniform(0, 2 * M_PI);
+        double x = distance * cos(angle);
+        double y = distance * sin(angle);
+        double leak = random_sign() * random_uniform(0, max_leak) * distance;
+        gesture(Label::CURSOR, ms, x, y, leak, x * SIDE_PER_BOTTOM_COUNT, 0, random_uniform(0, 0.2));
+    }
+
+    // Rotating the ball around the vertical axis, with some rolling mixed in.
+    void twist(double distance, double ms) {
+        double angle = random_uniform(0, 2 * M_PI);
+        double leak = random_uniform(0, 0.25) * distance;
+        double x = leak * cos(angle);
+        double y = leak * sin(angle);
+        gesture(Label::TWIST, ms, x, y, random_sign() * distance, x * SIDE_PER_BOTTOM_COUNT);
+    }
+
+    void shifted_scroll(double distance, double ms) {
+        uint8_t shift = 1 << SHIFT_BUTTON;
+        idle(random_uniform(50, 200), shift);
+        double leak = random_sign() * random_uniform(0, 0.1) * distance;
+        gesture(Label::SHIFTED_SCROLL, ms, leak, random_sign() * distance, 0, leak * SIDE_PER_BOTTOM_COUNT, shift);
+        idle(random_uniform(50, 200), shift);
+    }
+
+    labeled_trace_t t;
+    uint8_t held_buttons = 0;  // all along
+    // the side sensor turned a quarter further, with the twist on its Y axis
+    bool turned = false;
+
+   private:
+    uint32_t time_us = 0;
+
+    void add_record(uint8_t buttons, int16_t s0x, int16_t s0y, int16_t s1x, int16_t s1y) {
+        trace_record_t record;
+        record.time_us = time_us;
+        record.buttons = buttons | held_buttons;
+        record.movement[0][0] = s0x;
+        record.movement[0][1] = s0y;
+        record.movement[1][0] = turned ? -s1y : s1x;
+        record.movement[1][1] = turned ? s1x : s1y;
+        t.trace.records.push_back(record);
+        time_us += corpus_interval_us;
+    }
+};
+
+static std::vector<labeled_trace_t> make_corpus() {
+    std::vector<labeled_trace_t> corpus;
+
+    config_t shifted_config = config;
+    shifted_config.button_function[SHIFT_BUTTON] = ButtonFunction::SHIFT;
+    shifted_config.sensor_shifted_function[0][0] = SensorFunction::HORIZONTAL_SCROLL;
+    shifted_config.sensor_shifted_function[0][1] = SensorFunction::VERTICAL_SCROLL;
+    shifted_config.sensor_shifted_function[1][0] = SensorFunction::NO_FUNCTION;
+    shifted_config.sensor_shifted_function[1][1] = SensorFunction::NO_FUNCTION;
+
+    // twisting scrolls horizontally while the shift button is held
+    config_t shift_twist_config = config;
+    shift_twist_config.button_function[SHIFT_BUTTON] = ButtonFunction::SHIFT;
+    shift_twist_config.sensor_shifted_function[1][0] = SensorFunction::HORIZONTAL_SCROLL;
+
+    config_t turned_config = config;
+    turned_config.sensor_rotation[1] += 90;
+    for (auto functions : { turned_config.sensor_function, turned_config.sensor_shifted_function }) {
+        functions[1][0] = SensorFunction::NO_FUNCTION;
+        functions[1][1] = SensorFunction::VERTICAL_SCROLL;
+    }
+
+    rng_state = 1;
+    TraceBuilder cursor("cursor", config);
+    for (int i = 0; i < SEGMENTS_PER_SCENARIO; i++) {
+        cursor.idle(random_uniform(150, 600));
+        cursor.cursor(random_uniform(100, 1500), random_uniform(150, 600), 0.25);
+    }
+    cursor.idle(500);
+    corpus.push_back(cursor.t);
+
+    rng_state = 2;
+    TraceBuilder twist("twist", config);
+    for (int i = 0; i < SEGMENTS_PER_SCENARIO; i++) {
+        twist.idle(random_uniform(150, 600));
+        twist.twist(random_uniform(200, 1200), random_uniform(150, 500));
+    }
+    twist.idle(500);
+    corpus.push_back(twist.t);
+
+    // no rest between one gesture and the next
+    rng_state = 3;
+    TraceBuilder mixed("mixed", config);
+    for (int i = 0; i < SEGMENTS_PER_SCENARIO; i++) {
+        mixed.idle(random_uniform(0, 150));
+        if (random_uniform(0, 1) < 0.5) {
+            mixed.cursor(random_uniform(100, 1500), random_uniform(150, 600), 0.25);
+        } else {
+            mixed.twist(random_uniform(200, 1200), random_uniform(150, 500));
+        }
+    }
+    mixed.idle(500);
+    corpus.push_back(mixed.t);
+
+    rng_state = 4;
+    TraceBuilder flicks("flicks", config);
+    for (int i = 0; i < SEGMENTS_PER_SCENARIO; i++) {
+        flicks.idle(random_uniform(150, 600));
+        flicks.cursor(random_uniform(1500, 4000), random_uniform(50, 120), 0.25);
+    }
+    flicks.idle(500);
+    corpus.push_back(flicks.t);
+
+    rng_state = 5;
+    TraceBuilder shifted("shifted", shifted_config);
+    for (int i = 0; i < SEGMENTS_PER_SCENARIO; i++) {
+        shifted.idle(random_uniform(150, 600));
+        shifted.shifted_scroll(random_uniform(200, 1500), random_uniform(200, 600));
+    }
+    shifted.idle(500);
+    corpus.push_back(shifted.t);
+
+    rng_state = 6;
+    TraceBuilder shift_twist("shift-twist", shift_twist_config);
+    shift_twist.held_buttons = 1 << SHIFT_BUTTON;
+    for (int i = 0; i < SEGMENTS_PER_SCENARIO; i++) {
+        shift_twist.idle(random_uniform(0, 150));
+        if (random_uniform(0, 1) < 0.5) {
+            shift_twist.cursor(random_uniform(100, 1500), random_uniform(150, 600), 0.25);
+        } else {
+            shift_twist.twist(random_uniform(200, 1200), random_uniform(150, 500));
+        }
+    }
+    shift_twist.idle(500);
+    corpus.push_back(shift_twist.t);
+
+    rng_state = 7;
+    TraceBuilder turned("turned", turned_config);
+    turned.turned = true;
+    for (int i = 0; i < SEGMENTS_PER_SCENARIO; i++) {
+        turned.idle(random_uniform(0, 150));
+        if (random_uniform(0, 1) < 0.5) {
+            turned.cursor(random_uniform(100, 1500), random_uniform(150, 600), 0.25);
+        } else {
+            turned.twist(random_uniform(200, 1200), random_uniform(150, 500));
+        }
+    }
+    turned.idle(500);
+    corpus.push_back(turned.t);
+
+    return corpus;
+}
+
+static bool load_labeled_trace(const char* path, labeled_trace_t* labeled) {
+    const char* name = strrchr(path, '/');
+    name = (name != nullptr) ? name + 1 : path;
+    Label label;
+    if (!strncmp(name, "cursor", 6)) {
+        label = Label::CURSOR;
+    } else if (!strncmp(name, "twist", 5)) {
+        label = Label::TWIST;
+    } else if (!strncmp(name, "shifted", 7)) {
+        label = Label::SHIFTED_SCROLL;
+    } else {
+        fprintf(stderr, "%s: name doesn't start with cursor, twist or shifted\n", path);
+        return false;
+    }
+    if (!trace_load(path, &labeled->trace)) {
+        fprintf(stderr, "%s: not a valid trace\n", path);
+        return false;
+    }
+    labeled->scenario = name;
+    labeled->segments.push_back({ label, 0 });
+    return true;
+}
+
+// What the logic would send if it didn't try to tell twisting from rolling.
+static output_t expected_output(const config_t& config, const trace_record_t& record) {
+    output_t out = { 0, 0, 0, 0 };
+    bool shifted = false;
+    for (int i = 0; i < NBUTTONS; i++) {
+        if (config.button_function[i] == ButtonFunction::SHIFT && (record.buttons & (1 << i))) {
+            shifted = true;
+        }
+    }
+    for (int sensor = 0; sensor < NSENSORS; sensor++) {
+        for (int axis = 0; axis < 2; axis++) {
+            SensorFunction function =
+                shifted ? config.sensor_shifted_function[sensor][axis] : config.sensor_function[sensor][axis];
+            int32_t movement = record.movement[sensor][axis];
+            if (static_cast<int>(function) < 0) {
+                movement = -movement;
+            }
+            switch (abs(static_cast<int>(function))) {
+                case static_cast<int>(SensorFunction::CURSOR_X):
+                    out.dx += movement;
+                    break;
+                case static_cast<int>(SensorFunction::CURSOR_Y):
+                    out.dy += movement;
+                    break;
+                case static_cast<int>(SensorFunction::VERTICAL_SCROLL):
+                    out.vwheel += movement;
+                    break;
+                case static_cast<int>(SensorFunction::HORIZONTAL_SCROLL):
+                    out.hwheel += movement;
+                    break;
+            }
+        }
+    }
+    return out;
+}
+
+struct timed_report_t {
+    uint32_t time_us;  // of the record it was sent for
+    output_t output;
+};
+
+static std::vector<timed_report_t> reports;
+
+static void collect_report(uint8_t report_id, const void* data, uint16_t len) {
+    if (report_id != 1) {
+        return;
+    }
+    const hid_report_t* report = (const hid_report_t*) data;
+    reports.push_back({ (uint32_t) hal_time_us(), { report->dx, report->dy, report->vwheel, report->hwheel } });
+}
+
+// what was reported after each record, nothing if there was no report
+static std::vector<output_t> reports_by_record(const std::vector<trace_record_t>& records) {
+    std::vector<output_t> outputs(records.size(), { 0, 0, 0, 0 });
+    size_t r = 0;
+    for (size_t i = 0; i < records.size() && r < reports.size(); i++) {
+        if (reports[r].time_us == records[i].time_us) {
+            outputs[i] = reports[r++].output;
+        }
+    }
+    return outputs;
+}
+
+struct results_t {
+    int cursor_segments = 0;
+    int false_positives = 0;
+    int scroll_segments = 0;
+    int false_negatives = 0;
+    std::vector<double> time_to_scroll_ms;
+    int64_t cursor_counts = 0;
+    int64_t lost_cursor_counts = 0;
+    int64_t scroll_counts = 0;
+    int64_t lost_scroll_counts = 0;
+
+    void add(const results_t& other) {
+        cursor_segments += other.cursor_segments;
+        false_positives += other.false_positives;
+        scroll_segments += other.scroll_segments;
+        false_negatives += other.false_negatives;
+        time_to_scroll_ms.insert(time_to_scroll_ms.end(), other.time_to_scroll_ms.begin(), other.time_to_scroll_ms.end());
+        cursor_counts += other.cursor_counts;
+        lost_cursor_counts += other.lost_cursor_counts;
+        scroll_counts += other.scroll_counts;
+        lost_scroll_counts += other.lost_scroll_counts;
+    }
+};
+
+static results_t evaluate(const labeled_trace_t& labeled) {
+    results_t results;
+    const std::vector<trace_record_t>& records = labeled.trace.records;
+
+    reports.clear();
+    trace_replay(labeled.trace);
+    std::vector<output_t> outputs = reports_by_record(records);
+
+    for (size_t s = 0; s < labeled.segments.size(); s++) {
+        const segment_t& segment = labeled.segments[s];
+        size_t end = (s + 1 < labeled.segments.size()) ? labeled.segments[s + 1].start : records.size();
+
+        output_t expected = { 0, 0, 0, 0 };
+        output_t actual = { 0, 0, 0, 0 };
+        int64_t first_scroll_us = -1;
+        for (size_t i = segment.start; i < end; i++) {
+            output_t e = expected_output(labeled.trace.header.config, records[i]);
+            expected.dx += e.dx;
+            expected.dy += e.dy;
+            expected.vwheel += e.vwheel;
+            expected.hwheel += e.hwheel;
+            actual.dx += outputs[i].dx;
+            actual.dy += outputs[i].dy;
+            actual.vwheel += outputs[i].vwheel;
+            actual.hwheel += outputs[i].hwheel;
+            if (first_scroll_us < 0 && (outputs[i].vwheel != 0 || outputs[i].hwheel != 0)) {
+                first_scroll_us = (uint32_t) (records[i].time_us - records[segment.start].time_us);
+            }
+        }
+
+        int64_t lost_cursor = llabs(expected.dx - actual.dx) + llabs(expected.dy - actual.dy);
+        int64_t lost_scroll = llabs(expected.vwheel - actual.vwheel) + llabs(expected.hwheel - actual.hwheel);
+        int64_t expected_scroll = llabs(expected.vwheel) + llabs(expected.hwheel);
+
+        if (segment.label == Label::CURSOR) {
+            results.cursor_segments++;
+            if (actual.vwheel != 0 || actual.hwheel != 0 || first_scroll_us >= 0) {
+                results.false_positives++;
+            }
+            results.cursor_counts += llabs(expected.dx) + llabs(expected.dy);
+            results.lost_cursor_counts += lost_cursor;
+        } else {
+            results.scroll_segments++;
+            if (lost_scroll * 2 > expected_scroll) {
+                results.false_negatives++;
+            }
+            if (first_scroll_us >= 0) {
+                results.time_to_scroll_ms.push_back(first_scroll_us / 1000.0);
+            }
+            results.scroll_counts += expected_scroll;
+            results.lost_scroll_counts += lost_scroll;
+        }
+    }
+
+    return results;
+}
+
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return NAN;
+    }
+    std::sort(values.begin(), values.end());
+    return values[(size_t) (p / 100 * (values.size() - 1) + 0.5)];
+}
+
+static double percentage(int64_t part, int64_t whole) {
+    return whole > 0 ? 100.0 * part / whole : NAN;
+}
+
+static void print_results(const char* name, const results_t& r) {
+    printf("%-12s %5.1f %5.1f  %6.1f %6.1f  %8.1f %8.1f\n", name,
+        percentage(r.false_positives, r.cursor_segments), percentage(r.false_negatives, r.scroll_segments),
+        percentile(r.time_to_scroll_ms, 50), percentile(r.time_to_scroll_ms, 90),
+        percentage(r.lost_cursor_counts, r.cursor_counts), percentage(r.lost_scroll_counts, r.scroll_counts));
+}
+
+int main(int argc, char** argv) {
+    const char* save_dir = nullptr;
+    std::vector<labeled_trace_t> traces;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--save") && i + 1 < argc) {
+            save_dir = argv[++i];
+        } else if (!strcmp(argv[i], "--interval") && i + 1 < argc) {
+            corpus_interval_us = atoi(argv[++i]);
+            if (corpus_interval_us == 0) {
+                fprintf(stderr, "invalid interval\n");
+                return 1;
+            }
+        } else {
+            labeled_trace_t labeled;
+            if (!load_labeled_trace(argv[i], &labeled)) {
+                return 1;
+            }
+            traces.push_back(labeled);
+        }
+    }
+
+    std::vector<labeled_trace_t> corpus = make_corpus();
+    corpus.insert(corpus.end(), traces.begin(), traces.end());
+
+    if (save_dir != nullptr) {
+        for (const labeled_trace_t& labeled : corpus) {
+            std::string path = std::string(save_dir) + "/" + labeled.scenario + ".bin";
+            if (!trace_save(path.c_str(), labeled.trace)) {
+                fprintf(stderr, "%s: can't write\n", path.c_str());
+                return 1;
+            }
+        }
+    }
+
+    host_set_report_callback(collect_report);
+
+    printf("%-12s %5s %5s  %13s  %8s %8s\n", "", "FP%", "FN%", "to scroll ms", "lost", "lost");
+    printf("%-12s %5s %5s  %6s %6s  %8s %8s\n", "scenario", "", "", "p50", "p90", "cursor%", "scroll%");
+    results_t total;
+    for (const labeled_trace_t& labeled : corpus) {
+        results_t results = evaluate(labeled);
+        print_results(labeled.scenario.c_str(), results);
+        total.add(results);
+    }
+    print_results("all", total);
+
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include "config_store.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "crc.h"
+#include "hal.h"
+
+#define NSLOTS (CONFIG_STORE_SECTORS * CONFIG_STORE_SLOTS_PER_SECTOR)
+
+// from the last scan or save, -1 if there are no valid records
+static int newest_slot = -1;
+static uint32_t newest_sequence = 0;
+static bool scanned = false;
+
+static const config_record_t* slot_record(int slot) {
+    return (const config_record_t*) (hal_flash_store() + slot * CONFIG_STORE_SLOT_SIZE);
+}
+
+static bool record_ok(const config_record_t* record) {
+    return record->magic == CONFIG_STORE_MAGIC &&
+           crc32((const uint8_t*) record, offsetof(config_record_t, crc32)) == record->crc32;
+}
+
+static bool blank(const uint8_t* data, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        if (data[i] != 0xff) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool slot_blank(int slot) {
+    return blank((const uint8_t*) slot_record(slot), CONFIG_STORE_SLOT_SIZE);
+}
+
+static void scan() {
+    newest_slot = -1;
+    newest_sequence = 0;
+    for (int slot = 0; slot < NSLOTS; slot++) {
+        const config_record_t* record = slot_record(slot);
+        if (record_ok(record) && (newest_slot < 0 || record->sequence > newest_sequence)) {
+            newest_slot = slot;
+            newest_sequence = record->sequence;
+        }
+    }
+    scanned = true;
+}
+
+const uint8_t* config_store_load() {
+    scan();
+    return newest_slot >= 0 ? slot_record(newest_slot)->config : nullptr;
+}
+
+void config_store_save(const uint8_t* config) {
+    if (!scanned) {
+        scan();
+    }
+
+    config_record_t record;
+    record.magic = CONFIG_STORE_MAGIC;
+    record.sequence = newest_sequence + 1;
+    memcpy(record.config, config, CONFIG_SIZE);
+    record.crc32 = crc32((const uint8_t*) &record, offsetof(config_record_t, crc32));
+
+    // skip whatever a cut short save left behind, up to the end of the sector
+    int slot = newest_slot + 1;
+    while (slot % CONFIG_STORE_SLOTS_PER_SECTOR != 0 && !slot_blank(slot)) {
+        slot++;
+    }
+    // moving on to the next sector, which only has older records
+    if (slot % CONFIG_STORE_SLOTS_PER_SECTOR == 0) {
+        slot %= NSLOTS;
+        uint32_t sector_offset = slot * CONFIG_STORE_SLOT_SIZE;
+        if (!blank(hal_flash_store() + sector_offset, CONFIG_STORE_SECTOR_SIZE)) {
+            hal_flash_erase(sector_offset);
+        }
+    }
+
+    hal_flash_program(slot * CONFIG_STORE_SLOT_SIZE, (const uint8_t*) &record, sizeof(record));
+    newest_slot = slot;
+    newest_sequence = record.sequence;
+}
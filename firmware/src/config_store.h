@@ -0,0 +1,41 @@
+#ifndef _CONFIG_STORE_H_
+#define _CONFIG_STORE_H_
+
+#include <stdint.h>
+
+#include "trackball.h"
+
+// The config in flash, as an append-only log of records spread over
+// CONFIG_STORE_SECTORS sectors. Every save programs the next blank slot and
+// the newest valid record wins, so a sector is only erased when the log moves
+// into it again, once every CONFIG_STORE_SECTORS * CONFIG_STORE_SLOTS_PER_SECTOR
+// saves. A save that was cut short leaves a record that fails its CRC and
+// the one before it is used.
+
+#define CONFIG_STORE_SECTOR_SIZE 4096
+#define CONFIG_STORE_SECTORS 4
+#define CONFIG_STORE_SIZE (CONFIG_STORE_SECTORS * CONFIG_STORE_SECTOR_SIZE)
+#define CONFIG_STORE_PAGE_SIZE 256  // slots never cross a page
+#define CONFIG_STORE_SLOT_SIZE 128
+#define CONFIG_STORE_SLOTS_PER_SECTOR (CONFIG_STORE_SECTOR_SIZE / CONFIG_STORE_SLOT_SIZE)
+
+#define CONFIG_STORE_MAGIC 0x46434254  // "TBCF"
+
+struct __attribute__((packed)) config_record_t {
+    uint32_t magic;
+    uint32_t sequence;  // one more than the record before
+    uint8_t config[CONFIG_SIZE];
+    uint32_t crc32;  // of everything above
+};
+
+static_assert(sizeof(config_record_t) <= CONFIG_STORE_SLOT_SIZE, "config record doesn't fit in a slot");
+static_assert(CONFIG_STORE_PAGE_SIZE % CONFIG_STORE_SLOT_SIZE == 0, "slots would cross pages");
+
+// CONFIG_SIZE bytes of the newest valid record, or nullptr if there isn't
+// one. Not necessarily a valid config_t, it could be from another version.
+const uint8_t* config_store_load();
+
+// Appends a record, erasing the next sector first if the current one is full.
+void config_store_save(const uint8_t* config);
+
+#endif
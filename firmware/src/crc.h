@@ -1,7 +1,7 @@
 #ifndef _CRC_H_
 #define _CRC_H_
 
-#include <pico/stdlib.h>
+#include <stdint.h>
 
 uint32_t crc32(const uint8_t* buf, int len);
 
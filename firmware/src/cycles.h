@@ -0,0 +1,25 @@
+#ifndef _CYCLES_H_
+#define _CYCLES_H_
+
+#include <hardware/structs/systick.h>
+
+// SysTick used as a free running 24-bit cycle counter. It counts down at clk_sys.
+// Every core has its own SysTick, so cycle_counter_init() has to be called on
+// the core that does the measuring.
+
+inline void cycle_counter_init() {
+    systick_hw->rvr = 0x00ffffff;
+    systick_hw->cvr = 0;
+    systick_hw->csr = 0x5;  // enable, count processor clock, no interrupt
+}
+
+inline uint32_t cycle_count() {
+    return systick_hw->cvr;
+}
+
+// only correct for intervals shorter than 2^24 cycles (~134 ms at 125 MHz)
+inline uint32_t cycles_elapsed(uint32_t start, uint32_t end) {
+    return (start - end) & 0x00ffffff;
+}
+
+#endif
@@ -0,0 +1,61 @@
+#include "debounce.h"
+
+#include <string.h>
+
+void debounce_init(debouncer_t* d, uint32_t raw) {
+    memset(d, 0, sizeof(*d));
+    d->state = raw;
+    d->raw = raw;
+}
+
+void debounce_event(debouncer_t* d, const button_event_t* event) {
+    uint32_t bit = 1 << event->button;
+    if (event->pressed) {
+        d->raw |= bit;
+        if (!(d->state & bit)) {
+            d->state |= bit;
+            if (!d->new_press) {
+                d->new_press = true;
+                d->press_us = event->time_us;
+            }
+            return;
+        }
+        d->release_pending &= ~bit;
+    } else {
+        d->raw &= ~bit;
+        if (d->state & bit) {
+            if (!(d->release_pending & bit)) {
+                d->release_pending |= bit;
+                d->opened_us[event->button] = event->time_us;
+                return;
+            }
+            // bounced closed and open again, the wait starts over
+            d->opened_us[event->button] = event->time_us;
+        }
+    }
+    d->bounces++;
+}
+
+uint32_t debounce_update(debouncer_t* d, uint32_t now_us, uint32_t raw) {
+    uint32_t missed = raw ^ d->raw;
+    for (int i = 0; i < NBUTTONS; i++) {
+        if (missed & (1 << i)) {
+            button_event_t event = { now_us, (uint8_t) i, (raw & (1 << i)) != 0 };
+            debounce_event(d, &event);
+        }
+        if ((d->release_pending & (1 << i)) && now_us - d->opened_us[i] >= DEBOUNCE_RELEASE_US) {
+            d->state &= ~(1 << i);
+            d->release_pending &= ~(1 << i);
+        }
+    }
+    return d->state;
+}
+
+bool debounce_take_press(debouncer_t* d, uint32_t* press_us) {
+    if (!d->new_press) {
+        return false;
+    }
+    d->new_press = false;
+    *press_us = d->press_us;
+    return true;
+}
@@ -0,0 +1,43 @@
+#ifndef _DEBOUNCE_H_
+#define _DEBOUNCE_H_
+
+#include <stdint.h>
+
+#include "trackball.h"
+
+// Button debouncing from timestamped edges. A press counts as soon as its
+// first edge comes in, since a switch that starts bouncing has been pressed.
+// A release only counts once the switch has stayed open for
+// DEBOUNCE_RELEASE_US, so the bouncing after the press and before the
+// release is ignored, and every click lasts at least that long.
+
+#define DEBOUNCE_RELEASE_US 5000
+
+// one edge on a button's pin, pressed is the level right after it
+struct button_event_t {
+    uint32_t time_us;
+    uint8_t button;
+    bool pressed;
+};
+
+struct debouncer_t {
+    uint32_t state;  // debounced, bit i set if button i is pressed
+    uint32_t raw;  // the levels after the last edges
+    uint32_t release_pending;  // open, but not for long enough yet
+    uint32_t opened_us[NBUTTONS];
+    bool new_press;  // since debounce_take_press()
+    uint32_t press_us;  // first edge of the earliest new press
+    uint32_t bounces;  // edges that didn't change the debounced state
+};
+
+void debounce_init(debouncer_t* d, uint32_t raw);
+void debounce_event(debouncer_t* d, const button_event_t* event);
+
+// Debounced state at now_us. raw is the current levels, if an edge got lost
+// on the way they're taken as an edge at now_us.
+uint32_t debounce_update(debouncer_t* d, uint32_t now_us, uint32_t raw);
+
+// True if a button went down since the previous call, *press_us is when.
+bool debounce_take_press(debouncer_t* d, uint32_t* press_us);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef _FRAME_H_
+#define _FRAME_H_
+
+#include <stdint.h>
+
+// Frame capture: the raw images a sensor sees, for spotting a dirty lens or
+// a bad ball surface. While frames are being captured core 1 doesn't track
+// at all, and afterwards the sensor is started up again, which takes a bit.
+//
+// Frames are FRAME_SIZE bytes, one byte per pixel, FRAME_WIDTH pixels per
+// row. They can be read in chunks with feature report FRAME_REPORT_ID:
+//   SET_REPORT: [FRAME_START] [sensor] or [FRAME_STOP]
+//   GET_REPORT: [frame] [chunk] [sensor] [0] [FRAME_CHUNK_SIZE bytes]
+// frame counts frames since the start, chunk is 0 to FRAME_CHUNKS - 1, or
+// FRAME_NO_CHUNK if the next frame isn't there yet. Or they can be streamed
+// over the bulk interface (see stream.h) with STREAM_FRAMES(sensor), in
+// packets of the same type: [sensor] [frame] [uint16_t offset] [data]. Either
+// way, a frame is captured while the previous one is being read.
+// config-tool/trackball-frames.py saves them as images.
+
+#define FRAME_WIDTH 36
+#define FRAME_SIZE (FRAME_WIDTH * FRAME_WIDTH)
+
+#define FRAME_REPORT_ID 6
+#define FRAME_REPORT_SIZE 62
+#define FRAME_CHUNK_SIZE (FRAME_REPORT_SIZE - 4)
+#define FRAME_CHUNKS ((FRAME_SIZE + FRAME_CHUNK_SIZE - 1) / FRAME_CHUNK_SIZE)
+#define FRAME_NO_CHUNK 0xFF
+
+#define FRAME_STOP 0
+#define FRAME_START 1
+
+#define FRAME_NO_SENSOR -1
+
+#endif
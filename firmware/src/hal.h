@@ -0,0 +1,88 @@
+#ifndef _HAL_H_
+#define _HAL_H_
+
+#include <stdint.h>
+
+#include "trackball.h"
+
+// Everything the logic in trackball.cc needs from the platform it runs on.
+// hal_pico.cc implements it on the RP2040, host/hal_host.cc on a regular
+// computer, where it's fed with whatever the caller wants.
+
+struct sensor_reading_t {
+    int16_t movement[2];
+    bool motion;  // the sensor saw motion, even if it added up to less than a count
+};
+
+uint64_t hal_time_us();
+
+// CPU cycles, counting up and wrapping around at 2^24, so the difference
+// between two calls is (end - start) & 0x00ffffff. Only for measuring.
+uint32_t hal_cycle_count();
+
+// bit i is set if button i is pressed, debounced
+uint32_t hal_buttons_get();
+// When the earliest button that went down in the last hal_buttons_get() was
+// pressed, lower 32 bits of hal_time_us(). Only means something if one did.
+uint32_t hal_buttons_press_us();
+// edges the debouncing ignored
+uint32_t hal_button_bounces();
+
+// motion since the previous call
+void hal_sensors_read(sensor_reading_t readings[NSENSORS]);
+void hal_sensor_set_cpi(int sensor, unsigned int cpi);
+
+// Rest mode settings in the PMW3360's own terms: run_downshift in 10 ms,
+// the rates are frame periods in ms minus one and the rest downshifts are
+// in 320 and 32 frame periods of rest 1 and 2. Takes a few milliseconds.
+struct sensor_rest_t {
+    bool enabled;
+    uint8_t run_downshift;
+    uint16_t rest1_rate;
+    uint8_t rest1_downshift;
+    uint16_t rest2_rate;
+    uint8_t rest2_downshift;
+    uint16_t rest3_rate;
+};
+
+void hal_sensor_set_rest(int sensor, const sensor_rest_t* rest);
+
+// The CONFIG_STORE_SIZE bytes of flash the config store lives in (see
+// config_store.h), readable as memory. Offsets are from its start.
+// hal_flash_erase() erases the CONFIG_STORE_SECTOR_SIZE sector at offset to
+// 0xff, hal_flash_program() programs bytes that must be erased and within
+// one CONFIG_STORE_PAGE_SIZE page. Both take a while, but the other core
+// keeps running if the platform can manage it.
+const uint8_t* hal_flash_store();
+void hal_flash_erase(uint32_t offset);
+void hal_flash_program(uint32_t offset, const uint8_t* data, uint32_t len);
+
+// True when a report can be sent and it's a good time to send it. That can
+// be later than when the endpoint frees up, so that the report carries the
+// freshest data when the host polls, unless it's urgent. The platform calls
+// handle_report_complete() once the report is sent.
+bool hal_hid_ready(bool urgent);
+void hal_hid_report(uint8_t report_id, const void* report, uint16_t len);
+
+// Signals the suspended host to resume the bus. Only call it when
+// handle_suspend() said that's allowed.
+void hal_usb_remote_wakeup();
+
+// Frame capture, see frame.h. hal_frame_capture() starts capturing frames
+// from a sensor over and over, or stops with FRAME_NO_SENSOR. hal_frame_get()
+// returns the oldest frame that's been captured since, or nullptr, and it
+// stays put until hal_frame_release().
+void hal_frame_capture(int sensor);
+const uint8_t* hal_frame_get();
+void hal_frame_release();
+
+// The bulk stream (see stream.h), on platforms that have one, otherwise
+// nothing is ever available or read. hal_stream_write() never waits, so only
+// write what hal_stream_available() says fits.
+uint32_t hal_stream_available();
+void hal_stream_write(const void* data, uint32_t len);
+uint32_t hal_stream_read(void* data, uint32_t len);
+
+void hal_reset_into_bootloader();
+
+#endif
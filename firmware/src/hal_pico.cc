@@ -0,0 +1,812 @@
+/* 
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Jacek Fedorynski
+ * Copyright (c) 2019 Ha Thach (tinyusb.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+// The RP2040 side of the firmware: hardware abstraction layer functions for
+// the logic in trackball.cc, the two cores' main loops and the TinyUSB glue.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+
+#include <bsp/board.h>
+#include <tusb.h>
+
+#include <pico/bootrom.h>
+#include <pico/multicore.h>
+#include <pico/stdlib.h>
+
+#include <hardware/flash.h>
+#include <hardware/gpio.h>
+
+#include "config_store.h"
+#include "cycles.h"
+#include "debounce.h"
+#include "frame.h"
+#include "hal.h"
+#include "pmw3360.h"
+#include "poll_phase.h"
+#include "spsc_queue.h"
+#include "stats.h"
+#include "trace.h"
+#include "trackball.h"
+
+// These IDs are bogus. If you want to distribute any hardware using this,
+// you will have to get real ones.
+#define USB_VID 0xCAFE
+#define USB_PID 0xBADA
+
+// uncomment to have core 1 print (on the UART) how many CPU cycles reading
+// the sensors takes, how many of them the CPU actually spends working and
+// how many asleep
+// #define SPI_BENCHMARK
+
+// uncomment to have core 1 print how long after power-on the sensors were up
+// and the first sample was taken
+// #define STARTUP_BENCHMARK
+
+// Just-in-time reports, see poll_phase.h. Core 1 shifts its samples so
+// that one of them finishes SAMPLE_MARGIN_US before a report is due.
+// Both TinyUSB callbacks run from tud_task(), which core 0 calls in a tight
+// loop, so their timestamps are late by about the same few microseconds.
+#define SAMPLE_MARGIN_US 20
+// how far one sample can be moved towards its slot, so that a late SOF
+// callback doesn't throw the schedule around
+#define MAX_SAMPLE_SHIFT_US 25
+
+// Core 1 sleeps with WFE between samples and is woken up by the button and
+// MOTION pin interrupts or by an alarm this long before the next sample, the rest is
+// waited out awake so that the sample starts on time.
+#define WAKE_MARGIN_US 20
+// Core 0 has to run tud_task() in a tight loop for the SOF timestamps above,
+// it only sleeps while the bus is suspended, waking up at least this often.
+#define SUSPENDED_WAKE_US 10000
+
+#define PRESUMED_FLASH_SIZE 2097152
+#define CONFIG_STORE_OFFSET_IN_FLASH (PRESUMED_FLASH_SIZE - CONFIG_STORE_SIZE)
+#define CONFIG_STORE_IN_MEMORY (((uint8_t*) XIP_BASE) + CONFIG_STORE_OFFSET_IN_FLASH)
+
+static_assert(CONFIG_STORE_SECTOR_SIZE == FLASH_SECTOR_SIZE);
+static_assert(CONFIG_STORE_PAGE_SIZE == FLASH_PAGE_SIZE);
+
+uint button_pins[NBUTTONS] = { 16, 17, 24, 26 };
+
+// Every edge on a button pin is timestamped by an interrupt on core 1 and
+// queued for the debouncer, which runs on the same core outside the
+// interrupt. A press wakes core 1 up to take a sample right away.
+SPSCQueue<button_event_t, 64> button_events;
+debouncer_t debouncer;  // core 1
+uint32_t press_us = 0;  // core 1, from the last hal_buttons_get()
+
+// Boards with the sensors' MOTION pins connected (MOTION_INTERRUPT) wake
+// core 1 up as soon as a sensor sees motion while it's sampling slower than
+// configured. The pins go low on motion and back up when it's read out, so
+// the flag is cleared right before reading the sensors.
+std::atomic<bool> motion_irq{ false };  // core 1
+
+#define SENSOR0_SPI spi0
+#define SENSOR0_MISO 4
+#define SENSOR0_MOSI 3
+#define SENSOR0_SCK 2
+#define SENSOR0_NCS 9
+#define SENSOR0_MOTION 5
+#ifdef SENSOR1_ON_SPI1
+// Alternative board mapping with the second sensor on its own SPI peripheral.
+// Both sensors are then read at the same time.
+#define SENSOR1_SPI spi1
+#define SENSOR1_MISO 12
+#define SENSOR1_MOSI 11
+#define SENSOR1_SCK 10
+#define SENSOR1_NCS 13
+#define SENSOR1_MOTION 14
+#define SENSORS_SHARE_SPI false
+#else
+#define SENSOR1_SPI spi0
+#define SENSOR1_MISO 20
+#define SENSOR1_MOSI 23
+#define SENSOR1_SCK 18
+#define SENSOR1_NCS 25
+#define SENSOR1_MOTION 21
+#define SENSORS_SHARE_SPI true
+#endif
+
+poll_phase_t poll_phase;  // in time_us_32(), written by core 0
+
+// Frame capture, see frame.h. Core 0 writes capture_request: the sensor
+// plus one in the low byte, zero to stop, and a count above it so that
+// every request is different. Core 1 captures into the two buffers in turn
+// and tags each with the request it was for, core 0 reads them in the same
+// order and skips the ones from an earlier request.
+std::atomic<uint32_t> capture_request{ 0 };
+uint8_t capture_buffers[2][FRAME_SIZE];
+uint32_t capture_tag[2];
+std::atomic<bool> capture_ready[2];
+uint8_t capture_write = 0;  // core 1
+uint8_t capture_read = 0;  // core 0
+static_assert(FRAME_SIZE == PMW3360_FRAME_SIZE);
+
+PMW3360 sensors[NSENSORS] = {
+    PMW3360(SENSOR0_SPI, SENSOR0_MISO, SENSOR0_MOSI, SENSOR0_SCK, SENSOR0_NCS, SENSORS_SHARE_SPI),
+    PMW3360(SENSOR1_SPI, SENSOR1_MISO, SENSOR1_MOSI, SENSOR1_SCK, SENSOR1_NCS, SENSORS_SHARE_SPI),
+};
+
+tusb_desc_device_t const desc_device = {
+    .bLength = sizeof(tusb_desc_device_t),
+    .bDescriptorType = TUSB_DESC_DEVICE,
+    .bcdUSB = 0x0200,
+    .bDeviceClass = 0x00,
+    .bDeviceSubClass = 0x00,
+    .bDeviceProtocol = 0x00,
+    .bMaxPacketSize0 = CFG_TUD_ENDPOINT0_SIZE,
+
+    .idVendor = USB_VID,
+    .idProduct = USB_PID,
+    .bcdDevice = 0x0100,
+
+    .iManufacturer = 0x01,
+    .iProduct = 0x02,
+    .iSerialNumber = 0x00,
+
+    .bNumConfigurations = 0x01,
+};
+
+uint8_t const desc_hid_report[] = {
+    0x05, 0x01,         // Usage Page (Generic Desktop Ctrls)
+    0x09, 0x02,         // Usage (Mouse)
+    0xA1, 0x01,         // Collection (Application)
+    0x05, 0x01,         //   Usage Page (Generic Desktop Ctrls)
+    0x09, 0x02,         //   Usage (Mouse)
+    0xA1, 0x02,         //   Collection (Logical)
+    0x85, 0x01,         //     Report ID (1)
+    0x09, 0x01,         //     Usage (Pointer)
+    0xA1, 0x00,         //     Collection (Physical)
+    0x05, 0x09,         //       Usage Page (Button)
+    0x19, 0x01,         //       Usage Minimum (0x01)
+    0x29, 0x08,         //       Usage Maximum (0x08)
+    0x95, 0x08,         //       Report Count (8)
+    0x75, 0x01,         //       Report Size (1)
+    0x25, 0x01,         //       Logical Maximum (1)
+    0x81, 0x02,         //       Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position)
+    0x05, 0x01,         //       Usage Page (Generic Desktop Ctrls)
+    0x09, 0x30,         //       Usage (X)
+    0x09, 0x31,         //       Usage (Y)
+    0x95, 0x02,         //       Report Count (2)
+    0x75, 0x10,         //       Report Size (16)
+    0x16, 0x00, 0x80,   //       Logical Minimum (-32768)
+    0x26, 0xFF, 0x7F,   //       Logical Maximum (32767)
+    0x81, 0x06,         //       Input (Data,Var,Rel,No Wrap,Linear,Preferred State,No Null Position)
+    0xA1, 0x02,         //       Collection (Logical)
+    0x85, 0x02,         //         Report ID (2)
+    0x09, 0x48,         //         Usage (Resolution Multiplier)
+    0x95, 0x01,         //         Report Count (1)
+    0x75, 0x02,         //         Report Size (2)
+    0x15, 0x00,         //         Logical Minimum (0)
+    0x25, 0x01,         //         Logical Maximum (1)
+    0x35, 0x01,         //         Physical Minimum (1)
+    0x45, 0x78,         //         Physical Maximum (120)
+    0xB1, 0x02,         //         Feature (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+    0x85, 0x01,         //         Report ID (1)
+    0x09, 0x38,         //         Usage (Wheel)
+    0x35, 0x00,         //         Physical Minimum (0)
+    0x45, 0x00,         //         Physical Maximum (0)
+    0x16, 0x00, 0x80,   //         Logical Minimum (-32768)
+    0x26, 0xFF, 0x7F,   //         Logical Maximum (32767)
+    0x75, 0x10,         //         Report Size (16)
+    0x81, 0x06,         //         Input (Data,Var,Rel,No Wrap,Linear,Preferred State,No Null Position)
+    0xC0,               //       End Collection
+    0xA1, 0x02,         //       Collection (Logical)
+    0x85, 0x02,         //         Report ID (2)
+    0x09, 0x48,         //         Usage (Resolution Multiplier)
+    0x75, 0x02,         //         Report Size (2)
+    0x15, 0x00,         //         Logical Minimum (0)
+    0x25, 0x01,         //         Logical Maximum (1)
+    0x35, 0x01,         //         Physical Minimum (1)
+    0x45, 0x78,         //         Physical Maximum (120)
+    0xB1, 0x02,         //         Feature (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+    0x35, 0x00,         //         Physical Minimum (0)
+    0x45, 0x00,         //         Physical Maximum (0)
+    0x75, 0x04,         //         Report Size (4)
+    0xB1, 0x03,         //         Feature (Const,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+    0x85, 0x01,         //         Report ID (1)
+    0x05, 0x0C,         //         Usage Page (Consumer)
+    0x16, 0x00, 0x80,   //         Logical Minimum (-32768)
+    0x26, 0xFF, 0x7F,   //         Logical Maximum (32767)
+    0x75, 0x10,         //         Report Size (16)
+    0x0A, 0x38, 0x02,   //         Usage (AC Pan)
+    0x81, 0x06,         //         Input (Data,Var,Rel,No Wrap,Linear,Preferred State,No Null Position)
+    0xC0,               //       End Collection
+    0xC0,               //     End Collection
+    0xC0,               //   End Collection
+    0x06, 0x00, 0xFF,   //   Usage Page (Vendor Defined 0xFF00)
+    0x09, 0x20,         //   Usage (0x20)
+    0x85, 0x03,         //   Report ID (3)
+    0x75, 0x08,         //   Report Size (8)
+    0x95, CONFIG_SIZE,  //   Report Count (CONFIG_SIZE)
+    0xB1, 0x02,         //   Feature (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+    0x09, 0x21,         //   Usage (0x21)
+    0x85, 0x04,         //   Report ID (4)
+    0x75, 0x08,         //   Report Size (8)
+    0x95, TRACE_REPORT_SIZE,  //   Report Count (TRACE_REPORT_SIZE)
+    0xB1, 0x02,         //   Feature (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+    0x09, 0x22,         //   Usage (0x22)
+    0x85, 0x05,         //   Report ID (5)
+    0x75, 0x08,         //   Report Size (8)
+    0x95, STATS_REPORT_SIZE,  //   Report Count (STATS_REPORT_SIZE)
+    0xB1, 0x02,         //   Feature (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+    0x09, 0x23,         //   Usage (0x23)
+    0x85, 0x06,         //   Report ID (6)
+    0x75, 0x08,         //   Report Size (8)
+    0x95, FRAME_REPORT_SIZE,  //   Report Count (FRAME_REPORT_SIZE)
+    0xB1, 0x02,         //   Feature (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+    0xC0,               // End Collection
+};
+
+#define EPNUM_HID 0x81
+
+#ifdef VENDOR_INTERFACE
+#define CONFIG_TOTAL_LEN (TUD_CONFIG_DESC_LEN + TUD_HID_DESC_LEN + TUD_VENDOR_DESC_LEN)
+#define ITF_COUNT 2
+#define EPNUM_VENDOR_OUT 0x02
+#define EPNUM_VENDOR_IN 0x82
+#else
+#define CONFIG_TOTAL_LEN (TUD_CONFIG_DESC_LEN + TUD_HID_DESC_LEN)
+#define ITF_COUNT 1
+#endif
+
+uint8_t const desc_configuration[] = {
+    // Config number, interface count, string index, total length, attribute, power in mA
+    TUD_CONFIG_DESCRIPTOR(1, ITF_COUNT, 0, CONFIG_TOTAL_LEN, TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, 100),
+
+    // Interface number, string index, protocol, report descriptor len, EP In address, size & polling interval
+    TUD_HID_DESCRIPTOR(0, 0, HID_ITF_PROTOCOL_NONE, sizeof(desc_hid_report), EPNUM_HID, CFG_TUD_HID_EP_BUFSIZE, 1),
+
+#ifdef VENDOR_INTERFACE
+    // Interface number, string index, EP Out & IN address, EP size
+    TUD_VENDOR_DESCRIPTOR(1, 0, EPNUM_VENDOR_OUT, EPNUM_VENDOR_IN, CFG_TUD_VENDOR_EPSIZE),
+#endif
+};
+
+char const* string_desc_arr[] = {
+    (const char[]){ 0x09, 0x04 },  // 0: is supported language is English (0x0409)
+    "RP2040+PMW3360",              // 1: Manufacturer
+    "Trackball",                   // 2: Product
+};
+
+uint64_t hal_time_us() {
+    return time_us_64();
+}
+
+// SysTick counts down, each core sets up its own
+uint32_t hal_cycle_count() {
+    return 0x00ffffff - cycle_count();
+}
+
+uint32_t buttons_raw() {
+    uint32_t pin_state = gpio_get_all();
+    uint32_t buttons = 0;
+    for (int i = 0; i < NBUTTONS; i++) {
+        if (!(pin_state & (1 << button_pins[i]))) {
+            buttons |= 1 << i;
+        }
+    }
+    return buttons;
+}
+
+// the interrupts for the button and MOTION pins, core 1
+void gpio_irq(uint gpio, uint32_t events) {
+#ifdef MOTION_INTERRUPT
+    if (gpio == SENSOR0_MOTION || gpio == SENSOR1_MOTION) {
+        motion_irq.store(true, std::memory_order_relaxed);
+        return;
+    }
+#endif
+    uint32_t now = time_us_32();
+    for (int i = 0; i < NBUTTONS; i++) {
+        if (button_pins[i] == gpio) {
+            // if it doesn't fit, debounce_update() notices later
+            button_events.push({ now, (uint8_t) i, !gpio_get(gpio) });
+        }
+    }
+}
+
+void buttons_init() {
+    debounce_init(&debouncer, buttons_raw());
+    for (int i = 0; i < NBUTTONS; i++) {
+        gpio_set_irq_enabled_with_callback(button_pins[i], GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE, true, gpio_irq);
+    }
+#ifdef MOTION_INTERRUPT
+    gpio_set_irq_enabled_with_callback(SENSOR0_MOTION, GPIO_IRQ_EDGE_FALL, true, gpio_irq);
+    gpio_set_irq_enabled_with_callback(SENSOR1_MOTION, GPIO_IRQ_EDGE_FALL, true, gpio_irq);
+#endif
+}
+
+void drain_button_events() {
+    button_event_t event;
+    while (button_events.pop(event)) {
+        debounce_event(&debouncer, &event);
+    }
+}
+
+uint32_t hal_buttons_get() {
+    drain_button_events();
+    uint32_t buttons = debounce_update(&debouncer, time_us_32(), buttons_raw());
+    debounce_take_press(&debouncer, &press_us);
+    return buttons;
+}
+
+uint32_t hal_buttons_press_us() {
+    return press_us;
+}
+
+uint32_t hal_button_bounces() {
+    return debouncer.bounces;
+}
+
+enum class SampleTrigger : uint8_t {
+    SCHEDULE,
+    PRESS,
+    MOTION,
+};
+
+// Waits until then, until a button is pressed or, if on_motion, until a
+// sensor's MOTION pin goes low.
+SampleTrigger wait_for_sample(uint64_t then, bool on_motion) {
+    while (true) {
+        drain_button_events();
+        if (debouncer.new_press) {
+            return SampleTrigger::PRESS;
+        }
+        if (on_motion && motion_irq.load(std::memory_order_relaxed)) {
+            return SampleTrigger::MOTION;
+        }
+        uint64_t now = time_us_64();
+        if (now >= then) {
+            return SampleTrigger::SCHEDULE;
+        }
+        if (then - now > WAKE_MARGIN_US) {
+            best_effort_wfe_or_timeout(from_us_since_boot(then - WAKE_MARGIN_US));
+        }
+    }
+}
+
+void hal_sensors_read(sensor_reading_t readings[NSENSORS]) {
+    // motion from here on pulls a MOTION pin low again
+    motion_irq.store(false, std::memory_order_relaxed);
+
+#ifdef SPI_BENCHMARK
+    static uint32_t samples = 0;
+    static uint64_t total_cycles = 0;
+    static uint64_t busy_cycles = 0;
+    static uint64_t sleep_cycles = 0;
+
+    uint32_t start = cycle_count();
+    if (samples == 1000) {
+        // every once in a while do it the blocking way, for comparison
+        for (int i = 0; i < NSENSORS; i++) {
+            sensors[i].update();
+        }
+        uint32_t blocking_cycles = cycles_elapsed(start, cycle_count());
+        printf("sensor read: %u cycles, CPU busy for %u of them, asleep for %u, blocking read: %u cycles\n",
+            (unsigned int) (total_cycles / samples), (unsigned int) (busy_cycles / samples),
+            (unsigned int) (sleep_cycles / samples), (unsigned int) blocking_cycles);
+        samples = 0;
+        total_cycles = 0;
+        busy_cycles = 0;
+        sleep_cycles = 0;
+    } else {
+        uint32_t poll_cycles_before = 0;
+        for (int i = 0; i < NSENSORS; i++) {
+            poll_cycles_before += sensors[i].poll_cycles;
+        }
+        uint32_t sleep_cycles_before = PMW3360::sleep_cycles;
+        PMW3360::update_all(sensors, NSENSORS);
+        total_cycles += cycles_elapsed(start, cycle_count());
+        sleep_cycles += PMW3360::sleep_cycles - sleep_cycles_before;
+        for (int i = 0; i < NSENSORS; i++) {
+            busy_cycles += sensors[i].poll_cycles;
+        }
+        busy_cycles -= poll_cycles_before;
+        samples++;
+    }
+#else
+    PMW3360::update_all(sensors, NSENSORS);
+#endif
+
+    for (int i = 0; i < NSENSORS; i++) {
+        readings[i].movement[0] = sensors[i].movement[0];
+        readings[i].movement[1] = sensors[i].movement[1];
+        readings[i].motion = sensors[i].motion;
+    }
+}
+
+void hal_sensor_set_cpi(int sensor, unsigned int cpi) {
+    sensors[sensor].set_cpi(cpi);
+}
+
+void hal_sensor_set_rest(int sensor, const sensor_rest_t* rest) {
+    sensors[sensor].set_rest({
+        .enabled = rest->enabled,
+        .run_downshift = rest->run_downshift,
+        .rest1_rate = rest->rest1_rate,
+        .rest1_downshift = rest->rest1_downshift,
+        .rest2_rate = rest->rest2_rate,
+        .rest2_downshift = rest->rest2_downshift,
+        .rest3_rate = rest->rest3_rate,
+    });
+}
+
+const uint8_t* hal_flash_store() {
+    return CONFIG_STORE_IN_MEMORY;
+}
+
+// Nothing can run from flash while it's being erased or programmed. The
+// firmware is normally built to run from RAM (see CMakeLists.txt), then
+// core 1 keeps sampling and interrupts keep being served. Otherwise core 1
+// has to be stopped and interrupts disabled.
+#if PICO_COPY_TO_RAM
+uint32_t flash_op_begin() {
+    return 0;
+}
+
+void flash_op_end(uint32_t ints) {
+}
+#else
+uint32_t flash_op_begin() {
+    multicore_lockout_start_blocking();
+    return save_and_disable_interrupts();
+}
+
+void flash_op_end(uint32_t ints) {
+    restore_interrupts(ints);
+    multicore_lockout_end_blocking();
+}
+#endif
+
+void hal_flash_erase(uint32_t offset) {
+    uint32_t ints = flash_op_begin();
+    flash_range_erase(CONFIG_STORE_OFFSET_IN_FLASH + offset, FLASH_SECTOR_SIZE);
+    flash_op_end(ints);
+}
+
+void hal_flash_program(uint32_t offset, const uint8_t* data, uint32_t len) {
+    // the rest of the page is programmed with 0xff, which leaves it as it is
+    uint8_t page[FLASH_PAGE_SIZE];
+    memset(page, 0xff, sizeof(page));
+    memcpy(page + offset % FLASH_PAGE_SIZE, data, len);
+    uint32_t ints = flash_op_begin();
+    flash_range_program(CONFIG_STORE_OFFSET_IN_FLASH + offset - offset % FLASH_PAGE_SIZE, page, FLASH_PAGE_SIZE);
+    flash_op_end(ints);
+}
+
+bool hal_hid_ready(bool urgent) {
+    return tud_hid_ready() && poll_phase_report_due(&poll_phase, time_us_32(), urgent);
+}
+
+void hal_hid_report(uint8_t report_id, const void* report, uint16_t len) {
+    tud_hid_report(report_id, report, len);
+}
+
+void hal_usb_remote_wakeup() {
+    tud_remote_wakeup();
+}
+
+#ifdef VENDOR_INTERFACE
+uint32_t hal_stream_available() {
+    return tud_vendor_mounted() ? tud_vendor_write_available() : 0;
+}
+
+void hal_stream_write(const void* data, uint32_t len) {
+    tud_vendor_write(data, len);
+    tud_vendor_write_flush();
+}
+
+uint32_t hal_stream_read(void* data, uint32_t len) {
+    return tud_vendor_available() ? tud_vendor_read(data, len) : 0;
+}
+#else
+uint32_t hal_stream_available() {
+    return 0;
+}
+
+void hal_stream_write(const void* data, uint32_t len) {
+}
+
+uint32_t hal_stream_read(void* data, uint32_t len) {
+    return 0;
+}
+#endif
+
+void hal_frame_capture(int sensor) {
+    static uint32_t requests = 0;
+    requests++;
+    capture_request.store((requests << 8) | (sensor + 1), std::memory_order_relaxed);
+}
+
+const uint8_t* hal_frame_get() {
+    while (capture_ready[capture_read].load(std::memory_order_acquire)) {
+        if (capture_tag[capture_read] == capture_request.load(std::memory_order_relaxed)) {
+            return capture_buffers[capture_read];
+        }
+        hal_frame_release();
+    }
+    return nullptr;
+}
+
+void hal_frame_release() {
+    capture_ready[capture_read].store(false, std::memory_order_release);
+    capture_read ^= 1;
+}
+
+void hal_reset_into_bootloader() {
+    reset_usb_boot(0, 0);
+}
+
+void pin_init(uint pin) {
+    gpio_init(pin);
+    gpio_set_dir(pin, GPIO_IN);
+    gpio_pull_up(pin);
+}
+
+void pins_init() {
+    for (int i = 0; i < NBUTTONS; i++) {
+        pin_init(button_pins[i]);
+    }
+#ifdef MOTION_INTERRUPT
+    pin_init(SENSOR0_MOTION);
+    pin_init(SENSOR1_MOTION);
+#endif
+}
+
+void sensors_init() {
+    // both sensors are brought up at the same time, USB is already running on the other core
+    PMW3360Startup startup(sensors, NSENSORS);
+    startup.begin();
+    while (startup.poll()) {
+    }
+}
+
+// Captures frames until core 0 asks for something else, then brings the
+// sensor back up. Nothing is tracked in the meantime.
+void capture_frames(uint32_t request) {
+    int sensor = (request & 0xff) - 1;
+    while (capture_request.load(std::memory_order_relaxed) == request) {
+        if (capture_ready[capture_write].load(std::memory_order_acquire)) {
+            continue;  // core 0 is still reading both
+        }
+        sensors[sensor].queue_frame_capture(capture_buffers[capture_write]);
+        while (sensors[sensor].poll()) {
+        }
+        capture_tag[capture_write] = request;
+        capture_ready[capture_write].store(true, std::memory_order_release);
+        capture_write ^= 1;
+    }
+
+    PMW3360Startup startup(&sensors[sensor], 1);
+    startup.begin();
+    while (startup.poll()) {
+    }
+}
+
+// Moves a sample that would start at next_sample_us towards the slot where it
+// finishes just in time for the next report. Only done when the interval
+// divides the frame, so that every frame has a sample in the same place.
+uint64_t align_sample(uint64_t next_sample_us, uint32_t interval, uint32_t sample_duration_us) {
+    uint32_t now = time_us_32();
+    uint32_t to_poll = poll_phase_time_to_poll_us(&poll_phase, now);
+    if (to_poll == POLL_PHASE_UNKNOWN || FRAME_US % interval != 0) {
+        return next_sample_us;
+    }
+    uint32_t slot = now + to_poll - REPORT_LEAD_US - SAMPLE_MARGIN_US - sample_duration_us;
+    uint32_t offset = ((uint32_t) next_sample_us - slot) % interval;
+    int32_t shift = (offset > interval / 2) ? (int32_t) (interval - offset) : -(int32_t) offset;
+    if (shift > MAX_SAMPLE_SHIFT_US) {
+        shift = MAX_SAMPLE_SHIFT_US;
+    }
+    if (shift < -MAX_SAMPLE_SHIFT_US) {
+        shift = -MAX_SAMPLE_SHIFT_US;
+    }
+    return next_sample_us + shift;
+}
+
+void core1_main() {
+#if !PICO_COPY_TO_RAM
+    // flash_op_begin() needs core 1 to stop executing from flash while it's being written
+    multicore_lockout_victim_init();
+#endif
+    cycle_counter_init();
+    sensors_init();
+    // the interrupts go to the core that enables them
+    buttons_init();
+#ifdef STARTUP_BENCHMARK
+    sensor_task();
+    printf("first sample after %u us\n", (unsigned int) time_us_32());
+#endif
+
+    // core 1 reads the sensors at the rate sample_interval_us() says,
+    // independent of USB traffic, plus an extra sample whenever a button is
+    // pressed
+    uint64_t next_sample_us = time_us_64();
+    uint32_t sample_duration_us = 0;
+    uint32_t samples = 0;
+    bool pressed = false;
+    while (true) {
+        uint32_t request = capture_request.load(std::memory_order_relaxed);
+        if ((request & 0xff) != 0) {
+            capture_frames(request);
+            next_sample_us = time_us_64();
+            continue;
+        }
+
+        uint64_t start = time_us_64();
+        sensor_task();
+        uint32_t duration = time_us_64() - start;
+        // peak hold, slowly forgetting
+        if (duration > sample_duration_us) {
+            sample_duration_us = duration;
+        } else if ((++samples % 16) == 0) {
+            sample_duration_us--;
+        }
+
+        // the extra samples don't move the schedule
+        if (!pressed) {
+            uint32_t interval = sample_interval_us();
+            next_sample_us += interval;
+            next_sample_us = align_sample(next_sample_us, interval, sample_duration_us);
+            // if a sample took longer than the interval (or core 1 was stopped
+            // while the config was written to flash), carry on from now instead
+            // of catching up
+            uint64_t now = time_us_64();
+            if (next_sample_us < now) {
+                next_sample_us = now;
+            }
+        }
+        SampleTrigger trigger = wait_for_sample(next_sample_us, sample_on_motion());
+        pressed = trigger == SampleTrigger::PRESS;
+        if (trigger == SampleTrigger::MOTION) {
+            // sample now and go on at the configured rate from there
+            next_sample_us = time_us_64();
+        }
+    }
+}
+
+int main() {
+    stdio_init_all();
+    board_init();
+    load_config();
+    pins_init();
+    multicore_launch_core1(core1_main);
+    // for the report stage in the stats, core 1 does its own
+    cycle_counter_init();
+    tusb_init();
+    tud_sof_cb_enable(true);
+
+    while (true) {
+        tud_task();  // tinyusb device task
+        hid_task();
+        stream_task();
+        config_task();
+        // the USB interrupt wakes it up when the host resumes the bus
+        if (tud_suspended()) {
+            best_effort_wfe_or_timeout(make_timeout_time_us(SUSPENDED_WAKE_US));
+        }
+    }
+
+    return 0;
+}
+
+void tud_sof_cb(uint32_t frame_count) {
+    poll_phase_sof(&poll_phase, time_us_32());
+}
+
+void tud_hid_report_complete_cb(uint8_t instance, uint8_t const* report, uint16_t len) {
+    poll_phase_report_complete(&poll_phase, time_us_32());
+    handle_report_complete(report[0]);
+}
+
+// Invoked when usb bus is suspended
+void tud_suspend_cb(bool remote_wakeup_en) {
+    handle_suspend(remote_wakeup_en);
+}
+
+// Invoked when usb bus is resumed
+void tud_resume_cb() {
+    handle_resume();
+}
+
+// Invoked when device is mounted
+void tud_mount_cb() {
+    poll_phase_reset(&poll_phase);
+    handle_mount();
+}
+
+// Invoked when received GET DEVICE DESCRIPTOR
+// Application return pointer to descriptor
+uint8_t const* tud_descriptor_device_cb() {
+    return (uint8_t const*) &desc_device;
+}
+
+// Invoked when received GET HID REPORT DESCRIPTOR
+// Application return pointer to descriptor
+// Descriptor contents must exist long enough for transfer to complete
+uint8_t const* tud_hid_descriptor_report_cb(uint8_t itf) {
+    return desc_hid_report;
+}
+
+// Invoked when received GET_REPORT control request
+// Application must fill buffer report's content and return its length.
+// Return zero will cause the stack to STALL request
+uint16_t tud_hid_get_report_cb(uint8_t itf, uint8_t report_id, hid_report_type_t report_type, uint8_t* buffer, uint16_t reqlen) {
+    return handle_get_report(report_id, buffer, reqlen);
+}
+
+// Invoked when received SET_REPORT control request or
+// received data on OUT endpoint ( Report ID = 0, Type = 0 )
+void tud_hid_set_report_cb(uint8_t itf, uint8_t report_id, hid_report_type_t report_type, uint8_t const* buffer, uint16_t bufsize) {
+    handle_set_report(report_id, buffer, bufsize);
+}
+
+// Invoked when received GET CONFIGURATION DESCRIPTOR
+// Application return pointer to descriptor
+// Descriptor contents must exist long enough for transfer to complete
+uint8_t const* tud_descriptor_configuration_cb(uint8_t index) {
+    return desc_configuration;
+}
+
+static uint16_t _desc_str[32];
+
+// Invoked when received GET STRING DESCRIPTOR request
+// Application return pointer to descriptor, whose contents must exist long enough for transfer to complete
+uint16_t const* tud_descriptor_string_cb(uint8_t index, uint16_t langid) {
+    uint8_t chr_count;
+
+    if (index == 0) {
+        memcpy(&_desc_str[1], string_desc_arr[0], 2);
+        chr_count = 1;
+    } else {
+        // Note: the 0xEE index string is a Microsoft OS 1.0 Descriptors.
+        // https://docs.microsoft.com/en-us/windows-hardware/drivers/usbcon/microsoft-defined-usb-descriptors
+
+        if (!(index < sizeof(string_desc_arr) / sizeof(string_desc_arr[0])))
+            return NULL;
+
+        const char* str = string_desc_arr[index];
+
+        // Cap at max char
+        chr_count = strlen(str);
+        if (chr_count > 31)
+            chr_count = 31;
+
+        // Convert ASCII string into UTF-16
+        for (uint8_t i = 0; i < chr_count; i++) {
+            _desc_str[1 + i] = str[i];
+        }
+    }
+
+    // first byte is length (including header), second byte is string type
+    _desc_str[0] = (TUSB_DESC_STRING << 8) | (2 * chr_count + 2);
+
+    return _desc_str;
+}
@@ -1,59 +1,223 @@
 // derived from https://github.com/mrjohnk/PMW3360DM-T2QU
 
+#include <hardware/clocks.h>
+#include <hardware/dma.h>
 #include <hardware/gpio.h>
+#include <pico/stdlib.h>
 
 #include "pmw3360.h"
 
+#include "cycles.h"
 #include "registers.h"
 #include "srom.h"
 
+// minimum timings from the datasheet, in microseconds
+#define tSRAD 160
+#define tSRAD_MOTBR 35
+#define tSCLK_NCS_WRITE 35
+#define tSWW 180  // same as tSWR
+#define tSRR 20   // same as tSRW
+#define tLOAD 15
+#define tNCS_SCLK_CYCLES 16  // 120ns at up to 133 MHz
+#define tFRAME_CAPTURE 20000  // from starting a frame capture until the image can be read
+// time to clock one byte at 2 MHz
+#define BYTE_US 4
+
+// update_all() sleeps through waits at least this long, and wakes up this
+// early to make up for setting up the alarm and taking its interrupt
+#define MIN_SLEEP_US 10
+#define WAKE_EARLY_US 3
+
+PMW3360* PMW3360::bus_owner[2] = { nullptr, nullptr };
+uint32_t PMW3360::sleep_cycles = 0;
+
 void PMW3360::init() {
+    PMW3360Startup startup(this, 1);
+    startup.begin();
+    while (startup.poll()) {
+    }
+}
+
+void PMW3360::setup() {
     set_pins_function();
 
     gpio_init(ncs_pin);
     gpio_set_dir(ncs_pin, GPIO_OUT);
     gpio_put(ncs_pin, 1);
 
-    spi_init(spi, 500000);
+    // everything, including the SROM download, runs at the 2 MHz maximum
+    spi_init(spi, 2000000);
     spi_set_format(spi, 8, SPI_CPOL_1, SPI_CPHA_1, SPI_MSB_FIRST);
 
-    perform_startup();
+    if (shared_spi) {
+        unset_pins_function();
+    }
 
-    unset_pins_function();
+    if (dma_tx < 0) {
+        dma_tx = dma_claim_unused_channel(true);
+        dma_rx = dma_claim_unused_channel(true);
+    }
+    configure_burst_dma();
+}
+
+// burst reads done by poll() are transferred in the background
+void PMW3360::configure_burst_dma() {
+    dma_channel_config c = dma_channel_get_default_config(dma_tx);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_dreq(&c, spi_get_dreq(spi, true));
+    static const uint8_t zero = 0;
+    dma_channel_configure(dma_tx, &c, &spi_get_hw(spi)->dr, &zero, sizeof(burst), false);
+
+    c = dma_channel_get_default_config(dma_rx);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_dreq(&c, spi_get_dreq(spi, false));
+    dma_channel_configure(dma_rx, &c, burst, &spi_get_hw(spi)->dr, sizeof(burst), false);
 }
 
 void PMW3360::set_cpi(unsigned int cpi) {
-    set_pins_function();
+    if (shared_spi) {
+        set_pins_function();
+    }
 
-    int cpival = (cpi / 100) - 1;
+    config1 = (cpi / 100) - 1;
     cs_select();
-    write_register(Config1, cpival);
+    write_register(Config1, config1);
     cs_deselect();
 
-    unset_pins_function();
+    if (shared_spi) {
+        unset_pins_function();
+    }
+}
+
+void PMW3360::set_rest(const RestSettings& settings) {
+    rest = settings;
+    queue_rest_settings();
+    while (poll()) {
+    }
+}
+
+// Needs 10 free slots in the queue.
+void PMW3360::queue_rest_settings() {
+    queue_write(Run_Downshift, rest.run_downshift);
+    queue_write(Rest1_Rate_Lower, rest.rest1_rate & 0xff);
+    queue_write(Rest1_Rate_Upper, rest.rest1_rate >> 8);
+    queue_write(Rest1_Downshift, rest.rest1_downshift);
+    queue_write(Rest2_Rate_Lower, rest.rest2_rate & 0xff);
+    queue_write(Rest2_Rate_Upper, rest.rest2_rate >> 8);
+    queue_write(Rest2_Downshift, rest.rest2_downshift);
+    queue_write(Rest3_Rate_Lower, rest.rest3_rate & 0xff);
+    queue_write(Rest3_Rate_Upper, rest.rest3_rate >> 8);
+    // Write 0x00 to Config2 register for wired mouse or 0x20 for wireless mouse design.
+    // Rest mode saves power in a wired one too.
+    queue_write(Config2, rest.enabled ? 0x20 : 0x00);
 }
 
 void PMW3360::update() {
-    set_pins_function();
+    if (shared_spi) {
+        set_pins_function();
+    }
+
+    if (use_motion_burst) {
+        update_burst();
+    } else {
+        update_registers();
+    }
+
+    if (shared_spi) {
+        unset_pins_function();
+    }
+}
+
+void PMW3360::update_all(PMW3360* sensors, int n) {
+    for (int i = 0; i < n; i++) {
+        if (sensors[i].use_motion_burst) {
+            sensors[i].queue_motion_burst();
+        } else {
+            sensors[i].update();
+        }
+    }
+
+    while (true) {
+        bool busy = false;
+        // sleep until the earliest deadline, a sensor waiting for the other
+        // one to release the bus doesn't have one
+        int32_t sleep_us = INT32_MAX;
+        for (int i = 0; i < n; i++) {
+            if (!sensors[i].poll()) {
+                continue;
+            }
+            busy = true;
+            int32_t left = sensors[i].deadline_us - time_us_32();
+            if (left <= 0 && !sensors[i].bus_taken()) {
+                // can go on right away, or DMA is taking longer than it should
+                left = 0;
+            }
+            if (left >= 0 && left < sleep_us) {
+                sleep_us = left;
+            }
+        }
+        if (!busy) {
+            break;
+        }
+        if (sleep_us != INT32_MAX && sleep_us >= MIN_SLEEP_US) {
+            uint32_t start = cycle_count();
+            best_effort_wfe_or_timeout(make_timeout_time_us(sleep_us - WAKE_EARLY_US));
+            sleep_cycles += cycles_elapsed(start, cycle_count());
+        }
+    }
+}
+
+// Reads motion, deltas, SQUAL and shutter in one chip select window, cf p.22 of the datasheet.
+void PMW3360::update_burst() {
+    // any register read or write other than a motion burst ends burst mode,
+    // it has to be re-entered by writing to Motion_Burst
+    if (!in_burst_mode) {
+        write_register(Motion_Burst, 0x00);
+        in_burst_mode = true;
+    }
+
+    cs_select();
+    uint8_t x = Motion_Burst;
+    spi_write_blocking(spi, &x, 1);
+    sleep_us(tSRAD_MOTBR);
+    spi_read_blocking(spi, 0, burst, sizeof(burst));
+    cs_deselect();
+    sleep_us(1);  // tBEXIT (=500ns)
+    parse_burst();
+}
+
+void PMW3360::parse_burst() {
+    motion = burst[0] & (1 << 7);
+    is_on_surface = !(burst[0] & (1 << 3));
 
+    movement[0] = (int16_t) (burst[2] | (burst[3] << 8));
+    movement[1] = (int16_t) (burst[4] | (burst[5] << 8));
+    squal = burst[6];
+    shutter = (burst[10] << 8) | burst[11];
+}
+
+void PMW3360::update_registers() {
     // write 0x01 to Motion register and read from it to freeze the motion values and make them available
     write_register(Motion, 0x01);
     uint8_t motion = read_register(Motion);
 
+    this->motion = motion & (1 << 7);
     is_on_surface = !(motion & (1 << 3));
 
     movement[0] = read_register(Delta_X_L);
     movement[0] |= ((int16_t) read_register(Delta_X_H)) << 8;
     movement[1] = read_register(Delta_Y_L);
     movement[1] |= ((int16_t) read_register(Delta_Y_H)) << 8;
-
-    unset_pins_function();
 }
 
 void PMW3360::cs_select() {
     asm volatile("nop \n nop \n nop");
     gpio_put(ncs_pin, 0);  // Active low
-    asm volatile("nop \n nop \n nop");
+    busy_wait_at_least_cycles(tNCS_SCLK_CYCLES);
 }
 
 void PMW3360::cs_deselect() {
@@ -63,24 +227,26 @@ void PMW3360::cs_deselect() {
 }
 
 uint8_t PMW3360::read_register(uint8_t reg_addr) {
+    in_burst_mode = false;
     cs_select();
 
     // send adress of the register, with MSBit = 0 to indicate it's a read
     uint8_t x = reg_addr & 0x7f;
     spi_write_blocking(spi, &x, 1);
-    sleep_us(100);  // tSRAD
+    sleep_us(tSRAD);
     // read data
     uint8_t data;
     spi_read_blocking(spi, 0, &data, 1);
 
     sleep_us(1);  // tSCLK-NCS for read operation is 120ns
     cs_deselect();
-    sleep_us(19);  // tSRW/tSRR (=20us) minus tSCLK-NCS
+    sleep_us(tSRR - 1);  // tSRW/tSRR minus tSCLK-NCS
 
     return data;
 }
 
 void PMW3360::write_register(uint8_t reg_addr, uint8_t data) {
+    in_burst_mode = false;
     cs_select();
 
     // send adress of the register, with MSBit = 1 to indicate it's a write
@@ -89,9 +255,207 @@ void PMW3360::write_register(uint8_t reg_addr, uint8_t data) {
     // send data
     spi_write_blocking(spi, &data, 1);
 
-    sleep_us(20);  // tSCLK-NCS for write operation
+    sleep_us(tSCLK_NCS_WRITE);
     cs_deselect();
-    sleep_us(100);  // tSWW/tSWR (=120us) minus tSCLK-NCS. Could be shortened, but is looks like a safe lower bound
+    sleep_us(tSWW - tSCLK_NCS_WRITE);  // tSWW/tSWR minus tSCLK-NCS
+}
+
+// Non-blocking transaction engine.
+//
+// Every transaction goes through these phases:
+//   IDLE -> select, send address -> ADDRESS_SENT -> read data -> DATA_DONE -> deselect -> IDLE
+// (writes send the address and data together and go straight to DATA_DONE,
+// motion bursts read their 12 bytes and raw data bursts a whole frame with DMA
+// in the DMA_TRANSFER phase).
+// poll() moves on to the next phase when the deadline set by the previous one has
+// passed and returns immediately otherwise. After deselecting, the next transaction
+// on the same sensor isn't started until tSRR/tSWW has passed, but another sensor
+// can use the bus in the meantime. When the sensors share an SPI peripheral only one
+// of them can have its pins connected at a time, so only the waits with chip select
+// high can overlap. With separate peripherals everything can.
+
+bool PMW3360::queue_read(uint8_t reg_addr, transaction_callback_t callback) {
+    return queue_transaction(TransactionType::READ, reg_addr, 0, callback);
+}
+
+bool PMW3360::queue_write(uint8_t reg_addr, uint8_t data, transaction_callback_t callback) {
+    return queue_transaction(TransactionType::WRITE, reg_addr, data, callback);
+}
+
+bool PMW3360::queue_motion_burst(transaction_callback_t callback) {
+    return queue_transaction(TransactionType::MOTION_BURST, Motion_Burst, 0, callback);
+}
+
+bool PMW3360::queue_frame_capture(uint8_t* frame_, transaction_callback_t callback) {
+    if (PMW3360_TRANSACTION_QUEUE_SIZE - queue_length < 4) {
+        return false;
+    }
+    // Rest mode has to be off, starting the sensor up again puts it back.
+    queue_write(Config2, 0x00);
+    queue_write(Frame_Capture, 0x83);
+    // tFRAME_CAPTURE is waited after this one
+    queue_write(Frame_Capture, 0xc5);
+    frame = frame_;
+    return queue_transaction(TransactionType::RAW_DATA_BURST, Raw_Data_Burst, 0, callback);
+}
+
+bool PMW3360::queue_transaction(TransactionType type, uint8_t reg_addr, uint8_t data, transaction_callback_t callback) {
+    if (queue_length == PMW3360_TRANSACTION_QUEUE_SIZE) {
+        return false;
+    }
+    queue[(queue_head + queue_length) % PMW3360_TRANSACTION_QUEUE_SIZE] = { type, reg_addr, data, callback };
+    queue_length++;
+    return true;
+}
+
+bool PMW3360::busy() {
+    return queue_length > 0;
+}
+
+bool PMW3360::poll() {
+    if (queue_length == 0) {
+        return false;
+    }
+
+    if ((int32_t) (time_us_32() - deadline_us) < 0) {
+        return true;
+    }
+
+    uint32_t start_cycles = cycle_count();
+    Transaction& t = queue[queue_head];
+
+    switch (phase) {
+        case Phase::IDLE: {
+            if (!acquire_bus()) {
+                break;
+            }
+            cs_select();
+            if (t.type == TransactionType::MOTION_BURST && !in_burst_mode) {
+                // burst mode has to be entered by writing to Motion_Burst first
+                uint8_t buf[2] = { Motion_Burst | 0x80, 0x00 };
+                spi_write_blocking(spi, buf, 2);
+                entering_burst_mode = true;
+                phase = Phase::DATA_DONE;
+                wait_us(tSCLK_NCS_WRITE);
+            } else if (t.type == TransactionType::WRITE) {
+                uint8_t buf[2] = { (uint8_t) (t.reg_addr | 0x80), t.data };
+                spi_write_blocking(spi, buf, 2);
+                phase = Phase::DATA_DONE;
+                wait_us(tSCLK_NCS_WRITE);
+            } else {
+                uint8_t x = t.reg_addr & 0x7f;
+                spi_write_blocking(spi, &x, 1);
+                phase = Phase::ADDRESS_SENT;
+                wait_us(t.type == TransactionType::MOTION_BURST ? tSRAD_MOTBR : tSRAD);
+            }
+            break;
+        }
+        case Phase::ADDRESS_SENT:
+            if (t.type == TransactionType::READ) {
+                spi_read_blocking(spi, 0, &t.data, 1);
+                phase = Phase::DATA_DONE;
+                wait_us(1);  // tSCLK-NCS for read operation is 120ns
+            } else {
+                // the whole image is read in one go, without waits between bytes
+                bool raw = t.type == TransactionType::RAW_DATA_BURST;
+                uint32_t length = raw ? PMW3360_FRAME_SIZE : sizeof(burst);
+                dma_channel_set_write_addr(dma_rx, raw ? frame : burst, false);
+                dma_channel_set_trans_count(dma_rx, length, false);
+                dma_channel_set_trans_count(dma_tx, length, false);
+                dma_start_channel_mask((1u << dma_tx) | (1u << dma_rx));
+                phase = Phase::DMA_TRANSFER;
+                wait_us(length * BYTE_US);
+            }
+            break;
+        case Phase::DMA_TRANSFER:
+            if (!dma_channel_is_busy(dma_rx)) {
+                phase = Phase::DATA_DONE;
+                wait_us(1);  // tSCLK-NCS
+            }
+            break;
+        case Phase::DATA_DONE: {
+            cs_deselect();
+            release_bus();
+            phase = Phase::IDLE;
+
+            if (entering_burst_mode) {
+                // the burst itself is started on the next call
+                entering_burst_mode = false;
+                in_burst_mode = true;
+                wait_us(tSWW - tSCLK_NCS_WRITE);  // tSWW/tSWR minus tSCLK-NCS
+                break;
+            }
+
+            Transaction done = t;
+            queue_head = (queue_head + 1) % PMW3360_TRANSACTION_QUEUE_SIZE;
+            queue_length--;
+
+            switch (done.type) {
+                case TransactionType::READ:
+                    in_burst_mode = false;
+                    wait_us(tSRR - 1);  // tSRW/tSRR minus tSCLK-NCS
+                    break;
+                case TransactionType::WRITE:
+                    in_burst_mode = false;
+                    if (done.reg_addr == Frame_Capture && done.data == 0xc5) {
+                        wait_us(tFRAME_CAPTURE);
+                    } else {
+                        wait_us(tSWW - tSCLK_NCS_WRITE);  // tSWW/tSWR minus tSCLK-NCS
+                    }
+                    break;
+                case TransactionType::MOTION_BURST:
+                    parse_burst();
+                    wait_us(1);  // tBEXIT (=500ns)
+                    break;
+                case TransactionType::RAW_DATA_BURST:
+                    wait_us(1);  // tBEXIT (=500ns)
+                    break;
+            }
+
+            if (done.callback != nullptr) {
+                done.callback(this, done.reg_addr, done.data);
+            }
+            break;
+        }
+    }
+
+    poll_cycles += cycles_elapsed(start_cycles, cycle_count());
+
+    return queue_length > 0;
+}
+
+// Waits are measured with the 1us timer, add one so that we wait at least the given time.
+void PMW3360::wait_us(uint32_t us) {
+    deadline_us = time_us_32() + us + 1;
+}
+
+bool PMW3360::acquire_bus() {
+    if (!shared_spi) {
+        return true;
+    }
+    PMW3360*& owner = bus_owner[spi_get_index(spi)];
+    if (owner != nullptr && owner != this) {
+        return false;
+    }
+    owner = this;
+    set_pins_function();
+    return true;
+}
+
+bool PMW3360::bus_taken() {
+    if (!shared_spi) {
+        return false;
+    }
+    PMW3360* owner = bus_owner[spi_get_index(spi)];
+    return owner != nullptr && owner != this;
+}
+
+void PMW3360::release_bus() {
+    if (!shared_spi) {
+        return;
+    }
+    unset_pins_function();
+    bus_owner[spi_get_index(spi)] = nullptr;
 }
 
 // We do this because we have the two sensors connected to two different sets of spi0 pins.
@@ -109,58 +473,192 @@ void PMW3360::unset_pins_function() {
     gpio_set_function(sck_pin, GPIO_FUNC_NULL);
 }
 
-void PMW3360::perform_startup() {
-    cs_deselect();                         // ensure that the serial port is reset
-    cs_select();                           // ensure that the serial port is reset
-    cs_deselect();                         // ensure that the serial port is reset
-    write_register(Power_Up_Reset, 0x5a);  // force reset
-    sleep_ms(50);                          // wait for it to reboot
-    // read registers 0x02 to 0x06 (and discard the data)
-    read_register(Motion);
-    read_register(Delta_X_L);
-    read_register(Delta_X_H);
-    read_register(Delta_Y_L);
-    read_register(Delta_Y_H);
-    // upload the firmware
-    upload_firmware();
-    sleep_ms(10);
+static void store_srom_id(PMW3360* sensor, uint8_t reg_addr, uint8_t data) {
+    sensor->srom_id = data;
 }
 
-void PMW3360::upload_firmware() {
-    // send the firmware to the chip, cf p.18 of the datasheet
-
-    // Write 0 to Rest_En bit of Config2 register to disable Rest mode.
-    write_register(Config2, 0x20);
-
-    // write 0x1d in SROM_enable reg for initializing
-    write_register(SROM_Enable, 0x1d);
+void PMW3360Startup::begin() {
+    for (int i = 0; i < n; i++) {
+        sensors[i].setup();
+    }
+    state = State::RESET;
+    attempts = 0;
+    failed = false;
+    pending_wait_us = 0;
+    // tBEXIT, in case a sensor was just read in burst mode (plus one, see PMW3360::wait_us())
+    deadline_us = time_us_32() + 1 + 1;
+}
 
-    // wait for more than one frame period
-    sleep_ms(10);  // assume that the frame rate is as low as 100fps... even if it should never be that low
+bool PMW3360Startup::poll() {
+    if (state == State::DONE) {
+        return false;
+    }
 
-    // write 0x18 to SROM_enable to start SROM download
-    write_register(SROM_Enable, 0x18);
+    if (transactions_in_progress()) {
+        return true;
+    }
 
-    // write the SROM file (=firmware data)
-    cs_select();
-    uint8_t data = SROM_Load_Burst | 0x80;  // write burst destination adress
-    spi_write_blocking(spi, &data, 1);
-    sleep_us(15);
+    // waits are counted from when the last queued transaction finished
+    if (pending_wait_us > 0) {
+        deadline_us = time_us_32() + pending_wait_us;
+        pending_wait_us = 0;
+    }
 
-    // send all bytes of the firmware
-    for (int i = 0; i < firmware_length; i++) {
-        spi_write_blocking(spi, &(firmware_data[i]), 1);
-        sleep_us(15);
+    if ((int32_t) (time_us_32() - deadline_us) < 0) {
+        return true;
     }
 
-    // Read the SROM_ID register to verify the ID before any other register reads or writes.
-    read_register(SROM_ID);
+    switch (state) {
+        case State::RESET:
+            for (int i = 0; i < n; i++) {
+                sensors[i].cs_deselect();  // ensure that the serial port is reset
+                sensors[i].cs_select();    // ensure that the serial port is reset
+                sensors[i].cs_deselect();  // ensure that the serial port is reset
+                sensors[i].in_burst_mode = false;
+                sensors[i].queue_write(Power_Up_Reset, 0x5a);  // force reset
+            }
+            wait_after_transactions(50000);  // wait for it to reboot
+            state = State::DRAIN;
+            break;
+        case State::DRAIN:
+            for (int i = 0; i < n; i++) {
+                // read registers 0x02 to 0x06 (and discard the data)
+                sensors[i].queue_read(Motion);
+                sensors[i].queue_read(Delta_X_L);
+                sensors[i].queue_read(Delta_X_H);
+                sensors[i].queue_read(Delta_Y_L);
+                sensors[i].queue_read(Delta_Y_H);
+                // Write 0 to Rest_En bit of Config2 register to disable Rest mode.
+                sensors[i].queue_write(Config2, 0x20);
+                // write 0x1d in SROM_enable reg for initializing
+                sensors[i].queue_write(SROM_Enable, 0x1d);
+            }
+            // wait for more than one frame period
+            // assume that the frame rate is as low as 100fps... even if it should never be that low
+            wait_after_transactions(10000);
+            state = State::SROM_START;
+            break;
+        case State::SROM_START:
+            for (int i = 0; i < n; i++) {
+                // write 0x18 to SROM_enable to start SROM download
+                sensors[i].queue_write(SROM_Enable, 0x18);
+            }
+            wait_after_transactions(tSWW);
+            state = State::DOWNLOAD_BEGIN;
+            break;
+        case State::DOWNLOAD_BEGIN:
+            download_sensor[0] = nullptr;
+            download_sensor[1] = nullptr;
+            for (int i = 0; i < n; i++) {
+                // with both sensors' pins connected to a shared SPI peripheral, they both get the bytes we send
+                sensors[i].set_pins_function();
+                sensors[i].cs_select();
+                uint spi_index = spi_get_index(sensors[i].spi);
+                if (download_sensor[spi_index] == nullptr) {
+                    download_sensor[spi_index] = &sensors[i];
+                }
+            }
+            for (int i = 0; i < 2; i++) {
+                if (download_sensor[i] != nullptr) {
+                    uint8_t data = SROM_Load_Burst | 0x80;  // write burst destination adress
+                    spi_write_blocking(download_sensor[i]->spi, &data, 1);
+                }
+            }
+            deadline_us = time_us_32() + tLOAD + 1;
+            state = State::DOWNLOAD;
+            break;
+        case State::DOWNLOAD:
+            for (int i = 0; i < 2; i++) {
+                PMW3360* sensor = download_sensor[i];
+                if (sensor == nullptr) {
+                    continue;
+                }
+                // one byte every 20us: 4us to send it at 2 MHz plus the 15us tLOAD with some margin
+                download_timer[i] = dma_claim_unused_timer(true);
+                dma_timer_set_fraction(download_timer[i], 1, clock_get_hz(clk_sys) / 50000);
+                dma_channel_config c = dma_channel_get_default_config(sensor->dma_tx);
+                channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+                channel_config_set_read_increment(&c, true);
+                channel_config_set_write_increment(&c, false);
+                channel_config_set_dreq(&c, dma_get_timer_dreq(download_timer[i]));
+                dma_channel_configure(sensor->dma_tx, &c, &spi_get_hw(sensor->spi)->dr, firmware_data, firmware_length, true);
+            }
+            state = State::DOWNLOAD_END;
+            break;
+        case State::DOWNLOAD_END:
+            for (int i = 0; i < 2; i++) {
+                PMW3360* sensor = download_sensor[i];
+                if (sensor != nullptr && (dma_channel_is_busy(sensor->dma_tx) || spi_is_busy(sensor->spi))) {
+                    return true;
+                }
+            }
+            for (int i = 0; i < 2; i++) {
+                PMW3360* sensor = download_sensor[i];
+                if (sensor == nullptr) {
+                    continue;
+                }
+                dma_timer_unclaim(download_timer[i]);
+                // we ignored everything that came in while sending
+                while (spi_is_readable(sensor->spi)) {
+                    (void) spi_get_hw(sensor->spi)->dr;
+                }
+                spi_get_hw(sensor->spi)->icr = SPI_SSPICR_RORIC_BITS;
+            }
+            for (int i = 0; i < n; i++) {
+                sensors[i].cs_deselect();
+                if (sensors[i].shared_spi) {
+                    sensors[i].unset_pins_function();
+                }
+                sensors[i].configure_burst_dma();
+            }
+            deadline_us = time_us_32() + 200 + 1;
+            state = State::VERIFY;
+            break;
+        case State::VERIFY:
+            for (int i = 0; i < n; i++) {
+                // Read the SROM_ID register to verify the ID before any other register reads or writes.
+                sensors[i].srom_id = 0;
+                sensors[i].queue_read(SROM_ID, store_srom_id);
+            }
+            state = State::CONFIGURE;
+            break;
+        case State::CONFIGURE:
+            for (int i = 0; i < n; i++) {
+                if (sensors[i].srom_id == 0) {
+                    if (++attempts < 3) {
+                        state = State::RESET;
+                        return true;
+                    }
+                    failed = true;
+                }
+            }
+            for (int i = 0; i < n; i++) {
+                // set the rest mode, or put it back after a frame capture
+                sensors[i].queue_rest_settings();
+                // set initial CPI resolution, or put it back after a frame capture
+                sensors[i].queue_write(Config1, sensors[i].config1);
+            }
+            wait_after_transactions(10000);
+            state = State::SETTLE;
+            break;
+        case State::SETTLE:
+            state = State::DONE;
+            return false;
+        case State::DONE:
+            return false;
+    }
 
-    // Write 0x00 to Config2 register for wired mouse or 0x20 for wireless mouse design.
-    write_register(Config2, 0x00);
+    return true;
+}
 
-    // set initial CPI resolution
-    write_register(Config1, 0x15);
+void PMW3360Startup::wait_after_transactions(uint32_t us) {
+    pending_wait_us = us + 1;
+}
 
-    cs_deselect();
+bool PMW3360Startup::transactions_in_progress() {
+    bool busy = false;
+    for (int i = 0; i < n; i++) {
+        busy |= sensors[i].poll();
+    }
+    return busy;
 }
@@ -3,32 +3,195 @@
 
 #include <hardware/spi.h>
 
+#define PMW3360_TRANSACTION_QUEUE_SIZE 16
+
+// raw image from frame capture, one byte per pixel, row by row
+#define PMW3360_FRAME_WIDTH 36
+#define PMW3360_FRAME_SIZE (PMW3360_FRAME_WIDTH * PMW3360_FRAME_WIDTH)
+
 class PMW3360 {
    public:
-    PMW3360(spi_inst_t* spi, uint miso_pin, uint mosi_pin, uint sck_pin, uint ncs_pin)
-        : spi(spi), miso_pin(miso_pin), mosi_pin(mosi_pin), sck_pin(sck_pin), ncs_pin(ncs_pin){};
+    typedef void (*transaction_callback_t)(PMW3360* sensor, uint8_t reg_addr, uint8_t data);
+
+    // Rest mode settings, the values of the registers with the same names
+    // (Run_Downshift to Rest3_Rate in the datasheet). enabled is Config2's
+    // Rest_En bit.
+    struct RestSettings {
+        bool enabled;
+        uint8_t run_downshift;
+        uint16_t rest1_rate;
+        uint8_t rest1_downshift;
+        uint16_t rest2_rate;
+        uint8_t rest2_downshift;
+        uint16_t rest3_rate;
+    };
+
+    // shared_spi means that another sensor is connected to the same SPI peripheral
+    // on a different set of pins, so we have to switch the pin functions on every access.
+    PMW3360(spi_inst_t* spi, uint miso_pin, uint mosi_pin, uint sck_pin, uint ncs_pin, bool shared_spi = true)
+        : spi(spi), miso_pin(miso_pin), mosi_pin(mosi_pin), sck_pin(sck_pin), ncs_pin(ncs_pin), shared_spi(shared_spi){};
+    // Blocking version of PMW3360Startup for a single sensor.
     void init();
     void set_cpi(unsigned int cpi);
+    // Also kept for when PMW3360Startup brings the sensor up again.
+    void set_rest(const RestSettings& settings);
     void update();
 
+    // Same as calling update() on each sensor, but the transactions are done by
+    // the non-blocking engine below, so the sensors' waits overlap. The CPU
+    // sleeps (WFE, woken up by an alarm) through the longer waits.
+    static void update_all(PMW3360* sensors, int n);
+    // CPU cycles update_all() spent asleep
+    static uint32_t sleep_cycles;
+
+    // Non-blocking register access. Transactions are queued and carried out by
+    // poll(), which never waits. It has to be called repeatedly for as long as it
+    // returns true. The callback is called from poll() when the transaction is
+    // done. For motion bursts reg_addr is Motion_Burst and the results are in
+    // movement, is_on_surface, squal and shutter.
+    // Don't call the blocking functions above while a transaction is in progress.
+    bool queue_read(uint8_t reg_addr, transaction_callback_t callback = nullptr);
+    bool queue_write(uint8_t reg_addr, uint8_t data, transaction_callback_t callback = nullptr);
+    bool queue_motion_burst(transaction_callback_t callback = nullptr);
+    // Captures the image the sensor sees into frame (PMW3360_FRAME_SIZE bytes),
+    // cf Frame Capture in the datasheet. Takes about 26 ms, most of it waiting for the
+    // sensor. It stops tracking and wipes the SROM, so run PMW3360Startup on
+    // the sensor again after the last frame. The callback's reg_addr is
+    // Raw_Data_Burst. Needs 4 free slots in the queue.
+    bool queue_frame_capture(uint8_t* frame, transaction_callback_t callback = nullptr);
+    bool poll();
+    bool busy();
+
     int16_t movement[2];
+    // the MOT bit of the Motion register, set even for motion under a count
+    bool motion;
     bool is_on_surface;
+    // only updated by the Motion_Burst path
+    uint8_t squal = 0;
+    uint16_t shutter = 0;
+
+    // read after the SROM download, zero means it didn't work
+    uint8_t srom_id = 0;
+
+    // Read the sample with a single Motion_Burst transaction instead of
+    // separate register reads. Set to false to fall back to the old path.
+    bool use_motion_burst = true;
+
+    // CPU cycles spent inside poll() (as opposed to waiting between calls to it)
+    uint32_t poll_cycles = 0;
 
    private:
+    friend class PMW3360Startup;
+
+    enum class TransactionType : uint8_t {
+        READ,
+        WRITE,
+        MOTION_BURST,
+        RAW_DATA_BURST,
+    };
+
+    enum class Phase : uint8_t {
+        IDLE,
+        ADDRESS_SENT,
+        DMA_TRANSFER,
+        DATA_DONE,
+    };
+
+    struct Transaction {
+        TransactionType type;
+        uint8_t reg_addr;
+        uint8_t data;
+        transaction_callback_t callback;
+    };
+
     spi_inst_t* spi;
     uint miso_pin;
     uint mosi_pin;
     uint sck_pin;
     uint ncs_pin;
+    bool shared_spi;
+    bool in_burst_mode = false;
+    int dma_tx = -1;
+    int dma_rx = -1;
+    uint8_t burst[12];
+    uint8_t* frame = nullptr;
+    // written to Config1 by set_cpi() and on startup
+    uint8_t config1 = 0x15;
+    // written by set_rest() and on startup, rest mode is off until then
+    RestSettings rest = { false, 0x32, 0x0000, 0x1f, 0x0063, 0xbc, 0x01f3 };
+
+    Transaction queue[PMW3360_TRANSACTION_QUEUE_SIZE];
+    uint8_t queue_head = 0;
+    uint8_t queue_length = 0;
+    Phase phase = Phase::IDLE;
+    bool entering_burst_mode = false;
+    uint32_t deadline_us = 0;
+
+    // which sensor currently has its pins connected to each SPI peripheral
+    static PMW3360* bus_owner[2];
 
+    void setup();
+    void configure_burst_dma();
     void cs_select();
     void cs_deselect();
     uint8_t read_register(uint8_t reg_addr);
     void write_register(uint8_t reg_addr, uint8_t data);
+    void queue_rest_settings();
+    void update_burst();
+    void update_registers();
+    void parse_burst();
+    bool queue_transaction(TransactionType type, uint8_t reg_addr, uint8_t data, transaction_callback_t callback);
+    void wait_us(uint32_t us);
+    bool acquire_bus();
+    void release_bus();
+    // by another sensor on the same SPI peripheral
+    bool bus_taken();
     void set_pins_function();
     void unset_pins_function();
-    void perform_startup();
-    void upload_firmware();
+};
+
+// Brings up a group of sensors at the same time without blocking, cf p.18 of the datasheet.
+// The register accesses go through the transaction engine, so all the waits overlap.
+// The SROM is downloaded to all sensors at once by DMA paced with a timer; sensors
+// that share an SPI peripheral have the same bytes broadcast to them.
+// If a sensor doesn't report a valid SROM_ID afterwards, the whole sequence is retried.
+// poll() has to be called repeatedly for as long as it returns true.
+class PMW3360Startup {
+   public:
+    PMW3360Startup(PMW3360* sensors, int n)
+        : sensors(sensors), n(n){};
+    void begin();
+    bool poll();
+
+    // true if the SROM download still failed after all retries
+    bool failed = false;
+
+   private:
+    enum class State : uint8_t {
+        RESET,
+        DRAIN,
+        SROM_START,
+        DOWNLOAD_BEGIN,
+        DOWNLOAD,
+        DOWNLOAD_END,
+        VERIFY,
+        CONFIGURE,
+        SETTLE,
+        DONE,
+    };
+
+    PMW3360* sensors;
+    int n;
+    State state = State::DONE;
+    int attempts = 0;
+    uint32_t deadline_us = 0;
+    uint32_t pending_wait_us = 0;
+    // one DMA transfer per SPI peripheral, indexed by spi_get_index()
+    PMW3360* download_sensor[2];
+    int download_timer[2];
+
+    void wait_after_transactions(uint32_t us);
+    bool transactions_in_progress();
 };
 
 #endif
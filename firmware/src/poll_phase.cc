@@ -0,0 +1,47 @@
+#include "poll_phase.h"
+
+static bool sof_recent(const poll_phase_t* p, uint32_t now_us) {
+    return now_us - p->sof_us.load(std::memory_order_relaxed) < 2 * FRAME_US;
+}
+
+void poll_phase_reset(poll_phase_t* p) {
+    p->phase_us.store(POLL_PHASE_UNKNOWN, std::memory_order_relaxed);
+    p->min_us = FRAME_US;
+    p->frames = 0;
+}
+
+void poll_phase_sof(poll_phase_t* p, uint32_t now_us) {
+    p->sof_us.store(now_us, std::memory_order_relaxed);
+}
+
+void poll_phase_report_complete(poll_phase_t* p, uint32_t now_us) {
+    if (!sof_recent(p, now_us)) {
+        return;
+    }
+    uint32_t phase = (now_us - p->sof_us.load(std::memory_order_relaxed)) % FRAME_US;
+    if (phase < p->min_us) {
+        p->min_us = phase;
+    }
+    if (++p->frames == POLL_PHASE_FRAMES) {
+        p->phase_us.store(p->min_us, std::memory_order_relaxed);
+        p->min_us = FRAME_US;
+        p->frames = 0;
+    }
+}
+
+uint32_t poll_phase_time_to_poll_us(const poll_phase_t* p, uint32_t now_us) {
+    uint32_t phase = p->phase_us.load(std::memory_order_relaxed);
+    if (phase == POLL_PHASE_UNKNOWN || !sof_recent(p, now_us)) {
+        return POLL_PHASE_UNKNOWN;
+    }
+    uint32_t in_frame = (now_us - p->sof_us.load(std::memory_order_relaxed)) % FRAME_US;
+    return (phase + FRAME_US - in_frame) % FRAME_US;
+}
+
+bool poll_phase_report_due(const poll_phase_t* p, uint32_t now_us, bool urgent) {
+    if (urgent) {
+        return true;
+    }
+    uint32_t to_poll = poll_phase_time_to_poll_us(p, now_us);
+    return to_poll == POLL_PHASE_UNKNOWN || to_poll <= REPORT_LEAD_US;
+}
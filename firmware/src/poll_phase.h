@@ -0,0 +1,45 @@
+#ifndef _POLL_PHASE_H_
+#define _POLL_PHASE_H_
+
+#include <stdint.h>
+
+#include <atomic>
+
+// Just-in-time reports. The host polls the mouse endpoint once per frame at
+// about the same point in the frame every time. That point is learned from
+// when sent reports complete relative to the SOF. Reports are then held back
+// until REPORT_LEAD_US before the next poll. Until the point is known, or
+// when there are no SOFs, reports go out as soon as the endpoint is free.
+
+#define FRAME_US 1000
+#define REPORT_LEAD_US 100
+// the poll phase is the earliest completion seen in this many frames
+#define POLL_PHASE_FRAMES 256
+#define POLL_PHASE_UNKNOWN UINT32_MAX
+
+// Core 0 updates it from the USB callbacks, core 1 only reads sof_us and
+// phase_us.
+struct poll_phase_t {
+    std::atomic<uint32_t> sof_us{ 0 };  // of the last SOF
+    std::atomic<uint32_t> phase_us{ POLL_PHASE_UNKNOWN };  // from the SOF
+    uint32_t min_us = FRAME_US;
+    uint32_t frames = 0;
+};
+
+// Forgets the phase, the host may poll at a different point in the frame
+// after a re-enumeration.
+void poll_phase_reset(poll_phase_t* p);
+void poll_phase_sof(poll_phase_t* p, uint32_t now_us);
+void poll_phase_report_complete(poll_phase_t* p, uint32_t now_us);
+
+// Microseconds from now until the next expected poll, or POLL_PHASE_UNKNOWN
+// if there are no SOFs (not mounted, suspended) or the phase isn't known yet.
+uint32_t poll_phase_time_to_poll_us(const poll_phase_t* p, uint32_t now_us);
+
+// True if a report should be handed to the free endpoint now. Urgent ones
+// always go. If the previous poll was missed, this waits for the next one,
+// which is when the report would go out anyway, and the data will be
+// fresher.
+bool poll_phase_report_due(const poll_phase_t* p, uint32_t now_us, bool urgent);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef _SPSC_QUEUE_H_
+#define _SPSC_QUEUE_H_
+
+#include <stdint.h>
+
+#include <atomic>
+
+// Lock-free single-producer/single-consumer ring buffer. One core may call
+// push() and another core may call pop() without any other synchronization.
+// Only plain atomic loads and stores are used, so it works on the M0+ cores.
+// It holds at most N - 1 items.
+template <typename T, uint32_t N>
+class SPSCQueue {
+   public:
+    bool push(const T& item) {
+        uint32_t write = write_index.load(std::memory_order_relaxed);
+        uint32_t next = (write + 1) % N;
+        if (next == read_index.load(std::memory_order_acquire)) {
+            return false;  // full
+        }
+        items[write] = item;
+        write_index.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& item) {
+        uint32_t read = read_index.load(std::memory_order_relaxed);
+        if (read == write_index.load(std::memory_order_acquire)) {
+            return false;  // empty
+        }
+        item = items[read];
+        read_index.store((read + 1) % N, std::memory_order_release);
+        return true;
+    }
+
+   private:
+    T items[N];
+    std::atomic<uint32_t> write_index{ 0 };
+    std::atomic<uint32_t> read_index{ 0 };
+};
+
+#endif
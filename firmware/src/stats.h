@@ -0,0 +1,117 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+
+// Runtime statistics: how long each stage of a sample takes, how many samples and reports go out per second,
+// how old the data in the reports is and how much time is spent in each power state. They're collected all the
+// time and read with feature report STATS_REPORT_ID, one page at a time:
+//   SET_REPORT: [page]
+//   GET_REPORT: [page] [STATS_VERSION] [page contents] (zero padded)
+// ConfigCommand::RESET_STATS starts them over. config-tool/trackball-stats.py reads them.
+//
+// Page 0 (STATS_PAGE_SUMMARY) is a stats_summary_t: totals, cycles per stage and data age.
+//
+// STATS_PAGE_MOTION is a stats_motion_t: sensor overflows, lost and carried over counts, reports not sent.
+//
+// STATS_PAGE_BUTTONS is a stats_buttons_t: presses, ignored bounces and press latency.
+//
+// STATS_PAGE_POWER is a stats_power_t: time in and wakeups from each power state, remote wakeups and wake latency.
+//
+// The other pages are histograms, one uint32_t count per bucket. Bucket 0 holds values below 2^shift, bucket i
+// values from 2^(shift + i - 1) up to 2^(shift + i), the last bucket everything above that.
+
+#define STATS_REPORT_ID 5
+#define STATS_VERSION 5
+#define STATS_REPORT_SIZE 62
+
+#define STATS_HISTOGRAM_BUCKETS 12
+
+enum StatsStage : uint8_t {
+    STAGE_SENSOR_READ = 0,  // hal_sensors_read()
+    STAGE_MAPPING = 1,      // button and sensor functions
+    STAGE_TWIST = 2,        // running averages and handle_twist_to_scroll()
+    STAGE_REPORT = 3,       // hal_hid_report()
+    NSTAGES = 4,
+};
+
+enum StatsPage : uint8_t {
+    STATS_PAGE_SUMMARY = 0,
+    STATS_PAGE_STAGE_CYCLES = 1,  // one page per stage, CPU cycles
+    STATS_PAGE_SAMPLES_PER_SECOND = STATS_PAGE_STAGE_CYCLES + NSTAGES,
+    STATS_PAGE_REPORTS_PER_SECOND,
+    STATS_PAGE_HID_BUSY_PER_SECOND,
+    STATS_PAGE_CPI_CHANGES_PER_SECOND,
+    STATS_PAGE_DATA_AGE,  // microseconds
+    STATS_PAGE_MOTION,
+    STATS_PAGE_BUTTONS,
+    STATS_PAGE_PRESS_LATENCY,  // microseconds
+    STATS_PAGE_POWER,
+    STATS_PAGE_WAKE_LATENCY,  // microseconds
+    STATS_NPAGES,
+};
+
+// smallest value that doesn't go into bucket 0 is 2^shift
+#define STATS_CYCLES_SHIFT 7
+#define STATS_PER_SECOND_SHIFT 0
+#define STATS_DATA_AGE_SHIFT 5
+#define STATS_PRESS_LATENCY_SHIFT 4
+#define STATS_WAKE_LATENCY_SHIFT 7
+
+struct __attribute__((packed)) stats_summary_t {
+    uint32_t time_ms;  // since the stats were reset
+    uint32_t samples;
+    uint32_t reports;
+    uint32_t hid_busy;  // reports that were due while the endpoint was still busy
+    uint32_t cpi_changes;
+    uint32_t stage_cycles_average[NSTAGES];
+    uint32_t stage_cycles_max[NSTAGES];
+    uint16_t data_age_average_us;
+    uint16_t data_age_min_us;
+    uint16_t data_age_max_us;
+};
+
+struct __attribute__((packed)) stats_motion_t {
+    uint32_t sensor_overflows;  // readings at the limit of the sensor's 16 bit delta registers
+    uint32_t saturated_samples;  // motion that didn't even fit in 32 bits, counts were lost
+    uint32_t carried_reports;  // reports that were full, the rest went into the next report
+    uint32_t carried_max;  // most counts carried over from one report to the next
+    uint32_t suppressed_reports;  // nothing new in them, so they weren't sent
+};
+
+// Press latency is from the first edge of a button press to the report with
+// the press in it being handed to the USB stack. It goes out on the next poll.
+struct __attribute__((packed)) stats_buttons_t {
+    uint32_t presses;
+    uint32_t bounces;  // edges the debouncing ignored
+    uint32_t press_latency_average_us;
+    uint32_t press_latency_min_us;
+    uint32_t press_latency_max_us;
+};
+
+enum PowerState : uint8_t {
+    POWER_RUN = 0,
+    POWER_REST1 = 1,
+    POWER_REST2 = 2,
+    POWER_REST3 = 3,
+    POWER_SUSPENDED = 4,  // the USB bus, whatever the sensors are doing
+    NPOWER_STATES = 5,
+};
+
+// The sensors can't tell which rest mode they're in, so the rest states are
+// where they should be, going by how long the ball has been still and the
+// rest mode settings. A wakeup is the first motion after the ball was still
+// long enough for a rest mode, or the first motion or button press while
+// suspended. Wake latency is from the sample that saw the motion (or the
+// press) to the first report after it being handed to the USB stack. After
+// a suspend that includes the remote wakeup and the host resuming the bus.
+struct __attribute__((packed)) stats_power_t {
+    uint32_t state_ms[NPOWER_STATES];
+    uint32_t wakeups[NPOWER_STATES];  // out of each state, run has none
+    uint32_t remote_wakeups;  // times the host was woken up
+    uint32_t wake_latency_average_us;
+    uint32_t wake_latency_min_us;
+    uint32_t wake_latency_max_us;
+};
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+#include <stdint.h>
+
+// Bulk stream to the host over an optional vendor interface (build with
+// -DVENDOR_INTERFACE=ON). Much faster than paging through feature reports,
+// for recording long traces and watching the stats live.
+//
+// The host turns streams on and off by writing commands to the bulk OUT
+// endpoint:
+//   [STREAM_COMMAND_START] [mask of STREAM_* to turn on]
+//   [STREAM_COMMAND_STOP] [mask of STREAM_* to turn off]
+// Starting STREAM_TRACE discards whatever was left in the trace buffer, like
+// TRACE_START in trace.h does.
+//
+// The device sends packets on the bulk IN endpoint, each one a
+// stream_packet_header_t followed by length bytes of payload:
+//   STREAM_TRACE    uint32_t records dropped since the start, then trace_record_t's
+//   STREAM_STATS    stats_summary_t (see stats.h), every STREAM_STATS_INTERVAL_US
+//   STREAM_FRAMES(sensor)  a chunk of a frame from that sensor, see frame.h
+// A packet is only written when there's room for all of it in the endpoint
+// buffer, so the stream never waits for the host, and when the host doesn't
+// keep up trace records are dropped the same way as with feature reports.
+// config-tool/trackball-stream.py reads it.
+
+#define STREAM_SYNC 0xA5
+
+#define STREAM_COMMAND_START 1
+#define STREAM_COMMAND_STOP 2
+
+#define STREAM_TRACE (1 << 0)
+#define STREAM_STATS (1 << 1)
+// frames from one sensor at a time, starting one stops the other
+#define STREAM_FRAMES(sensor) (1 << (2 + (sensor)))
+
+#define STREAM_STATS_INTERVAL_US 100000
+
+// keeps packets small enough to fit in the endpoint buffer
+#define STREAM_MAX_TRACE_RECORDS 32
+#define STREAM_FRAME_CHUNK_SIZE 324
+
+struct __attribute__((packed)) stream_packet_header_t {
+    uint8_t sync;
+    uint8_t type;
+    uint16_t length;
+};
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+#include "trackball.h"
+
+// Motion traces: the raw inputs of every sensor_task() call (time, buttons
+// and per-sensor deltas), so that they can be fed through the logic again on
+// the host, see host/replay.h.
+//
+// On the device, records are collected in a RAM ring buffer while recording
+// is on. The host drains it with feature report TRACE_REPORT_ID:
+//   GET_REPORT: [count] [flags] [count records] (zero padded)
+//   SET_REPORT: [TRACE_START or TRACE_STOP]
+// Starting a recording discards whatever was left in the buffer. When the
+// buffer is full, new records are dropped and TRACE_FLAG_DROPPED is set in
+// the next report.
+//
+// A trace file is a trace_header_t followed by trace_record_t's, all little
+// endian. config-tool/trackball-trace.py records them.
+
+#define TRACE_MAGIC 0x52544254  // "TBTR"
+#define TRACE_VERSION 6
+
+#define TRACE_REPORT_ID 4
+#define TRACE_RECORDS_PER_REPORT 4
+#define TRACE_REPORT_SIZE (2 + TRACE_RECORDS_PER_REPORT * sizeof(trace_record_t))
+
+// ~4 seconds at 1000 samples per second
+#define TRACE_BUFFER_SIZE 4096
+
+#define TRACE_STOP 0
+#define TRACE_START 1
+
+#define TRACE_FLAG_RECORDING (1 << 0)
+#define TRACE_FLAG_DROPPED (1 << 1)
+
+struct __attribute__((packed)) trace_header_t {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t nsensors;
+    uint8_t resolution_multiplier;
+    uint8_t reserved;
+    config_t config;
+};
+
+struct __attribute__((packed)) trace_record_t {
+    uint32_t time_us;  // lower 32 bits of hal_time_us()
+    uint8_t buttons;   // as returned by hal_buttons_get()
+    int16_t movement[NSENSORS][2];
+};
+
+#endif
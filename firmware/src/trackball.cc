@@ -25,220 +25,165 @@
  */
 
 #include <math.h>
-#include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include <bsp/board.h>
-#include <tusb.h>
-
-#include <pico/bootrom.h>
-#include <pico/stdlib.h>
-
-#include <hardware/flash.h>
-#include <hardware/gpio.h>
-
+#include "config_store.h"
 #include "crc.h"
-#include "pmw3360.h"
-
-// These IDs are bogus. If you want to distribute any hardware using this,
-// you will have to get real ones.
-#define USB_VID 0xCAFE
-#define USB_PID 0xBADA
-
-#define CONFIG_VERSION 1
-#define CONFIG_SIZE 26
-
-#define NSENSORS 2
-#define NBUTTONS 4
-
-#define PRESUMED_FLASH_SIZE 2097152
-#define CONFIG_OFFSET_IN_FLASH (PRESUMED_FLASH_SIZE - FLASH_SECTOR_SIZE)
-#define FLASH_CONFIG_IN_MEMORY (((uint8_t*) XIP_BASE) + CONFIG_OFFSET_IN_FLASH)
-
-uint button_pins[NBUTTONS] = { 16, 17, 24, 26 };
-
-#define SENSOR0_SPI spi0
-#define SENSOR0_MISO 4
-#define SENSOR0_MOSI 3
-#define SENSOR0_SCK 2
-#define SENSOR0_NCS 9
-#define SENSOR1_SPI spi0
-#define SENSOR1_MISO 20
-#define SENSOR1_MOSI 23
-#define SENSOR1_SCK 18
-#define SENSOR1_NCS 25
-
-PMW3360 sensors[NSENSORS] = {
-    PMW3360(SENSOR0_SPI, SENSOR0_MISO, SENSOR0_MOSI, SENSOR0_SCK, SENSOR0_NCS),
-    PMW3360(SENSOR1_SPI, SENSOR1_MISO, SENSOR1_MOSI, SENSOR1_SCK, SENSOR1_NCS),
-};
-
-tusb_desc_device_t const desc_device = {
-    .bLength = sizeof(tusb_desc_device_t),
-    .bDescriptorType = TUSB_DESC_DEVICE,
-    .bcdUSB = 0x0200,
-    .bDeviceClass = 0x00,
-    .bDeviceSubClass = 0x00,
-    .bDeviceProtocol = 0x00,
-    .bMaxPacketSize0 = CFG_TUD_ENDPOINT0_SIZE,
-
-    .idVendor = USB_VID,
-    .idProduct = USB_PID,
-    .bcdDevice = 0x0100,
-
-    .iManufacturer = 0x01,
-    .iProduct = 0x02,
-    .iSerialNumber = 0x00,
-
-    .bNumConfigurations = 0x01,
-};
-
-uint8_t const desc_hid_report[] = {
-    0x05, 0x01,         // Usage Page (Generic Desktop Ctrls)
-    0x09, 0x02,         // Usage (Mouse)
-    0xA1, 0x01,         // Collection (Application)
-    0x05, 0x01,         //   Usage Page (Generic Desktop Ctrls)
-    0x09, 0x02,         //   Usage (Mouse)
-    0xA1, 0x02,         //   Collection (Logical)
-    0x85, 0x01,         //     Report ID (1)
-    0x09, 0x01,         //     Usage (Pointer)
-    0xA1, 0x00,         //     Collection (Physical)
-    0x05, 0x09,         //       Usage Page (Button)
-    0x19, 0x01,         //       Usage Minimum (0x01)
-    0x29, 0x08,         //       Usage Maximum (0x08)
-    0x95, 0x08,         //       Report Count (8)
-    0x75, 0x01,         //       Report Size (1)
-    0x25, 0x01,         //       Logical Maximum (1)
-    0x81, 0x02,         //       Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position)
-    0x05, 0x01,         //       Usage Page (Generic Desktop Ctrls)
-    0x09, 0x30,         //       Usage (X)
-    0x09, 0x31,         //       Usage (Y)
-    0x95, 0x02,         //       Report Count (2)
-    0x75, 0x10,         //       Report Size (16)
-    0x16, 0x00, 0x80,   //       Logical Minimum (-32768)
-    0x26, 0xFF, 0x7F,   //       Logical Maximum (32767)
-    0x81, 0x06,         //       Input (Data,Var,Rel,No Wrap,Linear,Preferred State,No Null Position)
-    0xA1, 0x02,         //       Collection (Logical)
-    0x85, 0x02,         //         Report ID (2)
-    0x09, 0x48,         //         Usage (Resolution Multiplier)
-    0x95, 0x01,         //         Report Count (1)
-    0x75, 0x02,         //         Report Size (2)
-    0x15, 0x00,         //         Logical Minimum (0)
-    0x25, 0x01,         //         Logical Maximum (1)
-    0x35, 0x01,         //         Physical Minimum (1)
-    0x45, 0x78,         //         Physical Maximum (120)
-    0xB1, 0x02,         //         Feature (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
-    0x85, 0x01,         //         Report ID (1)
-    0x09, 0x38,         //         Usage (Wheel)
-    0x35, 0x00,         //         Physical Minimum (0)
-    0x45, 0x00,         //         Physical Maximum (0)
-    0x16, 0x00, 0x80,   //         Logical Minimum (-32768)
-    0x26, 0xFF, 0x7F,   //         Logical Maximum (32767)
-    0x75, 0x10,         //         Report Size (16)
-    0x81, 0x06,         //         Input (Data,Var,Rel,No Wrap,Linear,Preferred State,No Null Position)
-    0xC0,               //       End Collection
-    0xA1, 0x02,         //       Collection (Logical)
-    0x85, 0x02,         //         Report ID (2)
-    0x09, 0x48,         //         Usage (Resolution Multiplier)
-    0x75, 0x02,         //         Report Size (2)
-    0x15, 0x00,         //         Logical Minimum (0)
-    0x25, 0x01,         //         Logical Maximum (1)
-    0x35, 0x01,         //         Physical Minimum (1)
-    0x45, 0x78,         //         Physical Maximum (120)
-    0xB1, 0x02,         //         Feature (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
-    0x35, 0x00,         //         Physical Minimum (0)
-    0x45, 0x00,         //         Physical Maximum (0)
-    0x75, 0x04,         //         Report Size (4)
-    0xB1, 0x03,         //         Feature (Const,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
-    0x85, 0x01,         //         Report ID (1)
-    0x05, 0x0C,         //         Usage Page (Consumer)
-    0x16, 0x00, 0x80,   //         Logical Minimum (-32768)
-    0x26, 0xFF, 0x7F,   //         Logical Maximum (32767)
-    0x75, 0x10,         //         Report Size (16)
-    0x0A, 0x38, 0x02,   //         Usage (AC Pan)
-    0x81, 0x06,         //         Input (Data,Var,Rel,No Wrap,Linear,Preferred State,No Null Position)
-    0xC0,               //       End Collection
-    0xC0,               //     End Collection
-    0xC0,               //   End Collection
-    0x06, 0x00, 0xFF,   //   Usage Page (Vendor Defined 0xFF00)
-    0x09, 0x20,         //   Usage (0x20)
-    0x85, 0x03,         //   Report ID (3)
-    0x75, 0x08,         //   Report Size (8)
-    0x95, CONFIG_SIZE,  //   Report Count (CONFIG_SIZE)
-    0xB1, 0x02,         //   Feature (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
-    0xC0,               // End Collection
-};
-
-#define CONFIG_TOTAL_LEN (TUD_CONFIG_DESC_LEN + TUD_HID_DESC_LEN)
-#define EPNUM_HID 0x81
-
-uint8_t const desc_configuration[] = {
-    // Config number, interface count, string index, total length, attribute, power in mA
-    TUD_CONFIG_DESCRIPTOR(1, 1, 0, CONFIG_TOTAL_LEN, 0, 100),
-
-    // Interface number, string index, protocol, report descriptor len, EP In address, size & polling interval
-    TUD_HID_DESCRIPTOR(0, 0, HID_ITF_PROTOCOL_NONE, sizeof(desc_hid_report), EPNUM_HID, CFG_TUD_HID_EP_BUFSIZE, 1)
+#include "frame.h"
+#include "hal.h"
+#include "spsc_queue.h"
+#include "stats.h"
+#include "stream.h"
+#include "trace.h"
+#include "trackball.h"
+
+// Motion summed over sensors, samples and reports is kept in 32 bits and
+// saturates there instead of wrapping around. What doesn't fit in the 16 bits
+// of a report is carried over into the next one, so no counts are lost.
+struct motion_t {
+    uint8_t buttons;
+    int32_t dx;
+    int32_t dy;
+    int32_t vwheel;
+    int32_t hwheel;
 };
 
-char const* string_desc_arr[] = {
-    (const char[]){ 0x09, 0x04 },  // 0: is supported language is English (0x0409)
-    "RP2040+PMW3360",              // 1: Manufacturer
-    "Trackball",                   // 2: Product
+// sensor_task() runs on core 1. Every sample (or, when core 0 falls behind,
+// several samples summed together) is passed to hid_task() on core 0 through
+// this queue. Core 0 only accumulates them into the report and sends it.
+struct queued_sample_t {
+    motion_t motion;
+    uint32_t time_us;  // when the newest of the samples was taken
+    bool press;  // a button went down, the report shouldn't wait
+    uint32_t press_us;  // when the first one did
+    bool wake;  // first motion or press out of a rest state or a suspend
+    uint32_t wake_us;
 };
 
-struct __attribute__((packed)) hid_report_t {
-    uint8_t buttons;
-    int16_t dx;
-    int16_t dy;
-    int16_t vwheel;
-    int16_t hwheel;
+SPSCQueue<queued_sample_t, 64> sample_queue;
+
+motion_t sample;  // core 1
+queued_sample_t pending_sample;  // core 1, samples that didn't fit in the queue yet
+motion_t report_motion;  // core 0, not sent yet
+hid_report_t report;  // core 0
+uint32_t report_sample_us = 0;  // core 0, time of the newest sample in the report
+uint32_t sent_sample_us = 0;  // core 0, the same for the report being sent
+uint64_t report_sent_us = 0;  // core 0
+uint64_t report_slot_us = 0;  // core 0, when the last report was sent or suppressed
+bool report_in_flight = false;  // core 0
+bool report_press = false;  // core 0, the report has a new press in it
+uint32_t report_press_us = 0;  // core 0
+bool report_wake = false;  // core 0, the report has a wakeup in it
+uint32_t report_wake_us = 0;  // core 0
+
+// Stats, see stats.h. They're read by core 0 without any locking, so a
+// value can occasionally be a sample out of date. Core 1 clears its own
+// stats when core 0 sets stats_reset_requested.
+struct stage_stats_t {
+    uint64_t total_cycles;
+    uint32_t count;
+    uint32_t max_cycles;
+    uint32_t histogram[STATS_HISTOGRAM_BUCKETS];
 };
 
-hid_report_t report;
-
-enum class ButtonFunction : int8_t {
-    NO_FUNCTION = 0,
-    BUTTON1 = 1,
-    BUTTON2 = 2,
-    BUTTON3 = 3,
-    BUTTON4 = 4,
-    BUTTON5 = 5,
-    BUTTON6 = 6,
-    BUTTON7 = 7,
-    BUTTON8 = 8,
-    CLICK_DRAG = 9,
-    SHIFT = 10,
+struct per_second_t {
+    uint64_t start_us;
+    uint32_t count;
+    uint32_t histogram[STATS_HISTOGRAM_BUCKETS];
 };
 
-enum class SensorFunction : int8_t {
-    NO_FUNCTION = 0,
-    CURSOR_X = 1,
-    CURSOR_Y = 2,
-    VERTICAL_SCROLL = 3,
-    HORIZONTAL_SCROLL = 4,
-    CURSOR_X_INVERTED = -1,
-    CURSOR_Y_INVERTED = -2,
-    VERTICAL_SCROLL_INVERTED = -3,
-    HORIZONTAL_SCROLL_INVERTED = -4,
+struct sensor_stats_t {
+    uint32_t samples;
+    uint32_t cpi_changes;
+    uint32_t sensor_overflows;
+    uint32_t saturated_samples;
+    uint64_t power_state_us[NPOWER_STATES];
+    uint32_t wakeups[NPOWER_STATES];
+    per_second_t samples_per_second;
+    per_second_t cpi_changes_per_second;
 };
 
-enum class ConfigCommand : int8_t {
-    NO_COMMAND = 0,
-    RESET_INTO_BOOTSEL = 1,
+struct usb_stats_t {
+    uint64_t reset_us;
+    uint32_t reports;
+    uint32_t hid_busy;
+    uint32_t carried_reports;
+    uint32_t carried_max;
+    uint32_t suppressed_reports;
+    per_second_t reports_per_second;
+    per_second_t hid_busy_per_second;
+    uint32_t data_age_min_us;
+    uint32_t data_age_max_us;
+    uint64_t data_age_total_us;
+    uint32_t data_age_count;
+    uint32_t data_age_histogram[STATS_HISTOGRAM_BUCKETS];
+    uint32_t presses;
+    uint32_t bounces_at_reset;
+    uint32_t press_latency_min_us;
+    uint32_t press_latency_max_us;
+    uint64_t press_latency_total_us;
+    uint32_t press_latency_histogram[STATS_HISTOGRAM_BUCKETS];
+    uint32_t remote_wakeups;
+    uint32_t wake_count;
+    uint32_t wake_latency_min_us;
+    uint32_t wake_latency_max_us;
+    uint64_t wake_latency_total_us;
+    uint32_t wake_latency_histogram[STATS_HISTOGRAM_BUCKETS];
 };
 
-struct __attribute__((packed)) config_t {
-    uint8_t version;
-    ConfigCommand command;
-    SensorFunction sensor_function[NSENSORS][2];
-    SensorFunction sensor_shifted_function[NSENSORS][2];
-    uint8_t sensor_cpi[NSENSORS];
-    uint8_t sensor_shifted_cpi[NSENSORS];
-    ButtonFunction button_function[NBUTTONS];
-    ButtonFunction button_shifted_function[NBUTTONS];
-    uint32_t crc32;
-};
+// stages up to STAGE_TWIST are written by core 1, STAGE_REPORT by core 0
+stage_stats_t stage_stats[NSTAGES];
+sensor_stats_t sensor_stats;  // core 1
+usb_stats_t usb_stats = {
+    .data_age_min_us = UINT32_MAX,
+    .press_latency_min_us = UINT32_MAX,
+    .wake_latency_min_us = UINT32_MAX,
+};  // core 0
+std::atomic<bool> stats_reset_requested{ false };
+uint8_t stats_page = STATS_PAGE_SUMMARY;
+
+// the host polls the mouse endpoint every frame, a report that's still not
+// gone after this long missed a poll
+#define HID_BUSY_US 1250
+// Reports with nothing new in them aren't sent, the host would only have to
+// wake up for nothing. They're counted once per poll they would have gone
+// out in, any two are at least this far apart.
+#define SUPPRESSED_REPORT_SPACING_US 500
+
+// samples per second don't fit in the buckets otherwise
+#define STATS_SAMPLES_PER_SECOND_SHIFT 4
+
+// Trace recorder, see trace.h. Core 1 fills the queue while recording is on,
+// core 0 drains it in handle_get_report(). trace_dropped is only written by
+// core 1, core 0 remembers the value it last reported.
+SPSCQueue<trace_record_t, TRACE_BUFFER_SIZE> trace_queue;
+std::atomic<bool> trace_recording{ false };
+std::atomic<uint32_t> trace_dropped{ 0 };
+uint32_t trace_dropped_reported = 0;
+
+// Bulk stream, see stream.h. Core 0.
+uint8_t stream_mask = 0;
+uint64_t stream_stats_sent_us = 0;
+uint32_t stream_dropped_start = 0;
+uint8_t stream_buffer[sizeof(stream_packet_header_t) + 4 + STREAM_MAX_TRACE_RECORDS * sizeof(trace_record_t)];
+
+// Frame capture, see frame.h. Core 0.
+int8_t frame_sensor = FRAME_NO_SENSOR;
+const uint8_t* frame = nullptr;  // the one being read by the host
+uint8_t frame_number = 0;
+uint16_t frame_offset = 0;
+
+bool got_first_sample = false;
+
+// Without the MOTION pins, motion after the ball was still would be picked
+// up up to an idle interval late, so adaptive sampling is off by default.
+#ifdef MOTION_INTERRUPT
+#define DEFAULT_IDLE_AFTER_MS 500
+#else
+#define DEFAULT_IDLE_AFTER_MS 0
+#endif
 
 config_t config = {
     .version = CONFIG_VERSION,
@@ -252,12 +197,12 @@ config_t config = {
         { SensorFunction::VERTICAL_SCROLL, SensorFunction::NO_FUNCTION },
     },
     .sensor_cpi = {
-        600 / 100,
-        800 / 100,
+        600,
+        800,
     },
     .sensor_shifted_cpi = {
-        600 / 100,
-        800 / 100,
+        600,
+        800,
     },
     .button_function = {
         ButtonFunction::BUTTON1,
@@ -271,38 +216,236 @@ config_t config = {
         ButtonFunction::BUTTON2,
         ButtonFunction::BUTTON3,
     },
+    .sample_rate = 1000 / 100,
+    .native_cpi = 0,
+    // rest mode off, the rest is roughly the sensor's own defaults
+    .rest_after = { 0, 100, 6000 },
+    .rest_period_ms = { 1, 100, 500 },
+    .idle_after_ms = DEFAULT_IDLE_AFTER_MS,
+    .idle_interval_ms = 8,
+    // sensor 0 right under the ball, sensor 1 on its side, looking at the twist
+    .sensor_elevation = { 0, 90 },
+    .sensor_azimuth = { 0, 0 },
+    .sensor_rotation = { 0, 90 },
     .crc32 = 0,
 };
 
+// Saving the config waits this long after the last change, so that several
+// in a row only get written once. Core 0.
+#define CONFIG_SAVE_DELAY_US 500000
+bool config_save_pending = false;
+uint64_t config_save_at_us = 0;
+
+// range of config.sample_rate, in hundreds of samples per second
+#define MIN_SAMPLE_RATE 1
+#define MAX_SAMPLE_RATE 80
+
+// range of config.idle_interval_ms
+#define MAX_IDLE_INTERVAL_MS 100
+
+// what the PMW3360 can be set to
+#define SENSOR_CPI_STEP 100
+#define SENSOR_MAX_CPI 12000
+
+// Power states, see stats.h. Core 0 follows the USB bus from the callbacks,
+// core 1 follows core 0: while suspended it samples less often, keeps the
+// sensors in rest mode even if the config doesn't and asks core 0 to wake
+// the host up when the ball moves or a button is pressed.
+#define SUSPENDED_SAMPLE_INTERVAL_US 10000
+std::atomic<bool> usb_suspended{ false };
+bool remote_wakeup_allowed = false;  // core 0
+bool remote_wakeup_sent = false;  // core 0
+std::atomic<bool> remote_wakeup_requested{ false };  // set by core 1, cleared by core 0
+// the sensor's power-on settings, used while suspended if the config has rest mode off
+const sensor_rest_t default_rest = { true, 0x32, 0x0000, 0x1f, 0x0063, 0xbc, 0x01f3 };
+sensor_rest_t config_rest;  // core 1, compiled with the routes
+sensor_rest_t current_rest[NSENSORS];  // core 1, what the sensors are set to
+// how long the ball has to be still for each rest mode with the current settings
+uint64_t rest_after_us[3];  // core 1
+uint64_t last_motion_us = 0;  // core 1
+uint64_t power_state_updated_us = 0;  // core 1
+uint8_t prev_power_state = POWER_RUN;  // core 1, what the time since then was spent in
+bool suspend_woken = false;  // core 1, the wakeup for this suspend was already counted
+
+// Adaptive sampling, core 1. sample_interval_us() is the longer of the
+// configured interval and idle_sample_interval_us, which doubles with every
+// sample once the ball has been still for long enough and goes back to 0
+// when it moves. The idle settings are compiled with the routes.
+uint32_t idle_sample_interval_us = 0;
+uint64_t last_active_us = 0;  // motion or a button held
+uint64_t idle_after_us = 0;  // 0 is off
+uint32_t max_idle_interval_us = 0;
+
 uint8_t resolution_multiplier = 0;
 
 int accumulated_scroll[NSENSORS][2] = { 0 };
 uint64_t last_scroll_timestamp[NSENSORS][2] = { 0 };
-uint32_t prev_pin_state = 0xffffffff;
+uint32_t prev_buttons = 0;
 bool click_drag = false;
-uint8_t current_cpi[NSENSORS] = { 0 };
+uint16_t current_cpi[NSENSORS] = { 0 };  // what the sensors are set to
+uint16_t output_cpi[NSENSORS] = { 0 };  // what comes out after scaling
+// what scaling down to output_cpi left over, in 1 / current_cpi counts
+int32_t cpi_remainder[NSENSORS][2] = { 0 };
 bool scroll_mode = false;
 bool not_scroll_mode = false;
-float running_avg_x = 0;
-float running_avg_y = 0;
-float running_avg_hscroll = 0;
-float running_avg_vscroll = 0;
 
-int16_t handle_scroll(int sensor, int axis, int16_t movement, uint8_t multiplier_mask, float* running_avg_scroll) {
+// The config compiled into what sensor_task() needs for each shift state,
+// so that it doesn't have to go through the functions every sample. Core 0
+// bumps config_generation whenever the config changes and core 1 compiles
+// the routes again before its next sample.
+enum MotionField : uint8_t {
+    FIELD_DX = 0,
+    FIELD_DY = 1,
+    FIELD_VWHEEL = 2,
+    FIELD_HWHEEL = 3,
+    FIELD_NONE = 4,
+};
+
+struct axis_route_t {
+    int8_t sign;
+    uint8_t field;
+    uint8_t multiplier_mask;  // resolution multiplier bit of the scroll fields
+};
+
+struct routes_t {
+    axis_route_t axis[NSENSORS][2];
+    uint8_t button_mask[NBUTTONS];  // report buttons pressed by each physical button
+    uint32_t click_drag_buttons;
+    uint16_t sensor_cpi[NSENSORS];
+    uint16_t output_cpi[NSENSORS];
+};
+
+std::atomic<uint32_t> config_generation{ 1 };
+uint32_t routes_generation = 0;  // core 1
+routes_t routes[2];  // core 1, indexed by shifted
+uint32_t shift_buttons = 0;  // core 1
+
+// Speed estimates for the twist-to-scroll logic, one per sensor axis, index
+// sensor * 2 + axis, in inches per second of ball surface, as Q11.20 fixed
+// point. They're exponential moving averages with a time constant of
+// AVG_TIME_CONSTANT_US, stepped by the time that actually passed between
+// samples, so they come out the same at any sample rate. The RP2040 has no
+// FPU, so there's no floating point in the per-sample path.
+int32_t running_avg[NSENSORS * 2] = { 0 };  // core 1
+
+// How the ball turns, worked out from the running averages and where the
+// sensors are. Each sensor axis sees the ball's angular velocity through a
+// row of a 4x3 matrix A, compile_twist() turns that into the least squares
+// solution (A^T A)^-1 A^T as Q16.16, and handle_twist_to_scroll() applies it
+// every sample. The angular velocity comes out as the speed of the ball's
+// surface at its equator, in the same units as the averages, X and Y being
+// rolling and Z twisting.
+int32_t twist_solver[3][NSENSORS * 2];  // core 1
+// sensor axes that mostly see twisting, bit sensor * 2 + axis
+uint32_t twist_axes = 0;  // core 1
+
+// what the routes' fields point at
+int32_t* const motion_fields[] = { &sample.dx, &sample.dy, &sample.vwheel, &sample.hwheel };
+// inches per count as Q0.32, from the sensor's CPI
+uint32_t avg_scale[NSENSORS] = { 0 };
+// what one count adds to a running average at the current sample interval,
+// in inches per second as Q2.30
+uint32_t avg_gain[NSENSORS] = { 0 };
+// decay (Q0.20) and weight of new samples (1/s as Q12.20) for avg_dt_us
+int32_t avg_decay = 0;
+uint32_t avg_rate = 0;
+uint32_t avg_dt_us = 0;
+uint64_t avg_last_update_us = 0;
+
+#define AVG_FRACTION_BITS 20
+#define AVG_ONE (1 << AVG_FRACTION_BITS)
+// 0.9 per sample at 1000 samples per second, what the thresholds were tuned with
+#define AVG_TIME_CONSTANT_US 9491
+#define AVG_DECAY_PER_US 2147257400u  // exp(-1 us / AVG_TIME_CONSTANT_US) as Q1.31
+// longer gaps between samples are treated as this long, everything has
+// decayed to zero by then anyway
+#define AVG_MAX_DT_US 1000000
+// speeds of the ball surface, in mm/s (a 57.2 mm ball turns once per 180 mm)
+#define MM_PER_S(x) ((int32_t) ((x) / 25.4 * AVG_ONE + 0.5))
+#define MM_PER_S_SQUARED(x) ((int64_t) ((x) / 25.4 * AVG_ONE * ((x) / 25.4) * AVG_ONE + 0.5))
+
+void update_avg_gain(int sensor) {
+    avg_gain[sensor] = ((uint64_t) avg_scale[sensor] * avg_rate) >> (32 + AVG_FRACTION_BITS - 30);
+}
+
+void set_avg_scale(int sensor, uint16_t cpi) {
+    avg_scale[sensor] = 4294967300ull / cpi;  // ~2^32, same as before for multiples of 100
+    update_avg_gain(sensor);
+}
+
+// exp(-dt_us / AVG_TIME_CONSTANT_US) as Q1.31, by raising the decay per
+// microsecond to the power of dt_us
+uint32_t avg_decay_for(uint32_t dt_us) {
+    uint64_t result = 1u << 31;
+    uint64_t factor = AVG_DECAY_PER_US;
+    while (dt_us != 0) {
+        if (dt_us & 1) {
+            result = (result * factor + (1u << 30)) >> 31;
+        }
+        factor = (factor * factor + (1u << 30)) >> 31;
+        dt_us >>= 1;
+    }
+    return result;
+}
+
+void running_avg_add(int32_t* avg, int16_t movement, int sensor) {
+    int64_t sum = *avg + (((int64_t) movement * avg_gain[sensor] + (1 << 9)) >> (30 - AVG_FRACTION_BITS));
+    if (sum > INT32_MAX) {
+        sum = INT32_MAX;
+    }
+    if (sum < -INT32_MAX) {
+        sum = -INT32_MAX;
+    }
+    *avg = sum;
+}
+
+// rounded towards zero, so that it gets to zero when there's no motion
+int32_t running_avg_decay(int32_t avg) {
+    return ((int64_t) avg * avg_decay + (avg < 0 ? AVG_ONE - 1 : 0)) >> AVG_FRACTION_BITS;
+}
+
+// Decays the averages by the time since the last sample. New motion is then
+// added as distance / dt weighted by (1 - decay), which makes the averages
+// converge to the actual speed whatever dt is. The sample interval is nearly
+// always the same, so the weights are only recomputed when it changes.
+void running_avg_update(uint64_t now) {
+    uint64_t dt = now - avg_last_update_us;
+    avg_last_update_us = now;
+    if (dt > AVG_MAX_DT_US) {
+        dt = AVG_MAX_DT_US;
+    }
+    if (dt == 0) {
+        dt = 1;
+    }
+    if (dt != avg_dt_us) {
+        avg_dt_us = dt;
+        uint32_t decay = avg_decay_for(dt);
+        avg_decay = (decay + (1 << (31 - AVG_FRACTION_BITS - 1))) >> (31 - AVG_FRACTION_BITS);
+        avg_rate = (((uint64_t) ((1u << 31) - decay) * 1000000 / dt) + (1 << 10)) >> (31 - AVG_FRACTION_BITS);
+        for (int sensor = 0; sensor < NSENSORS; sensor++) {
+            update_avg_gain(sensor);
+        }
+    }
+
+    for (int i = 0; i < NSENSORS * 2; i++) {
+        running_avg[i] = running_avg_decay(running_avg[i]);
+    }
+}
+
+int16_t handle_scroll(int sensor, int axis, int16_t movement, uint8_t multiplier_mask, uint64_t now) {
     int16_t ret = 0;
-    *running_avg_scroll += 0.1 * movement / current_cpi[sensor];
     if (resolution_multiplier & multiplier_mask) {
         ret = movement;
     } else {
         if (movement != 0) {
-            last_scroll_timestamp[sensor][axis] = time_us_64();
+            last_scroll_timestamp[sensor][axis] = now;
             accumulated_scroll[sensor][axis] += movement;
             int ticks = accumulated_scroll[sensor][axis] / 120;
             accumulated_scroll[sensor][axis] -= ticks * 120;
             ret = ticks;
         } else {
             if ((accumulated_scroll[sensor][axis] != 0) &&
-                (time_us_64() - last_scroll_timestamp[sensor][axis] > 1000000)) {
+                (now - last_scroll_timestamp[sensor][axis] > 1000000)) {
                 accumulated_scroll[sensor][axis] = 0;
             }
         }
@@ -310,190 +453,1094 @@ int16_t handle_scroll(int sensor, int axis, int16_t movement, uint8_t multiplier
     return ret;
 }
 
+// turns v in the plane of axes a and b, from a towards b
+void rotate(double v[3], int a, int b, double degrees) {
+    double c = cos(degrees * (M_PI / 180));
+    double s = sin(degrees * (M_PI / 180));
+    double va = v[a];
+    v[a] = va * c - v[b] * s;
+    v[b] = va * s + v[b] * c;
+}
+
+// A sensor right under the ball sees the angular velocity's Y on its X axis
+// and minus its X on its Y axis, a sensor anywhere else sees those rows
+// turned the way it is. Done when the config changes, so floating point is
+// fine here.
+void compile_twist() {
+    double rows[NSENSORS * 2][3];
+    twist_axes = 0;
+    for (int sensor = 0; sensor < NSENSORS; sensor++) {
+        // the config is packed, these aren't aligned
+        int16_t elevation = config.sensor_elevation[sensor];
+        int16_t azimuth = config.sensor_azimuth[sensor];
+        int16_t rotation = config.sensor_rotation[sensor];
+        double* x = rows[sensor * 2];
+        double* y = rows[sensor * 2 + 1];
+        x[0] = 0;
+        x[1] = 1;
+        x[2] = 0;
+        y[0] = -1;
+        y[1] = 0;
+        y[2] = 0;
+        for (int axis = 0; axis < 2; axis++) {
+            double* row = rows[sensor * 2 + axis];
+            rotate(row, 0, 1, -rotation);
+            rotate(row, 2, 0, -elevation);
+            rotate(row, 0, 1, azimuth);
+            if (fabs(row[2]) > 0.5) {
+                twist_axes |= 1 << (sensor * 2 + axis);
+            }
+        }
+    }
+
+    // A^T A, with a little added so that it can be inverted when the sensors
+    // can't see some axis, which then comes out as zero
+    double m[3][3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            m[i][j] = (i == j) ? 0.001 : 0;
+            for (int k = 0; k < NSENSORS * 2; k++) {
+                m[i][j] += rows[k][i] * rows[k][j];
+            }
+        }
+    }
+    // its adjugate, the inverse times the determinant
+    double inverse[3][3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            int i1 = (i + 1) % 3;
+            int i2 = (i + 2) % 3;
+            int j1 = (j + 1) % 3;
+            int j2 = (j + 2) % 3;
+            inverse[j][i] = m[i1][j1] * m[i2][j2] - m[i1][j2] * m[i2][j1];
+        }
+    }
+    double det = m[0][0] * inverse[0][0] + m[0][1] * inverse[1][0] + m[0][2] * inverse[2][0];
+    for (int i = 0; i < 3; i++) {
+        for (int k = 0; k < NSENSORS * 2; k++) {
+            double sum = 0;
+            for (int j = 0; j < 3; j++) {
+                sum += inverse[i][j] * rows[k][j];
+            }
+            twist_solver[i][k] = lround(sum / det * 65536);
+        }
+    }
+}
+
 /*
  * This function tries to decide whether we're scrolling or moving the cursor.
  * It then commits to one or the other until the ball stops moving.
- * If it decides that we're moving the cursor then it zeroes any scroll input.
- * It doesn't currently cancel cursor movement when it decides that we're
- * scrolling.
- * The sensor axes functions are configurable, but below logic probably only
- * makes sense if the default mapping is used. It might also slightly interfere
- * with a configuration where you have the ball set to scroll when "shift"
- * button is held, so keep that in mind.
+ * It works on how the ball is turning, worked out from both sensors and
+ * where they are, so it doesn't matter which sensor axes are mapped to
+ * what, shifted or not. Rolling fast enough means we're moving the cursor,
+ * twisting fast enough means we're scrolling, and until we're scrolling the
+ * scroll axes that see the twist are ignored. It doesn't currently cancel
+ * cursor movement when it decides that we're scrolling.
  * False positives still happen occasionally, you can try to tweak the
  * thresholds to improve the situation.
- * In theory it is CPI agnostic, but I haven't done a lot of testing with
- * different CPI values.
- * Oh, and the running averages are sensitive to how many samples per second
- * we're getting from the sensors, at the time it was being written it was
- * around 500.
+ * The speeds are in physical units and don't depend on the CPI or how many
+ * samples per second we're getting from the sensors, so the thresholds
+ * don't need re-tuning when those change.
+ * Returns true if the twist axes should scroll.
  */
-void handle_twist_to_scroll() {
-    if (fabs(running_avg_x) < 0.1 / 12 && fabs(running_avg_y) < 0.1 / 12) {
+bool handle_twist_to_scroll() {
+    int32_t w[3];
+    for (int i = 0; i < 3; i++) {
+        int64_t sum = 0;
+        for (int k = 0; k < NSENSORS * 2; k++) {
+            // most of it is zeros
+            if (twist_solver[i][k] != 0) {
+                sum += (int64_t) twist_solver[i][k] * running_avg[k];
+            }
+        }
+        sum >>= 16;
+        w[i] = sum > INT32_MAX ? INT32_MAX : sum < -INT32_MAX ? -INT32_MAX : sum;
+    }
+
+    if (abs(w[0]) < MM_PER_S(2.12) && abs(w[1]) < MM_PER_S(2.12)) {
         not_scroll_mode = false;
     }
 
-    if (fabs(running_avg_vscroll) < 0.1 / 16) {
+    if (abs(w[2]) < MM_PER_S(1.59)) {
         scroll_mode = false;
     }
 
-    if (!scroll_mode && (running_avg_x * running_avg_x + running_avg_y * running_avg_y > 4.0 / (12 * 12))) {
+    if (!scroll_mode &&
+        ((uint64_t) ((int64_t) w[0] * w[0]) + (uint64_t) ((int64_t) w[1] * w[1]) > MM_PER_S_SQUARED(42.33))) {
         not_scroll_mode = true;
     }
 
-    if (!not_scroll_mode && running_avg_vscroll * running_avg_vscroll > 4.0 / (16 * 16)) {
+    if (!not_scroll_mode && (int64_t) w[2] * w[2] > MM_PER_S_SQUARED(31.75)) {
         scroll_mode = true;
     }
 
-    if (!scroll_mode || not_scroll_mode) {
-        report.vwheel = 0;
+    return scroll_mode && !not_scroll_mode;
+}
+
+uint32_t configured_sample_interval_us() {
+    uint8_t rate = config.sample_rate;
+    if (rate < MIN_SAMPLE_RATE) {
+        rate = MIN_SAMPLE_RATE;
+    }
+    if (rate > MAX_SAMPLE_RATE) {
+        rate = MAX_SAMPLE_RATE;
+    }
+    return 1000000 / (rate * 100);
+}
+
+uint32_t sample_interval_us() {
+    if (usb_suspended.load(std::memory_order_relaxed)) {
+        return SUSPENDED_SAMPLE_INTERVAL_US;
+    }
+    uint32_t interval = configured_sample_interval_us();
+    return idle_sample_interval_us > interval ? idle_sample_interval_us : interval;
+}
+
+bool sample_on_motion() {
+    return sample_interval_us() > configured_sample_interval_us();
+}
+
+void histogram_add(uint32_t* histogram, uint32_t value, int shift) {
+    value >>= shift;
+    int bucket = 0;
+    while (value != 0 && bucket < STATS_HISTOGRAM_BUCKETS - 1) {
+        value >>= 1;
+        bucket++;
+    }
+    histogram[bucket]++;
+}
+
+uint32_t cycles_since(uint32_t start) {
+    return (hal_cycle_count() - start) & 0x00ffffff;
+}
+
+void stage_add(int stage, uint32_t cycles) {
+    stage_stats_t* s = &stage_stats[stage];
+    s->total_cycles += cycles;
+    s->count++;
+    if (cycles > s->max_cycles) {
+        s->max_cycles = cycles;
+    }
+    histogram_add(s->histogram, cycles, STATS_CYCLES_SHIFT);
+}
+
+// counts events and adds the count to the histogram once a second
+void per_second_add(per_second_t* p, uint64_t now, uint32_t events, int shift) {
+    if (p->start_us == 0) {
+        p->start_us = now;
+    }
+    while (now - p->start_us >= 1000000) {
+        histogram_add(p->histogram, p->count, shift);
+        p->count = 0;
+        p->start_us += 1000000;
+    }
+    p->count += events;
+}
+
+void reset_sensor_stats() {
+    for (int stage = 0; stage < STAGE_REPORT; stage++) {
+        memset(&stage_stats[stage], 0, sizeof(stage_stats[stage]));
+    }
+    memset(&sensor_stats, 0, sizeof(sensor_stats));
+}
+
+void reset_usb_stats() {
+    memset(&stage_stats[STAGE_REPORT], 0, sizeof(stage_stats[STAGE_REPORT]));
+    memset(&usb_stats, 0, sizeof(usb_stats));
+    usb_stats.reset_us = hal_time_us();
+    usb_stats.data_age_min_us = UINT32_MAX;
+    usb_stats.press_latency_min_us = UINT32_MAX;
+    usb_stats.wake_latency_min_us = UINT32_MAX;
+    usb_stats.bounces_at_reset = hal_button_bounces();
+}
+
+int32_t saturating_add(int32_t a, int32_t b, bool* saturated) {
+    int32_t sum;
+    if (__builtin_add_overflow(a, b, &sum)) {
+        *saturated = true;
+        return b > 0 ? INT32_MAX : INT32_MIN;
+    }
+    return sum;
+}
+
+// Adds motion from the next sample, returns false if some of it didn't fit.
+bool motion_add(motion_t* motion, const motion_t* next) {
+    bool saturated = false;
+    motion->buttons = next->buttons;
+    motion->dx = saturating_add(motion->dx, next->dx, &saturated);
+    motion->dy = saturating_add(motion->dy, next->dy, &saturated);
+    motion->vwheel = saturating_add(motion->vwheel, next->vwheel, &saturated);
+    motion->hwheel = saturating_add(motion->hwheel, next->hwheel, &saturated);
+    return !saturated;
+}
+
+// As much of the motion as fits in a report, the rest stays in value.
+int16_t take_int16(int32_t* value) {
+    int32_t taken = *value > INT16_MAX ? INT16_MAX : (*value < -INT16_MAX ? -INT16_MAX : *value);
+    *value -= taken;
+    return taken;
+}
+
+uint16_t clamp_u16(uint64_t value) {
+    return value > UINT16_MAX ? UINT16_MAX : value;
+}
+
+void get_stats_summary(stats_summary_t* summary) {
+    summary->time_ms = (hal_time_us() - usb_stats.reset_us) / 1000;
+    summary->samples = sensor_stats.samples;
+    summary->reports = usb_stats.reports;
+    summary->hid_busy = usb_stats.hid_busy;
+    summary->cpi_changes = sensor_stats.cpi_changes;
+    for (int stage = 0; stage < NSTAGES; stage++) {
+        uint32_t count = stage_stats[stage].count;
+        summary->stage_cycles_average[stage] = count > 0 ? stage_stats[stage].total_cycles / count : 0;
+        summary->stage_cycles_max[stage] = stage_stats[stage].max_cycles;
+    }
+    uint32_t count = usb_stats.data_age_count;
+    summary->data_age_average_us = clamp_u16(count > 0 ? usb_stats.data_age_total_us / count : 0);
+    summary->data_age_min_us = clamp_u16(count > 0 ? usb_stats.data_age_min_us : 0);
+    summary->data_age_max_us = clamp_u16(usb_stats.data_age_max_us);
+}
+
+uint16_t get_stats_report(uint8_t* buffer) {
+    memset(buffer, 0, STATS_REPORT_SIZE);
+    buffer[0] = stats_page;
+    buffer[1] = STATS_VERSION;
+    const uint32_t* histogram = nullptr;
+    uint8_t shift = 0;
+
+    if (stats_page == STATS_PAGE_SUMMARY) {
+        stats_summary_t summary;
+        get_stats_summary(&summary);
+        memcpy(buffer + 3, &summary, sizeof(summary));
+    } else if (stats_page < STATS_PAGE_STAGE_CYCLES + NSTAGES) {
+        histogram = stage_stats[stats_page - STATS_PAGE_STAGE_CYCLES].histogram;
+        shift = STATS_CYCLES_SHIFT;
+    } else if (stats_page == STATS_PAGE_SAMPLES_PER_SECOND) {
+        histogram = sensor_stats.samples_per_second.histogram;
+        shift = STATS_SAMPLES_PER_SECOND_SHIFT;
+    } else if (stats_page == STATS_PAGE_REPORTS_PER_SECOND) {
+        histogram = usb_stats.reports_per_second.histogram;
+        shift = STATS_PER_SECOND_SHIFT;
+    } else if (stats_page == STATS_PAGE_HID_BUSY_PER_SECOND) {
+        histogram = usb_stats.hid_busy_per_second.histogram;
+        shift = STATS_PER_SECOND_SHIFT;
+    } else if (stats_page == STATS_PAGE_CPI_CHANGES_PER_SECOND) {
+        histogram = sensor_stats.cpi_changes_per_second.histogram;
+        shift = STATS_PER_SECOND_SHIFT;
+    } else if (stats_page == STATS_PAGE_DATA_AGE) {
+        histogram = usb_stats.data_age_histogram;
+        shift = STATS_DATA_AGE_SHIFT;
+    } else if (stats_page == STATS_PAGE_MOTION) {
+        stats_motion_t motion;
+        motion.sensor_overflows = sensor_stats.sensor_overflows;
+        motion.saturated_samples = sensor_stats.saturated_samples;
+        motion.carried_reports = usb_stats.carried_reports;
+        motion.carried_max = usb_stats.carried_max;
+        motion.suppressed_reports = usb_stats.suppressed_reports;
+        memcpy(buffer + 3, &motion, sizeof(motion));
+    } else if (stats_page == STATS_PAGE_BUTTONS) {
+        stats_buttons_t buttons;
+        buttons.presses = usb_stats.presses;
+        buttons.bounces = hal_button_bounces() - usb_stats.bounces_at_reset;
+        buttons.press_latency_average_us =
+            usb_stats.presses > 0 ? usb_stats.press_latency_total_us / usb_stats.presses : 0;
+        buttons.press_latency_min_us = usb_stats.presses > 0 ? usb_stats.press_latency_min_us : 0;
+        buttons.press_latency_max_us = usb_stats.press_latency_max_us;
+        memcpy(buffer + 3, &buttons, sizeof(buttons));
+    } else if (stats_page == STATS_PAGE_PRESS_LATENCY) {
+        histogram = usb_stats.press_latency_histogram;
+        shift = STATS_PRESS_LATENCY_SHIFT;
+    } else if (stats_page == STATS_PAGE_POWER) {
+        stats_power_t power;
+        for (int state = 0; state < NPOWER_STATES; state++) {
+            power.state_ms[state] = sensor_stats.power_state_us[state] / 1000;
+            power.wakeups[state] = sensor_stats.wakeups[state];
+        }
+        power.remote_wakeups = usb_stats.remote_wakeups;
+        uint32_t count = usb_stats.wake_count;
+        power.wake_latency_average_us = count > 0 ? usb_stats.wake_latency_total_us / count : 0;
+        power.wake_latency_min_us = count > 0 ? usb_stats.wake_latency_min_us : 0;
+        power.wake_latency_max_us = usb_stats.wake_latency_max_us;
+        memcpy(buffer + 3, &power, sizeof(power));
+    } else if (stats_page == STATS_PAGE_WAKE_LATENCY) {
+        histogram = usb_stats.wake_latency_histogram;
+        shift = STATS_WAKE_LATENCY_SHIFT;
+    }
+
+    if (histogram != nullptr) {
+        buffer[2] = shift;
+        memcpy(buffer + 3, histogram, STATS_HISTOGRAM_BUCKETS * sizeof(uint32_t));
+    }
+    return STATS_REPORT_SIZE;
+}
+
+void set_stats_report(const uint8_t* buffer) {
+    if (buffer[0] < STATS_NPAGES) {
+        stats_page = buffer[0];
+    }
+}
+
+void record_trace(uint64_t now, uint32_t buttons, const sensor_reading_t readings[NSENSORS]) {
+    trace_record_t record;
+    record.time_us = now;
+    record.buttons = buttons;
+    for (int sensor = 0; sensor < NSENSORS; sensor++) {
+        record.movement[sensor][0] = readings[sensor].movement[0];
+        record.movement[sensor][1] = readings[sensor].movement[1];
+    }
+    if (!trace_queue.push(record)) {
+        trace_dropped.store(trace_dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+}
+
+// nearest CPI the sensor can actually do
+uint16_t sensor_cpi_for(uint16_t cpi) {
+    uint32_t rounded = (cpi + SENSOR_CPI_STEP / 2) / SENSOR_CPI_STEP * SENSOR_CPI_STEP;
+    if (rounded < SENSOR_CPI_STEP) {
+        return SENSOR_CPI_STEP;
+    }
+    if (rounded > SENSOR_MAX_CPI) {
+        return SENSOR_MAX_CPI;
+    }
+    return rounded;
+}
+
+// motion at output_cpi, the fraction of a count that doesn't come out yet is
+// kept for the next sample
+int16_t scale_movement(int sensor, int axis, int16_t movement) {
+    int32_t total = (int32_t) movement * output_cpi[sensor] + cpi_remainder[sensor][axis];
+    int32_t scaled = total / current_cpi[sensor];
+    cpi_remainder[sensor][axis] = total - scaled * current_cpi[sensor];
+    return scaled;
+}
+
+void compile_routes() {
+    shift_buttons = 0;
+    for (int i = 0; i < NBUTTONS; i++) {
+        if (config.button_function[i] == ButtonFunction::SHIFT) {
+            shift_buttons |= 1 << i;
+        }
+    }
+
+    for (int shifted = 0; shifted < 2; shifted++) {
+        routes_t* r = &routes[shifted];
         for (int sensor = 0; sensor < NSENSORS; sensor++) {
             for (int axis = 0; axis < 2; axis++) {
-                // ignoring the shifted function for now...
-                if (config.sensor_function[sensor][axis] == SensorFunction::VERTICAL_SCROLL ||
-                    config.sensor_function[sensor][axis] == SensorFunction::VERTICAL_SCROLL_INVERTED) {
-                    accumulated_scroll[sensor][axis] = 0;
+                SensorFunction sensor_function =
+                    shifted ? config.sensor_shifted_function[sensor][axis] : config.sensor_function[sensor][axis];
+                axis_route_t* route = &r->axis[sensor][axis];
+                route->sign = static_cast<int>(sensor_function) < 0 ? -1 : 1;
+                route->multiplier_mask = 0;
+                switch (sensor_function) {
+                    case SensorFunction::CURSOR_X:
+                    case SensorFunction::CURSOR_X_INVERTED:
+                        route->field = FIELD_DX;
+                        break;
+                    case SensorFunction::CURSOR_Y:
+                    case SensorFunction::CURSOR_Y_INVERTED:
+                        route->field = FIELD_DY;
+                        break;
+                    case SensorFunction::VERTICAL_SCROLL:
+                    case SensorFunction::VERTICAL_SCROLL_INVERTED:
+                        route->field = FIELD_VWHEEL;
+                        route->multiplier_mask = 1 << 0;
+                        break;
+                    case SensorFunction::HORIZONTAL_SCROLL:
+                    case SensorFunction::HORIZONTAL_SCROLL_INVERTED:
+                        route->field = FIELD_HWHEEL;
+                        route->multiplier_mask = 1 << 2;
+                        break;
+                    default:
+                        route->field = FIELD_NONE;
+                        break;
                 }
             }
+            uint16_t cpi = shifted ? config.sensor_shifted_cpi[sensor] : config.sensor_cpi[sensor];
+            if (config.native_cpi != 0) {
+                r->sensor_cpi[sensor] = sensor_cpi_for(config.native_cpi);
+                // scaling up would only make up counts the sensor never saw
+                r->output_cpi[sensor] = cpi < 1 ? 1 : cpi > r->sensor_cpi[sensor] ? r->sensor_cpi[sensor] : cpi;
+            } else {
+                r->sensor_cpi[sensor] = sensor_cpi_for(cpi);
+                r->output_cpi[sensor] = r->sensor_cpi[sensor];
+            }
+        }
+
+        r->click_drag_buttons = 0;
+        for (int i = 0; i < NBUTTONS; i++) {
+            ButtonFunction button_function =
+                shifted ? config.button_shifted_function[i] : config.button_function[i];
+            if (shift_buttons & (1 << i)) {
+                button_function = ButtonFunction::NO_FUNCTION;
+            }
+            r->button_mask[i] = 0;
+            if (button_function >= ButtonFunction::BUTTON1 && button_function <= ButtonFunction::BUTTON8) {
+                r->button_mask[i] = 1 << (static_cast<int>(button_function) - 1);
+            } else if (button_function == ButtonFunction::CLICK_DRAG) {
+                r->click_drag_buttons |= 1 << i;
+            }
         }
     }
 }
 
-void hid_task() {
-    if (!tud_hid_ready()) {
+uint32_t clamp_u32(uint32_t value, uint32_t min, uint32_t max) {
+    return value < min ? min : value > max ? max : value;
+}
+
+// the nearest the sensors can do to the config's rest modes
+void compile_rest() {
+    // the config is packed, these aren't aligned
+    uint32_t after[3];
+    uint32_t period_ms[3];
+    for (int i = 0; i < 3; i++) {
+        after[i] = config.rest_after[i];
+        period_ms[i] = config.rest_period_ms[i] < 1 ? 1 : config.rest_period_ms[i];
+    }
+    // time spent in run, rest 1 and rest 2, in ms
+    uint32_t run_ms = after[0] * 100;
+    uint32_t rest1_ms = after[1] > after[0] ? (after[1] - after[0]) * 100 : 0;
+    uint32_t rest2_ms = after[2] > after[1] ? (after[2] - after[1]) * 100 : 0;
+
+    config_rest.enabled = after[0] != 0;
+    config_rest.run_downshift = clamp_u32((run_ms + 5) / 10, 1, 255);
+    config_rest.rest1_rate = period_ms[0] - 1;
+    config_rest.rest1_downshift = clamp_u32((rest1_ms + 160 * period_ms[0]) / (320 * period_ms[0]), 1, 255);
+    config_rest.rest2_rate = period_ms[1] - 1;
+    config_rest.rest2_downshift = clamp_u32((rest2_ms + 16 * period_ms[1]) / (32 * period_ms[1]), 1, 255);
+    config_rest.rest3_rate = period_ms[2] - 1;
+}
+
+void compile_idle() {
+    idle_after_us = config.idle_after_ms * 1000ull;
+    max_idle_interval_us = clamp_u32(config.idle_interval_ms, 1, MAX_IDLE_INTERVAL_MS) * 1000;
+}
+
+// Backs off while nothing happens, a held button keeps the full rate so
+// that its release isn't noticed late.
+void update_idle_interval(uint64_t now, bool moved, uint32_t buttons) {
+    if (moved || buttons != 0 || idle_after_us == 0) {
+        last_active_us = now;
+        idle_sample_interval_us = 0;
         return;
     }
+    if (now - last_active_us < idle_after_us) {
+        return;
+    }
+    uint32_t configured = configured_sample_interval_us();
+    uint32_t interval = (idle_sample_interval_us > configured ? idle_sample_interval_us : configured) * 2;
+    idle_sample_interval_us = interval < max_idle_interval_us ? interval : max_idle_interval_us;
+}
 
-    memset(&report, 0, sizeof(report));
+bool same_rest(const sensor_rest_t* a, const sensor_rest_t* b) {
+    return a->enabled == b->enabled && a->run_downshift == b->run_downshift && a->rest1_rate == b->rest1_rate &&
+           a->rest1_downshift == b->rest1_downshift && a->rest2_rate == b->rest2_rate &&
+           a->rest2_downshift == b->rest2_downshift && a->rest3_rate == b->rest3_rate;
+}
+
+// when the sensors go into each rest mode, counted from the last motion
+void set_rest_after(const sensor_rest_t* rest) {
+    rest_after_us[0] = rest->run_downshift * 10000ull;
+    rest_after_us[1] = rest_after_us[0] + rest->rest1_downshift * 320ull * (rest->rest1_rate + 1) * 1000;
+    rest_after_us[2] = rest_after_us[1] + rest->rest2_downshift * 32ull * (rest->rest2_rate + 1) * 1000;
+}
+
+uint8_t power_state(uint64_t now, bool suspended) {
+    if (suspended) {
+        return POWER_SUSPENDED;
+    }
+    uint8_t state = POWER_RUN;
+    if (current_rest[0].enabled) {
+        for (int i = 0; i < 3; i++) {
+            if (now - last_motion_us >= rest_after_us[i]) {
+                state = POWER_REST1 + i;
+            }
+        }
+    }
+    return state;
+}
 
-    uint32_t pin_state = gpio_get_all();
+void sensor_task() {
+    if (stats_reset_requested.load(std::memory_order_acquire)) {
+        reset_sensor_stats();
+        stats_reset_requested.store(false, std::memory_order_release);
+    }
 
-    bool shifted = false;
+    memset(&sample, 0, sizeof(sample));
+
+    // everything in this sample happens at the same time, which makes it replayable
+    uint64_t now = hal_time_us();
+    uint32_t buttons = hal_buttons_get();
+    bool press = (buttons & ~prev_buttons) != 0;
+    uint32_t cpi_changes = 0;
+    uint32_t mapping_start = hal_cycle_count();
+
+    uint32_t generation = config_generation.load(std::memory_order_acquire);
+    if (generation != routes_generation) {
+        compile_routes();
+        compile_rest();
+        compile_idle();
+        compile_twist();
+        routes_generation = generation;
+    }
 
-    // first pass to determine if we're in shifted state
-    for (int i = 0; i < NBUTTONS; i++) {
-        if (config.button_function[i] == ButtonFunction::SHIFT &&
-            !(pin_state & (1 << button_pins[i]))) {
-            shifted = true;
+    // only when the settings or the suspend state change
+    bool suspended = usb_suspended.load(std::memory_order_relaxed);
+    const sensor_rest_t* rest = (suspended && !config_rest.enabled) ? &default_rest : &config_rest;
+    for (int i = 0; i < NSENSORS; i++) {
+        if (!same_rest(&current_rest[i], rest)) {
+            hal_sensor_set_rest(i, rest);
+            current_rest[i] = *rest;
+            set_rest_after(rest);
         }
     }
 
-    // set CPI if not already correct
+    const routes_t* r = &routes[(buttons & shift_buttons) ? 1 : 0];
+
+    // set CPI if not already correct, with a native CPI this only happens
+    // when it's changed
     for (int i = 0; i < NSENSORS; i++) {
-        uint8_t wanted_cpi = shifted ? config.sensor_shifted_cpi[i] : config.sensor_cpi[i];
-        if (current_cpi[i] != wanted_cpi && wanted_cpi >= 1 && wanted_cpi <= 120) {
-            sensors[i].set_cpi(wanted_cpi * 100);
-            current_cpi[i] = wanted_cpi;
+        if (current_cpi[i] != r->sensor_cpi[i]) {
+            hal_sensor_set_cpi(i, r->sensor_cpi[i]);
+            current_cpi[i] = r->sensor_cpi[i];
+            memset(cpi_remainder[i], 0, sizeof(cpi_remainder[i]));
+            set_avg_scale(i, current_cpi[i]);
+            cpi_changes++;
         }
+        output_cpi[i] = r->output_cpi[i];
     }
 
     for (int i = 0; i < NBUTTONS; i++) {
-        ButtonFunction button_function =
-            shifted ? config.button_shifted_function[i] : config.button_function[i];
-        if (config.button_function[i] == ButtonFunction::SHIFT) {
-            button_function = ButtonFunction::NO_FUNCTION;
-        }
-        switch (button_function) {
-            case ButtonFunction::NO_FUNCTION:
-            case ButtonFunction::SHIFT:
-                break;
-            case ButtonFunction::BUTTON1:
-            case ButtonFunction::BUTTON2:
-            case ButtonFunction::BUTTON3:
-            case ButtonFunction::BUTTON4:
-            case ButtonFunction::BUTTON5:
-            case ButtonFunction::BUTTON6:
-            case ButtonFunction::BUTTON7:
-            case ButtonFunction::BUTTON8: {
-                int button = static_cast<int>(button_function) - 1;
-                if (!(pin_state & (1 << button_pins[i]))) {
-                    report.buttons |= 1 << button;
-                }
-                break;
-            }
-            case ButtonFunction::CLICK_DRAG:
-                if ((prev_pin_state & (1 << button_pins[i])) &&
-                    !(pin_state & (1 << button_pins[i]))) {
-                    click_drag = !click_drag;
-                }
-                break;
+        if (buttons & (1 << i)) {
+            sample.buttons |= r->button_mask[i];
         }
     }
 
+    // every click-drag button that was just pressed toggles it
+    if (__builtin_popcount(buttons & ~prev_buttons & r->click_drag_buttons) & 1) {
+        click_drag = !click_drag;
+    }
+
     if (click_drag) {
-        report.buttons |= 1 << 0;
+        sample.buttons |= 1 << 0;
     }
 
-    prev_pin_state = pin_state;
+    prev_buttons = buttons;
+
+    uint32_t mapping_cycles = cycles_since(mapping_start);
+    uint32_t twist_start = hal_cycle_count();
+    running_avg_update(now);
+    uint32_t twist_cycles = cycles_since(twist_start);
 
-    running_avg_x *= 0.9;
-    running_avg_y *= 0.9;
-    running_avg_vscroll *= 0.9;
-    running_avg_hscroll *= 0.9;
+    sensor_reading_t readings[NSENSORS];
+    uint32_t read_start = hal_cycle_count();
+    hal_sensors_read(readings);
+    stage_add(STAGE_SENSOR_READ, cycles_since(read_start));
 
+    if (trace_recording.load(std::memory_order_relaxed)) {
+        record_trace(now, buttons, readings);
+    }
+
+    // the state the sample was taken in, before any motion in it
+    uint8_t state = power_state(now, suspended);
+    sensor_stats.power_state_us[prev_power_state] += now - power_state_updated_us;
+    power_state_updated_us = now;
+    bool moved = false;
+    for (int sensor = 0; sensor < NSENSORS; sensor++) {
+        moved |= readings[sensor].motion || readings[sensor].movement[0] != 0 || readings[sensor].movement[1] != 0;
+    }
+    bool wake = false;
+    if (state == POWER_SUSPENDED) {
+        if ((moved || press) && !suspend_woken) {
+            suspend_woken = true;
+            wake = true;
+            remote_wakeup_requested.store(true, std::memory_order_release);
+        }
+    } else {
+        suspend_woken = false;
+        wake = moved && state != POWER_RUN;
+    }
+    if (wake) {
+        sensor_stats.wakeups[state]++;
+    }
+    if (moved) {
+        last_motion_us = now;
+    }
+    prev_power_state = power_state(now, suspended);
+    update_idle_interval(now, moved, buttons);
+
+    twist_start = hal_cycle_count();
     for (int sensor = 0; sensor < NSENSORS; sensor++) {
-        sensors[sensor].update();
         for (int axis = 0; axis < 2; axis++) {
-            int16_t movement = sensors[sensor].movement[axis];
-            SensorFunction sensor_function =
-                shifted ? config.sensor_shifted_function[sensor][axis] : config.sensor_function[sensor][axis];
-            if (static_cast<int>(sensor_function) < 0) {
-                movement *= -1;
+            int16_t* movement = &readings[sensor].movement[axis];
+            // the sensor's registers stop there, so it probably saw more
+            if (*movement == INT16_MAX || *movement == INT16_MIN) {
+                sensor_stats.sensor_overflows++;
+                *movement = *movement == INT16_MIN ? -INT16_MAX : *movement;
             }
-            switch (sensor_function) {
-                case SensorFunction::NO_FUNCTION:
-                    break;
-                case SensorFunction::CURSOR_X:
-                case SensorFunction::CURSOR_X_INVERTED:
-                    report.dx += movement;
-                    running_avg_x += 0.1 * movement / current_cpi[sensor];
-                    break;
-                case SensorFunction::CURSOR_Y:
-                case SensorFunction::CURSOR_Y_INVERTED:
-                    report.dy += movement;
-                    running_avg_y += 0.1 * movement / current_cpi[sensor];
-                    break;
-                case SensorFunction::VERTICAL_SCROLL:
-                case SensorFunction::VERTICAL_SCROLL_INVERTED:
-                    report.vwheel += handle_scroll(sensor, axis, movement, 1 << 0, &running_avg_vscroll);
-                    break;
-                case SensorFunction::HORIZONTAL_SCROLL:
-                case SensorFunction::HORIZONTAL_SCROLL_INVERTED:
-                    report.hwheel += handle_scroll(sensor, axis, movement, 1 << 2, &running_avg_hscroll);
-                    break;
+            running_avg_add(&running_avg[sensor * 2 + axis], *movement, sensor);
+        }
+    }
+    bool twist_scrolling = handle_twist_to_scroll();
+    twist_cycles += cycles_since(twist_start);
+
+    mapping_start = hal_cycle_count();
+    for (int sensor = 0; sensor < NSENSORS; sensor++) {
+        for (int axis = 0; axis < 2; axis++) {
+            int16_t movement = readings[sensor].movement[axis];
+            const axis_route_t* route = &r->axis[sensor][axis];
+            if (route->field == FIELD_NONE) {
+                continue;
+            }
+            if (output_cpi[sensor] != current_cpi[sensor]) {
+                movement = scale_movement(sensor, axis, movement);
+            }
+            movement *= route->sign;
+            int32_t* field = motion_fields[route->field];
+            if (route->multiplier_mask == 0) {
+                *field += movement;
+            } else if (!twist_scrolling && (twist_axes & (1 << (sensor * 2 + axis)))) {
+                accumulated_scroll[sensor][axis] = 0;
+            } else {
+                *field += handle_scroll(sensor, axis, movement, route->multiplier_mask, now);
             }
         }
     }
 
     // uncomment to have pressing all buttons reset into BOOTSEL
     // (convenient during development)
-    // if (!(pin_state & (1 << button_pins[0]) ||
-    //       pin_state & (1 << button_pins[1]) ||
-    //       pin_state & (1 << button_pins[2]) ||
-    //       pin_state & (1 << button_pins[3]))) {
-    //     reset_usb_boot(0, 0);
+    // if (buttons == (1 << NBUTTONS) - 1) {
+    //     hal_reset_into_bootloader();
     // }
 
-    handle_twist_to_scroll();
+    mapping_cycles += cycles_since(mapping_start);
+
+    stage_add(STAGE_MAPPING, mapping_cycles);
+    stage_add(STAGE_TWIST, twist_cycles);
+    sensor_stats.samples++;
+    sensor_stats.cpi_changes += cpi_changes;
+    per_second_add(&sensor_stats.samples_per_second, now, 1, STATS_SAMPLES_PER_SECOND_SHIFT);
+    per_second_add(&sensor_stats.cpi_changes_per_second, now, cpi_changes, STATS_PER_SECOND_SHIFT);
 
-    tud_hid_report(1, &report, sizeof(report));
+    if (!motion_add(&pending_sample.motion, &sample)) {
+        sensor_stats.saturated_samples++;
+    }
+    pending_sample.time_us = now;
+    if (press && !pending_sample.press) {
+        pending_sample.press = true;
+        pending_sample.press_us = hal_buttons_press_us();
+    }
+    if (wake && !pending_sample.wake) {
+        pending_sample.wake = true;
+        pending_sample.wake_us = (press && !moved) ? hal_buttons_press_us() : now;
+    }
+
+    if (sample_queue.push(pending_sample)) {
+        memset(&pending_sample, 0, sizeof(pending_sample));
+    }
 }
 
-void pin_init(uint pin) {
-    gpio_init(pin);
-    gpio_set_dir(pin, GPIO_IN);
-    gpio_pull_up(pin);
+void add_press_latency(uint32_t latency) {
+    usb_stats.presses++;
+    usb_stats.press_latency_total_us += latency;
+    if (latency < usb_stats.press_latency_min_us) {
+        usb_stats.press_latency_min_us = latency;
+    }
+    if (latency > usb_stats.press_latency_max_us) {
+        usb_stats.press_latency_max_us = latency;
+    }
+    histogram_add(usb_stats.press_latency_histogram, latency, STATS_PRESS_LATENCY_SHIFT);
 }
 
-void pins_init() {
-    for (int i = 0; i < NBUTTONS; i++) {
-        pin_init(button_pins[i]);
+void add_wake_latency(uint32_t latency) {
+    usb_stats.wake_count++;
+    usb_stats.wake_latency_total_us += latency;
+    if (latency < usb_stats.wake_latency_min_us) {
+        usb_stats.wake_latency_min_us = latency;
     }
+    if (latency > usb_stats.wake_latency_max_us) {
+        usb_stats.wake_latency_max_us = latency;
+    }
+    histogram_add(usb_stats.wake_latency_histogram, latency, STATS_WAKE_LATENCY_SHIFT);
 }
 
-void sensors_init() {
-    for (int i = 0; i < NSENSORS; i++) {
-        sensors[i].init();
+// While suspended the host isn't listening. Motion would only make the
+// cursor jump once it's back, so it's dropped, and the first motion or
+// press wakes the host up if it allows that.
+void suspended_task() {
+    memset(&report_motion, 0, sizeof(report_motion));
+    report_press = false;
+    if (!remote_wakeup_allowed) {
+        report_wake = false;
+        return;
+    }
+    if (remote_wakeup_requested.load(std::memory_order_acquire) && !remote_wakeup_sent) {
+        hal_usb_remote_wakeup();
+        remote_wakeup_sent = true;
+        usb_stats.remote_wakeups++;
+    }
+}
+
+void hid_task() {
+    queued_sample_t queued;
+    while (sample_queue.pop(queued)) {
+        got_first_sample = true;
+        // core 1 counts saturation, this can only add to what it already saw
+        motion_add(&report_motion, &queued.motion);
+        report_sample_us = queued.time_us;
+        if (queued.press && !report_press) {
+            report_press = true;
+            report_press_us = queued.press_us;
+        }
+        if (queued.wake && !report_wake) {
+            report_wake = true;
+            report_wake_us = queued.wake_us;
+        }
+    }
+
+    uint64_t now = hal_time_us();
+    per_second_add(&usb_stats.reports_per_second, now, 0, STATS_PER_SECOND_SHIFT);
+    per_second_add(&usb_stats.hid_busy_per_second, now, 0, STATS_PER_SECOND_SHIFT);
+
+    if (usb_suspended.load(std::memory_order_relaxed)) {
+        suspended_task();
+        return;
+    }
+
+    // the host only needs to hear about changes, button changes right away
+    bool buttons_changed = report_motion.buttons != report.buttons;
+    // a wakeup is timed by its report, even if it changes nothing in it
+    bool changed = buttons_changed || report_motion.dx != 0 || report_motion.dy != 0 || report_motion.vwheel != 0 ||
+                   report_motion.hwheel != 0 || report_wake;
+    if (!hal_hid_ready(report_press || buttons_changed)) {
+        // counted once per report
+        if (report_in_flight && now - report_sent_us > HID_BUSY_US) {
+            usb_stats.hid_busy++;
+            usb_stats.hid_busy_per_second.count++;
+            report_in_flight = false;
+        }
+        return;
+    }
+
+    if (!changed) {
+        // a press that didn't change the buttons (shift) has no report to time
+        report_press = false;
+        if (now - report_slot_us >= SUPPRESSED_REPORT_SPACING_US) {
+            usb_stats.suppressed_reports++;
+            report_slot_us = now;
+        }
+        return;
+    }
+
+    report.buttons = report_motion.buttons;
+    report.dx = take_int16(&report_motion.dx);
+    report.dy = take_int16(&report_motion.dy);
+    report.vwheel = take_int16(&report_motion.vwheel);
+    report.hwheel = take_int16(&report_motion.hwheel);
+    uint64_t carried = (uint64_t) abs(report_motion.dx) + abs(report_motion.dy) + abs(report_motion.vwheel) +
+                       abs(report_motion.hwheel);
+    if (carried > 0) {
+        usb_stats.carried_reports++;
+        if (carried > usb_stats.carried_max) {
+            usb_stats.carried_max = carried > UINT32_MAX ? UINT32_MAX : carried;
+        }
+    }
+
+    sent_sample_us = report_sample_us;
+    report_sent_us = now;
+    report_slot_us = now;
+    report_in_flight = true;
+    uint32_t report_start = hal_cycle_count();
+    hal_hid_report(1, &report, sizeof(report));
+    stage_add(STAGE_REPORT, cycles_since(report_start));
+    usb_stats.reports++;
+    usb_stats.reports_per_second.count++;
+    if (report_press) {
+        report_press = false;
+        add_press_latency((uint32_t) now - report_press_us);
+    }
+    if (report_wake) {
+        report_wake = false;
+        add_wake_latency((uint32_t) now - report_wake_us);
+    }
+}
+
+// The report is on its way to the host, so this is how old its data was when
+// it went out (give or take how long it took the USB stack to tell us).
+void handle_report_complete(uint8_t report_id) {
+    if (report_id != 1) {
+        return;
+    }
+    report_in_flight = false;
+    if (!got_first_sample) {
+        return;
+    }
+    uint32_t age = (uint32_t) hal_time_us() - sent_sample_us;
+    if (age < usb_stats.data_age_min_us) {
+        usb_stats.data_age_min_us = age;
+    }
+    if (age > usb_stats.data_age_max_us) {
+        usb_stats.data_age_max_us = age;
+    }
+    usb_stats.data_age_total_us += age;
+    usb_stats.data_age_count++;
+    histogram_add(usb_stats.data_age_histogram, age, STATS_DATA_AGE_SHIFT);
+}
+
+void reset_state() {
+    queued_sample_t queued;
+    while (sample_queue.pop(queued)) {
+    }
+    memset(&sample, 0, sizeof(sample));
+    memset(&pending_sample, 0, sizeof(pending_sample));
+    memset(&report_motion, 0, sizeof(report_motion));
+    memset(&report, 0, sizeof(report));
+    routes_generation = 0;  // the config may have been changed directly
+    report_sample_us = 0;
+    sent_sample_us = 0;
+    report_sent_us = 0;
+    report_slot_us = 0;
+    report_in_flight = false;
+    report_press = false;
+    report_wake = false;
+    usb_suspended.store(false, std::memory_order_relaxed);
+    remote_wakeup_allowed = false;
+    remote_wakeup_sent = false;
+    remote_wakeup_requested.store(false, std::memory_order_relaxed);
+    memset(current_rest, 0, sizeof(current_rest));
+    last_motion_us = 0;
+    power_state_updated_us = 0;
+    prev_power_state = POWER_RUN;
+    suspend_woken = false;
+    idle_sample_interval_us = 0;
+    last_active_us = 0;
+    reset_sensor_stats();
+    reset_usb_stats();
+    stats_reset_requested.store(false, std::memory_order_relaxed);
+    stats_page = STATS_PAGE_SUMMARY;
+    stream_mask = 0;
+    stream_stats_sent_us = 0;
+    stream_dropped_start = 0;
+    frame_sensor = FRAME_NO_SENSOR;
+    frame = nullptr;
+    frame_number = 0;
+    frame_offset = 0;
+    got_first_sample = false;
+    resolution_multiplier = 0;
+    memset(accumulated_scroll, 0, sizeof(accumulated_scroll));
+    memset(last_scroll_timestamp, 0, sizeof(last_scroll_timestamp));
+    prev_buttons = 0;
+    click_drag = false;
+    memset(current_cpi, 0, sizeof(current_cpi));
+    memset(output_cpi, 0, sizeof(output_cpi));
+    memset(cpi_remainder, 0, sizeof(cpi_remainder));
+    memset(avg_scale, 0, sizeof(avg_scale));
+    memset(avg_gain, 0, sizeof(avg_gain));
+    avg_decay = 0;
+    avg_rate = 0;
+    avg_dt_us = 0;
+    avg_last_update_us = 0;
+    scroll_mode = false;
+    not_scroll_mode = false;
+    memset(running_avg, 0, sizeof(running_avg));
+}
+
+uint16_t get_trace_report(uint8_t* buffer) {
+    memset(buffer, 0, TRACE_REPORT_SIZE);
+    uint8_t count = 0;
+    trace_record_t record;
+    while (count < TRACE_RECORDS_PER_REPORT && trace_queue.pop(record)) {
+        memcpy(buffer + 2 + count * sizeof(record), &record, sizeof(record));
+        count++;
+    }
+    buffer[0] = count;
+    if (trace_recording.load(std::memory_order_relaxed)) {
+        buffer[1] |= TRACE_FLAG_RECORDING;
+    }
+    uint32_t dropped = trace_dropped.load(std::memory_order_relaxed);
+    if (dropped != trace_dropped_reported) {
+        buffer[1] |= TRACE_FLAG_DROPPED;
+        trace_dropped_reported = dropped;
+    }
+    return TRACE_REPORT_SIZE;
+}
+
+void start_trace() {
+    trace_record_t record;
+    while (trace_queue.pop(record)) {
+    }
+    trace_dropped_reported = trace_dropped.load(std::memory_order_relaxed);
+    trace_recording.store(true, std::memory_order_relaxed);
+}
+
+void set_trace_report(const uint8_t* buffer) {
+    if (buffer[0] == TRACE_START) {
+        start_trace();
+    } else if (buffer[0] == TRACE_STOP) {
+        trace_recording.store(false, std::memory_order_relaxed);
+    }
+}
+
+void start_frames(int sensor) {
+    if (frame != nullptr) {
+        hal_frame_release();
+    }
+    frame = nullptr;
+    frame_sensor = sensor;
+    frame_number = 0;
+    frame_offset = 0;
+    hal_frame_capture(sensor);
+}
+
+void stop_frames() {
+    if (frame_sensor != FRAME_NO_SENSOR) {
+        start_frames(FRAME_NO_SENSOR);
+    }
+}
+
+// Copies up to len bytes of the current frame, returns how many, zero if
+// there isn't a frame yet. offset is where they are in the frame. The frame
+// number to go with them is the frame_number from before the call.
+uint16_t next_frame_chunk(uint8_t* buffer, uint16_t len, uint16_t* offset) {
+    if (frame == nullptr) {
+        frame = hal_frame_get();
+        if (frame == nullptr) {
+            return 0;
+        }
+        frame_offset = 0;
+    }
+    if (len > FRAME_SIZE - frame_offset) {
+        len = FRAME_SIZE - frame_offset;
+    }
+    memcpy(buffer, frame + frame_offset, len);
+    *offset = frame_offset;
+    frame_offset += len;
+    if (frame_offset == FRAME_SIZE) {
+        hal_frame_release();
+        frame = nullptr;
+        frame_number++;
+    }
+    return len;
+}
+
+uint16_t get_frame_report(uint8_t* buffer) {
+    memset(buffer, 0, FRAME_REPORT_SIZE);
+    buffer[0] = frame_number;
+    buffer[1] = FRAME_NO_CHUNK;
+    buffer[2] = frame_sensor;
+    uint16_t offset;
+    if (frame_sensor != FRAME_NO_SENSOR && next_frame_chunk(buffer + 4, FRAME_CHUNK_SIZE, &offset) > 0) {
+        buffer[1] = offset / FRAME_CHUNK_SIZE;
+    }
+    return FRAME_REPORT_SIZE;
+}
+
+void set_frame_report(const uint8_t* buffer) {
+    if (buffer[0] == FRAME_START && buffer[1] < NSENSORS) {
+        start_frames(buffer[1]);
+    } else if (buffer[0] == FRAME_STOP) {
+        stop_frames();
+    }
+}
+
+void handle_stream_commands() {
+    uint8_t commands[64];
+    uint32_t len = hal_stream_read(commands, sizeof(commands));
+    for (uint32_t i = 0; i + 1 < len; i += 2) {
+        uint8_t mask = commands[i + 1];
+        if (commands[i] == STREAM_COMMAND_START) {
+            if ((mask & STREAM_TRACE) && !(stream_mask & STREAM_TRACE)) {
+                start_trace();
+                stream_dropped_start = trace_dropped.load(std::memory_order_relaxed);
+            }
+            for (int sensor = 0; sensor < NSENSORS; sensor++) {
+                if (mask & STREAM_FRAMES(sensor)) {
+                    start_frames(sensor);
+                    // only one sensor at a time
+                    mask = (mask & (STREAM_TRACE | STREAM_STATS)) | STREAM_FRAMES(sensor);
+                    stream_mask &= STREAM_TRACE | STREAM_STATS;
+                    break;
+                }
+            }
+            stream_mask |= mask;
+        } else if (commands[i] == STREAM_COMMAND_STOP) {
+            if (mask & stream_mask & STREAM_TRACE) {
+                trace_recording.store(false, std::memory_order_relaxed);
+            }
+            if (frame_sensor != FRAME_NO_SENSOR && (mask & stream_mask & STREAM_FRAMES(frame_sensor))) {
+                stop_frames();
+            }
+            stream_mask &= ~mask;
+        }
+    }
+}
+
+// Writes the packet in stream_buffer if all of it fits, otherwise nothing.
+bool stream_packet(uint8_t type, uint16_t length) {
+    stream_packet_header_t header = { .sync = STREAM_SYNC, .type = type, .length = length };
+    memcpy(stream_buffer, &header, sizeof(header));
+    if (hal_stream_available() < sizeof(header) + length) {
+        return false;
+    }
+    hal_stream_write(stream_buffer, sizeof(header) + length);
+    return true;
+}
+
+// At most one packet of each type per call, so that it never holds up
+// hid_task() for long.
+void stream_task() {
+    handle_stream_commands();
+    if (stream_mask == 0) {
+        return;
+    }
+
+    uint8_t* payload = stream_buffer + sizeof(stream_packet_header_t);
+
+    if (stream_mask & STREAM_TRACE) {
+        // only take as many records out of the queue as there's room for
+        uint32_t available = hal_stream_available();
+        uint32_t room = available > sizeof(stream_packet_header_t) + 4
+                            ? (available - sizeof(stream_packet_header_t) - 4) / sizeof(trace_record_t)
+                            : 0;
+        if (room > STREAM_MAX_TRACE_RECORDS) {
+            room = STREAM_MAX_TRACE_RECORDS;
+        }
+        uint32_t count = 0;
+        trace_record_t record;
+        while (count < room && trace_queue.pop(record)) {
+            memcpy(payload + 4 + count * sizeof(record), &record, sizeof(record));
+            count++;
+        }
+        if (count > 0) {
+            uint32_t dropped = trace_dropped.load(std::memory_order_relaxed) - stream_dropped_start;
+            memcpy(payload, &dropped, sizeof(dropped));
+            stream_packet(STREAM_TRACE, 4 + count * sizeof(record));
+        }
+    }
+
+    if (frame_sensor != FRAME_NO_SENSOR && (stream_mask & STREAM_FRAMES(frame_sensor)) &&
+        hal_stream_available() >= sizeof(stream_packet_header_t) + 4 + STREAM_FRAME_CHUNK_SIZE) {
+        uint8_t number = frame_number;
+        uint16_t offset;
+        uint16_t len = next_frame_chunk(payload + 4, STREAM_FRAME_CHUNK_SIZE, &offset);
+        if (len > 0) {
+            payload[0] = frame_sensor;
+            payload[1] = number;
+            memcpy(payload + 2, &offset, sizeof(offset));
+            stream_packet(STREAM_FRAMES(frame_sensor), 4 + len);
+        }
+    }
+
+    if (stream_mask & STREAM_STATS) {
+        uint64_t now = hal_time_us();
+        if (now - stream_stats_sent_us >= STREAM_STATS_INTERVAL_US) {
+            stats_summary_t summary;
+            get_stats_summary(&summary);
+            memcpy(payload, &summary, sizeof(summary));
+            if (stream_packet(STREAM_STATS, sizeof(summary))) {
+                stream_stats_sent_us = now;
+            }
+        }
     }
 }
 
@@ -501,7 +1548,11 @@ void run_config_command() {
     // we probably shouldn't do this for config read from flash
     // or let's just not write any non-null command to flash
     if (config.command == ConfigCommand::RESET_INTO_BOOTSEL) {
-        reset_usb_boot(0, 0);
+        hal_reset_into_bootloader();
+    }
+    if (config.command == ConfigCommand::RESET_STATS) {
+        reset_usb_stats();
+        stats_reset_requested.store(true, std::memory_order_release);
     }
 }
 
@@ -513,61 +1564,65 @@ bool version_ok(const uint8_t* buffer) {
     return ((config_t*) buffer)->version == CONFIG_VERSION;
 }
 
+// everything but the command and the checksum
+bool same_settings(const config_t* a, const config_t* b) {
+    return a->version == b->version &&
+           !memcmp(&a->sensor_function, &b->sensor_function,
+               offsetof(config_t, crc32) - offsetof(config_t, sensor_function));
+}
+
+// core 0 is the only one that writes it, so no read-modify-write needed
+void config_changed() {
+    config_generation.store(config_generation.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
 void load_config() {
-    if (checksum_ok(FLASH_CONFIG_IN_MEMORY) && version_ok(FLASH_CONFIG_IN_MEMORY)) {
-        memcpy(&config, FLASH_CONFIG_IN_MEMORY, CONFIG_SIZE);
+    const uint8_t* flash_config = config_store_load();
+    if (flash_config != nullptr && checksum_ok(flash_config) && version_ok(flash_config)) {
+        memcpy(&config, flash_config, CONFIG_SIZE);
+        config_changed();
     }
 }
 
 void persist_config() {
-    uint8_t buffer[FLASH_PAGE_SIZE];
-    memset(buffer, 0, sizeof(buffer));
-    memcpy(buffer, &config, CONFIG_SIZE);
-    uint32_t ints = save_and_disable_interrupts();
-    flash_range_erase(CONFIG_OFFSET_IN_FLASH, FLASH_SECTOR_SIZE);
-    flash_range_program(CONFIG_OFFSET_IN_FLASH, buffer, FLASH_PAGE_SIZE);
-    restore_interrupts(ints);
+    config_store_save((const uint8_t*) &config);
+    config_save_pending = false;
 }
 
-int main() {
-    stdio_init_all();
-    board_init();
-    load_config();
-    pins_init();
-    sensors_init();
-    tusb_init();
-
-    while (true) {
-        tud_task();  // tinyusb device task
-        hid_task();
+void config_task() {
+    if (config_save_pending && hal_time_us() >= config_save_at_us) {
+        persist_config();
     }
-
-    return 0;
 }
 
-// Invoked when device is mounted
-void tud_mount_cb() {
+void handle_mount() {
     // reset hi-res scroll for when we reboot from Windows into Linux
     resolution_multiplier = 0;
+    // a new host hasn't seen any buttons, the ones held down go out again
+    report.buttons = 0;
+    // a bus reset ends a suspend too
+    handle_resume();
+    // the host starts the stream again if it still wants it
+    if (stream_mask & STREAM_TRACE) {
+        trace_recording.store(false, std::memory_order_relaxed);
+    }
+    stream_mask = 0;
+    stop_frames();
 }
 
-// Invoked when received GET DEVICE DESCRIPTOR
-// Application return pointer to descriptor
-uint8_t const* tud_descriptor_device_cb() {
-    return (uint8_t const*) &desc_device;
+void handle_suspend(bool remote_wakeup_allowed_) {
+    remote_wakeup_allowed = remote_wakeup_allowed_;
+    remote_wakeup_sent = false;
+    remote_wakeup_requested.store(false, std::memory_order_relaxed);
+    usb_suspended.store(true, std::memory_order_relaxed);
 }
 
-// Invoked when received GET HID REPORT DESCRIPTOR
-// Application return pointer to descriptor
-// Descriptor contents must exist long enough for transfer to complete
-uint8_t const* tud_hid_descriptor_report_cb(uint8_t itf) {
-    return desc_hid_report;
+void handle_resume() {
+    usb_suspended.store(false, std::memory_order_relaxed);
+    remote_wakeup_requested.store(false, std::memory_order_relaxed);
 }
 
-// Invoked when received GET_REPORT control request
-// Application must fill buffer report's content and return its length.
-// Return zero will cause the stack to STALL request
-uint16_t tud_hid_get_report_cb(uint8_t itf, uint8_t report_id, hid_report_type_t report_type, uint8_t* buffer, uint16_t reqlen) {
+uint16_t handle_get_report(uint8_t report_id, uint8_t* buffer, uint16_t reqlen) {
     if (report_id == 2 && reqlen >= 1) {
         memcpy(buffer, &resolution_multiplier, 1);
         return 1;
@@ -577,64 +1632,48 @@ uint16_t tud_hid_get_report_cb(uint8_t itf, uint8_t report_id, hid_report_type_t
         memcpy(buffer, &config, CONFIG_SIZE);
         return CONFIG_SIZE;
     }
+    if (report_id == TRACE_REPORT_ID && reqlen >= TRACE_REPORT_SIZE) {
+        return get_trace_report(buffer);
+    }
+    if (report_id == STATS_REPORT_ID && reqlen >= STATS_REPORT_SIZE) {
+        return get_stats_report(buffer);
+    }
+    if (report_id == FRAME_REPORT_ID && reqlen >= FRAME_REPORT_SIZE) {
+        return get_frame_report(buffer);
+    }
 
     return 0;
 }
 
-// Invoked when received SET_REPORT control request or
-// received data on OUT endpoint ( Report ID = 0, Type = 0 )
-void tud_hid_set_report_cb(uint8_t itf, uint8_t report_id, hid_report_type_t report_type, uint8_t const* buffer, uint16_t bufsize) {
+void handle_set_report(uint8_t report_id, const uint8_t* buffer, uint16_t bufsize) {
     if (report_id == 2 && bufsize >= 1) {
         memcpy(&resolution_multiplier, buffer, 1);
     }
     if (report_id == 3 && bufsize >= CONFIG_SIZE) {
         if (checksum_ok(buffer) && version_ok(buffer)) {
+            // commands alone don't need to wear out the flash
+            bool changed = !same_settings(&config, (const config_t*) buffer);
             memcpy(&config, buffer, CONFIG_SIZE);
+            config_changed();
+            // not from the USB callback, config_task() does it
+            if (changed) {
+                config_save_pending = true;
+                config_save_at_us = hal_time_us() + CONFIG_SAVE_DELAY_US;
+            }
+            // resetting would lose it
+            if (config_save_pending && config.command == ConfigCommand::RESET_INTO_BOOTSEL) {
+                persist_config();
+            }
             run_config_command();
-            persist_config();
         }
     }
-}
-
-// Invoked when received GET CONFIGURATION DESCRIPTOR
-// Application return pointer to descriptor
-// Descriptor contents must exist long enough for transfer to complete
-uint8_t const* tud_descriptor_configuration_cb(uint8_t index) {
-    return desc_configuration;
-}
-
-static uint16_t _desc_str[32];
-
-// Invoked when received GET STRING DESCRIPTOR request
-// Application return pointer to descriptor, whose contents must exist long enough for transfer to complete
-uint16_t const* tud_descriptor_string_cb(uint8_t index, uint16_t langid) {
-    uint8_t chr_count;
-
-    if (index == 0) {
-        memcpy(&_desc_str[1], string_desc_arr[0], 2);
-        chr_count = 1;
-    } else {
-        // Note: the 0xEE index string is a Microsoft OS 1.0 Descriptors.
-        // https://docs.microsoft.com/en-us/windows-hardware/drivers/usbcon/microsoft-defined-usb-descriptors
-
-        if (!(index < sizeof(string_desc_arr) / sizeof(string_desc_arr[0])))
-            return NULL;
-
-        const char* str = string_desc_arr[index];
-
-        // Cap at max char
-        chr_count = strlen(str);
-        if (chr_count > 31)
-            chr_count = 31;
-
-        // Convert ASCII string into UTF-16
-        for (uint8_t i = 0; i < chr_count; i++) {
-            _desc_str[1 + i] = str[i];
-        }
+    if (report_id == TRACE_REPORT_ID && bufsize >= 1) {
+        set_trace_report(buffer);
+    }
+    if (report_id == STATS_REPORT_ID && bufsize >= 1) {
+        set_stats_report(buffer);
+    }
+    if (report_id == FRAME_REPORT_ID && bufsize >= 2) {
+        set_frame_report(buffer);
     }
-
-    // first byte is length (including header), second byte is string type
-    _desc_str[0] = (TUSB_DESC_STRING << 8) | (2 * chr_count + 2);
-
-    return _desc_str;
 }
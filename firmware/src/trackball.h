@@ -0,0 +1,131 @@
+#ifndef _TRACKBALL_H_
+#define _TRACKBALL_H_
+
+#include <stdint.h>
+
+#define CONFIG_VERSION 6
+#define CONFIG_SIZE 60
+
+#define NSENSORS 2
+#define NBUTTONS 4
+
+struct __attribute__((packed)) hid_report_t {
+    uint8_t buttons;
+    int16_t dx;
+    int16_t dy;
+    int16_t vwheel;
+    int16_t hwheel;
+};
+
+enum class ButtonFunction : int8_t {
+    NO_FUNCTION = 0,
+    BUTTON1 = 1,
+    BUTTON2 = 2,
+    BUTTON3 = 3,
+    BUTTON4 = 4,
+    BUTTON5 = 5,
+    BUTTON6 = 6,
+    BUTTON7 = 7,
+    BUTTON8 = 8,
+    CLICK_DRAG = 9,
+    SHIFT = 10,
+};
+
+enum class SensorFunction : int8_t {
+    NO_FUNCTION = 0,
+    CURSOR_X = 1,
+    CURSOR_Y = 2,
+    VERTICAL_SCROLL = 3,
+    HORIZONTAL_SCROLL = 4,
+    CURSOR_X_INVERTED = -1,
+    CURSOR_Y_INVERTED = -2,
+    VERTICAL_SCROLL_INVERTED = -3,
+    HORIZONTAL_SCROLL_INVERTED = -4,
+};
+
+enum class ConfigCommand : int8_t {
+    NO_COMMAND = 0,
+    RESET_INTO_BOOTSEL = 1,
+    RESET_STATS = 2,
+};
+
+struct __attribute__((packed)) config_t {
+    uint8_t version;
+    ConfigCommand command;
+    SensorFunction sensor_function[NSENSORS][2];
+    SensorFunction sensor_shifted_function[NSENSORS][2];
+    uint16_t sensor_cpi[NSENSORS];
+    uint16_t sensor_shifted_cpi[NSENSORS];
+    ButtonFunction button_function[NBUTTONS];
+    ButtonFunction button_shifted_function[NBUTTONS];
+    uint8_t sample_rate;  // sensor samples per second / 100
+    // 0 to set the sensors to the CPIs above, rounded to multiples of 100.
+    // Otherwise the sensors stay at this CPI and the CPIs above are applied
+    // in software, so switching between them costs nothing.
+    uint16_t native_cpi;
+    // Sensor rest modes. Once the ball has been still for rest_after[i]
+    // tenths of a second, the sensors go into rest mode i + 1, where they
+    // take a frame every rest_period_ms[i]. Off if rest_after[0] is 0.
+    uint16_t rest_after[3];
+    uint16_t rest_period_ms[3];
+    // Adaptive sampling. Once nothing has moved and no button has been held
+    // for idle_after_ms, the time between samples doubles with every sample
+    // until it's idle_interval_ms, and it's back to sample_rate as soon as
+    // something moves. Off if idle_after_ms is 0, which is the default
+    // unless the sensors' MOTION pins are connected (MOTION_INTERRUPT).
+    uint16_t idle_after_ms;
+    uint8_t idle_interval_ms;
+    // Where the sensors are on the ball, in degrees, for working out how the
+    // ball turns. sensor_elevation is how far up from right under the ball
+    // (90 is level with its center), sensor_azimuth which way from there
+    // (counterclockwise from the right, seen from above) and
+    // sensor_rotation how far the sensor is turned about its own axis
+    // (clockwise seen from above, when it's under the ball). A sensor at 0,
+    // 0, 0 sees cursor X on its X axis and cursor Y, inverted, on its Y axis.
+    int16_t sensor_elevation[NSENSORS];
+    int16_t sensor_azimuth[NSENSORS];
+    int16_t sensor_rotation[NSENSORS];
+    uint32_t crc32;
+};
+
+extern config_t config;
+
+// Called in a loop on the core that reads the sensors (core 1 on the RP2040).
+// Reads the buttons and sensors and queues the result for hid_task().
+void sensor_task();
+
+// How long to wait between sensor_task() calls, from the configured sample
+// rate, or longer while the ball is still or the USB bus is suspended.
+uint32_t sample_interval_us();
+
+// True while sampling less often than configured. Then the sensors noticing
+// motion (the PMW3360's MOTION pin) should start a sample right away.
+bool sample_on_motion();
+
+// Called in a loop on the core that runs USB (core 0 on the RP2040).
+// Sends the accumulated motion whenever the endpoint is ready.
+void hid_task();
+
+// Same core, after hid_task(). Feeds the bulk stream, see stream.h.
+void stream_task();
+
+// Same core. Saves the config to flash some time after it was changed.
+void config_task();
+
+void load_config();
+
+// Puts the logic back in its power-on state, except for the config.
+// Used on the host to replay traces from a known starting point.
+void reset_state();
+
+// USB events and requests, the platform calls these from its USB stack callbacks
+void handle_mount();
+// remote_wakeup_allowed is whether the host lets us wake it up
+void handle_suspend(bool remote_wakeup_allowed);
+void handle_resume();
+uint16_t handle_get_report(uint8_t report_id, uint8_t* buffer, uint16_t reqlen);
+void handle_set_report(uint8_t report_id, const uint8_t* buffer, uint16_t bufsize);
+// a report passed to hal_hid_report() has been sent
+void handle_report_complete(uint8_t report_id);
+
+#endif
@@ -99,11 +99,20 @@
 #define CFG_TUD_CDC               0
 #define CFG_TUD_MSC               0
 #define CFG_TUD_MIDI              0
+#ifdef VENDOR_INTERFACE
+#define CFG_TUD_VENDOR            1
+#else
 #define CFG_TUD_VENDOR            0
+#endif
 
 // HID buffer size Should be sufficient to hold ID (if any) + Data
 #define CFG_TUD_HID_EP_BUFSIZE    64
 
+// vendor FIFO sizes, TX holds the bulk stream while it waits for the host
+#define CFG_TUD_VENDOR_EPSIZE     64
+#define CFG_TUD_VENDOR_TX_BUFSIZE 1024
+#define CFG_TUD_VENDOR_RX_BUFSIZE 64
+
 #ifdef __cplusplus
  }
 #endif